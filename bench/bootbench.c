@@ -0,0 +1,588 @@
+/* -*- Mode: C -*- */
+
+/* Runs the boot path code from standalone/ on the host: inflate over
+   a corpus of kernels and initrds gzipped at levels 1-9, the
+   checksums, memcpy/memset, printf and the multiboot memory
+   allocator. Results can be stored as a baseline and later runs
+   compared against it. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <x86intrin.h>
+
+#include "tinf.h"
+#include <mbi.h>
+#include <mbi-tools.h>
+
+/* The host build of libstand renames what clashes with libc, see
+   SConscript. The rest comes from util.h, which we cannot include
+   next to libc headers. */
+void *stand_memcpy(void *dest, const void *src, size_t n);
+void *stand_memset(void *s, int c, size_t n);
+void  stand_printf(const char *fmt, ...);
+int   mem_select(int kernel, size_t nt_threshold);
+
+enum {
+  MEM_AUTO   = -1,
+  MEM_MOVSB  = 0,
+  MEM_MOVSD  = 1,
+};
+#define MEM_NT_OFF (~(size_t)0)
+
+static unsigned tries = 5;
+
+/* Output of stand_printf ends up here. */
+static size_t printed;
+
+void
+out_write(const char *s, size_t len)
+{
+  (void)s;
+  printed += len;
+}
+
+void
+__exit(unsigned status)
+{
+  fprintf(stderr, "libstand exited with %#x.\n", status);
+  exit(EXIT_FAILURE);
+}
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Results */
+
+struct result {
+  char        name[96];
+  const char *unit;             /* per byte or per call */
+  double      mbs;              /* 0 for calls */
+  double      cycles;           /* TSC cycles per unit */
+};
+
+static struct result results[4096];
+static unsigned nresults;
+
+/** Runs fn tries times and records the fastest run over units. */
+static void
+run(const char *unit, double units, void (*fn)(void *), void *arg,
+    const char *fmt, ...)
+{
+  double   best_time   = 0;
+  uint64_t best_cycles = 0;
+
+  for (unsigned t = 0; t < tries; t++) {
+    double   start  = now();
+    uint64_t cstart = __rdtsc();
+
+    fn(arg);
+
+    uint64_t cycles = __rdtsc() - cstart;
+    double   dur    = now() - start;
+
+    if (t == 0 || dur < best_time) best_time = dur;
+    if (t == 0 || cycles < best_cycles) best_cycles = cycles;
+  }
+
+  if (nresults == sizeof(results)/sizeof(results[0])) {
+    fprintf(stderr, "Too many results.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  struct result *r = &results[nresults++];
+  va_list ap;
+
+  va_start(ap, fmt);
+  vsnprintf(r->name, sizeof(r->name), fmt, ap);
+  va_end(ap);
+
+  r->unit   = unit;
+  r->mbs    = strcmp(unit, "byte") == 0 ? units / best_time / 1e6 : 0;
+  r->cycles = best_cycles / units;
+
+  if (r->mbs)
+    printf("%-48s %9.1f MB/s %8.3f cycles/%s\n", r->name, r->mbs, r->cycles, unit);
+  else
+    printf("%-48s %14s %8.1f cycles/%s\n", r->name, "", r->cycles, unit);
+}
+
+/* Corpus */
+
+static unsigned char *
+read_file(const char *path, size_t *len)
+{
+  FILE *f = fopen(path, "rb");
+  unsigned char *buf = NULL;
+  size_t size = 0;
+
+  if (!f) { perror(path); exit(EXIT_FAILURE); }
+
+  while (true) {
+    buf = realloc(buf, size + (1 << 20));
+    if (!buf) { perror("realloc"); exit(EXIT_FAILURE); }
+
+    size_t got = fread(buf + size, 1, 1 << 20, f);
+    size += got;
+    if (got < (1 << 20))
+      break;
+  }
+
+  fclose(f);
+  *len = size;
+  return buf;
+}
+
+/** Returns path compressed with gzip at level. */
+static unsigned char *
+gzip_file(const char *path, unsigned level, size_t *len)
+{
+  int fds[2];
+  char opt[4];
+
+  snprintf(opt, sizeof(opt), "-%u", level);
+
+  if (pipe(fds) != 0) { perror("pipe"); exit(EXIT_FAILURE); }
+
+  pid_t pid = fork();
+  if (pid < 0) { perror("fork"); exit(EXIT_FAILURE); }
+  if (pid == 0) {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    close(fds[1]);
+    execlp("gzip", "gzip", "-c", "-n", opt, "--", path, (char *)NULL);
+    perror("gzip");
+    _exit(127);
+  }
+
+  close(fds[1]);
+
+  unsigned char *buf = NULL;
+  size_t size = 0;
+  ssize_t got;
+
+  do {
+    buf = realloc(buf, size + (1 << 20));
+    if (!buf) { perror("realloc"); exit(EXIT_FAILURE); }
+    got = read(fds[0], buf + size, 1 << 20);
+    if (got > 0) size += got;
+  } while (got > 0);
+
+  close(fds[0]);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (got < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "gzip -%u %s failed.\n", level, path);
+    exit(EXIT_FAILURE);
+  }
+
+  *len = size;
+  return buf;
+}
+
+static const char *
+basename_of(const char *path)
+{
+  const char *s = strrchr(path, '/');
+  return s ? s + 1 : path;
+}
+
+/* Benchmarks */
+
+struct buffers {
+  unsigned char *src;
+  unsigned char *dst;
+  size_t src_len;
+  size_t dst_len;
+};
+
+static void
+do_inflate(void *arg)
+{
+  struct buffers *b = arg;
+  unsigned int len = b->dst_len;
+
+  if (tinf_gzip_uncompress(b->dst, &len, b->src, b->src_len) != TINF_OK) {
+    fprintf(stderr, "Inflate failed.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void
+bench_inflate(const char *path, const unsigned char *raw, size_t raw_len,
+              unsigned levels)
+{
+  for (unsigned level = 1; level <= 9; level++) {
+    if (!(levels & (1 << level)))
+      continue;
+
+    struct buffers b;
+
+    b.src     = gzip_file(path, level, &b.src_len);
+    b.dst_len = raw_len;
+    b.dst     = malloc(raw_len + 1);
+    if (!b.dst) { perror("malloc"); exit(EXIT_FAILURE); }
+
+    do_inflate(&b);
+    if (memcmp(b.dst, raw, raw_len) != 0) {
+      fprintf(stderr, "Inflating %s at level %u gives wrong data.\n", path, level);
+      exit(EXIT_FAILURE);
+    }
+
+    run("byte", raw_len, do_inflate, &b, "inflate/%s/gz%u", basename_of(path), level);
+
+    free(b.src);
+    free(b.dst);
+  }
+}
+
+static unsigned checksum;
+
+static void do_crc32(void *arg)   { struct buffers *b = arg; checksum = tinf_crc32(b->src, b->src_len); }
+static void do_adler32(void *arg) { struct buffers *b = arg; checksum = tinf_adler32(b->src, b->src_len); }
+static void do_memcpy(void *arg)  { struct buffers *b = arg; stand_memcpy(b->dst, b->src, b->src_len); }
+static void do_memset(void *arg)  { struct buffers *b = arg; stand_memset(b->dst, 0x5a, b->src_len); }
+
+static void
+bench_checksums(struct buffers *b)
+{
+  static const struct { int kernel; const char *name; } crc32[] = {
+    { TINF_CRC32_NIBBLE, "nibble" },
+    { TINF_CRC32_SLICE8, "slice8" },
+    { TINF_CRC32_PCLMUL, "pclmul" },
+  }, adler32[] = {
+    { TINF_ADLER32_SCALAR, "scalar" },
+    { TINF_ADLER32_SSSE3,  "ssse3" },
+    { TINF_ADLER32_AVX2,   "avx2" },
+  };
+
+  /* Every kernel has to agree with the plain loops. */
+  tinf_crc32_select(TINF_CRC32_NIBBLE);
+  unsigned crc32_ref = tinf_crc32(b->src, b->src_len);
+  tinf_adler32_select(TINF_ADLER32_SCALAR);
+  unsigned adler32_ref = tinf_adler32(b->src, b->src_len);
+
+  for (unsigned k = 0; k < sizeof(crc32)/sizeof(crc32[0]); k++) {
+    if (tinf_crc32_select(crc32[k].kernel) != crc32[k].kernel)
+      continue;
+
+    do_crc32(b);
+    if (checksum != crc32_ref) {
+      fprintf(stderr, "crc32/%s gives %08x instead of %08x.\n", crc32[k].name,
+              checksum, crc32_ref);
+      exit(EXIT_FAILURE);
+    }
+    run("byte", b->src_len, do_crc32, b, "crc32/%s", crc32[k].name);
+  }
+
+  for (unsigned k = 0; k < sizeof(adler32)/sizeof(adler32[0]); k++) {
+    if (tinf_adler32_select(adler32[k].kernel) != adler32[k].kernel)
+      continue;
+
+    do_adler32(b);
+    if (checksum != adler32_ref) {
+      fprintf(stderr, "adler32/%s gives %08x instead of %08x.\n", adler32[k].name,
+              checksum, adler32_ref);
+      exit(EXIT_FAILURE);
+    }
+    run("byte", b->src_len, do_adler32, b, "adler32/%s", adler32[k].name);
+  }
+
+  tinf_crc32_select(TINF_CRC32_AUTO);
+  tinf_adler32_select(TINF_ADLER32_AUTO);
+}
+
+static void
+bench_mem(struct buffers *b)
+{
+  static const struct { int kernel; size_t nt; const char *name; } kernels[] = {
+    { MEM_MOVSB, MEM_NT_OFF, "movsb" },
+    { MEM_MOVSD, MEM_NT_OFF, "movsd" },
+    { MEM_MOVSB, 128,        "nt" },
+  };
+
+  for (unsigned k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++) {
+    mem_select(kernels[k].kernel, kernels[k].nt);
+
+    memset(b->dst, 0, b->src_len);
+    do_memcpy(b);
+    if (memcmp(b->dst, b->src, b->src_len) != 0) {
+      fprintf(stderr, "memcpy/%s gives wrong data.\n", kernels[k].name);
+      exit(EXIT_FAILURE);
+    }
+    run("byte", b->src_len, do_memcpy, b, "memcpy/%s", kernels[k].name);
+
+    do_memset(b);
+    for (size_t i = 0; i < b->src_len; i++)
+      if (b->dst[i] != 0x5a) {
+        fprintf(stderr, "memset/%s gives wrong data at %zu.\n", kernels[k].name, i);
+        exit(EXIT_FAILURE);
+      }
+    run("byte", b->src_len, do_memset, b, "memset/%s", kernels[k].name);
+  }
+
+  mem_select(MEM_AUTO, 0);
+}
+
+enum { PRINTF_LINES = 20000 };
+
+static void
+do_printf(void *arg)
+{
+  (void)arg;
+  for (unsigned i = 0; i < PRINTF_LINES; i++)
+    stand_printf("%3u: start %08x end %016llx len %10llu %s\n", i, i * 4096,
+                 (unsigned long long)i << 32, (unsigned long long)i * 1000003, "module");
+}
+
+static void
+bench_printf(void)
+{
+  printed = 0;
+  do_printf(NULL);
+  run("byte", printed, do_printf, NULL, "printf");
+}
+
+/* A fragmented memory map in memory a 32-bit struct mbi can point
+   to. Only the last quarter of the entries is large enough for the
+   allocations. */
+enum { MAP_ENTRIES = 4096, ALLOCS = 1000 };
+
+struct fake_mbi {
+  struct mbi   mbi;
+  memory_map_t map[MAP_ENTRIES];
+  memory_map_t pristine[MAP_ENTRIES];
+};
+
+static struct fake_mbi *
+fake_mbi_create(void)
+{
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef __x86_64__
+  flags |= MAP_32BIT;
+#endif
+  struct fake_mbi *f = mmap(NULL, sizeof(*f), PROT_READ | PROT_WRITE, flags, -1, 0);
+
+  if (f == MAP_FAILED) { perror("mmap"); exit(EXIT_FAILURE); }
+
+  memset(&f->mbi, 0, sizeof(f->mbi));
+  f->mbi.flags       = MBI_FLAG_MMAP;
+  f->mbi.mmap_addr   = (uintptr_t)f->map;
+  f->mbi.mmap_length = sizeof(f->map);
+
+  for (unsigned i = 0; i < MAP_ENTRIES; i++) {
+    uint64_t base = 0x100000ULL + i * 0xC0000ULL;
+    uint64_t len  = (i & 1) ? 0x1000 : (i < MAP_ENTRIES * 3 / 4) ? 0x4000 : 0x80000;
+
+    f->pristine[i] = (memory_map_t){ sizeof(memory_map_t) - sizeof(uint32_t),
+                                     base, base >> 32, len, 0,
+                                     (i & 1) ? 2 /* reserved */ : MMAP_AVAILABLE };
+  }
+
+  memcpy(f->map, f->pristine, sizeof(f->map));
+  return f;
+}
+
+static void
+do_find_memory(void *arg)
+{
+  struct fake_mbi *f = arg;
+  void  *start;
+  size_t len;
+
+  for (unsigned i = 0; i < ALLOCS; i++)
+    if (!mbi_find_memory(&f->mbi, 0x10000, &start, &len, true, ~0ULL)) {
+      fprintf(stderr, "mbi_find_memory failed.\n");
+      exit(EXIT_FAILURE);
+    }
+}
+
+static void
+do_alloc(void *arg)
+{
+  struct fake_mbi *f = arg;
+
+  memcpy(f->map, f->pristine, sizeof(f->map));
+  for (unsigned i = 0; i < ALLOCS; i++)
+    mbi_alloc_protected_memory(&f->mbi, 0x10000, 12);
+}
+
+static void
+bench_mbi(void)
+{
+  struct fake_mbi *f = fake_mbi_create();
+
+  run("call", ALLOCS, do_find_memory, f, "mbi_find_memory/%u", MAP_ENTRIES);
+  run("call", ALLOCS, do_alloc, f, "mbi_alloc_protected_memory/%u", MAP_ENTRIES);
+
+  munmap(f, sizeof(*f));
+}
+
+/* Baselines */
+
+static void
+write_baseline(const char *path)
+{
+  FILE *f = fopen(path, "w");
+
+  if (!f) { perror(path); exit(EXIT_FAILURE); }
+  for (unsigned i = 0; i < nresults; i++)
+    fprintf(f, "%s %.4f %s\n", results[i].name, results[i].cycles, results[i].unit);
+  fclose(f);
+}
+
+/** Returns the number of results that are more than threshold
+    percent slower than in the baseline. */
+static unsigned
+compare_baseline(const char *path, double threshold)
+{
+  FILE *f = fopen(path, "r");
+  char name[96], unit[16];
+  double cycles;
+  unsigned regressions = 0;
+
+  if (!f) { perror(path); exit(EXIT_FAILURE); }
+
+  printf("\nCompared to %s:\n", path);
+  while (fscanf(f, "%95s %lf %15s", name, &cycles, unit) == 3) {
+    const struct result *r = NULL;
+
+    for (unsigned i = 0; i < nresults; i++)
+      if (strcmp(results[i].name, name) == 0)
+        r = &results[i];
+
+    if (!r)
+      continue;
+
+    double change = (r->cycles - cycles) / cycles * 100;
+    bool slower   = change > threshold;
+
+    printf("%-48s %10.3f -> %10.3f cycles/%-4s %+7.1f%% %s\n", name, cycles,
+           r->cycles, unit, change, slower ? "REGRESSION" : "");
+    regressions += slower;
+  }
+
+  fclose(f);
+  return regressions;
+}
+
+/** Parses levels like 1,6,9 or 1-9 into a bit mask. */
+static unsigned
+parse_levels(const char *s)
+{
+  unsigned mask = 0;
+
+  while (*s) {
+    char *end;
+    unsigned from = strtoul(s, &end, 10);
+    unsigned to   = from;
+
+    if (*end == '-')
+      to = strtoul(end + 1, &end, 10);
+    for (unsigned l = from; l <= to && l <= 9; l++)
+      mask |= 1 << l;
+
+    if (*end != ',')
+      break;
+    s = end + 1;
+  }
+
+  return mask & 0x3FE;
+}
+
+static const char usage[] =
+  "Usage: %s [-n tries] [-l levels] [-w baseline] [-c baseline [-t percent]] file...\n"
+  "  Inflates each file gzipped at the given levels (default 1-9) and runs\n"
+  "  the checksums and memcpy/memset over all of them. -w stores the results,\n"
+  "  -c compares against stored ones and fails if any is more than percent\n"
+  "  (default 5) slower.\n";
+
+int
+main(int argc, char **argv)
+{
+  const char *write_path   = NULL;
+  const char *compare_path = NULL;
+  double      threshold    = 5;
+  unsigned    levels       = parse_levels("1-9");
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:l:w:c:t:")) != -1) {
+    switch (opt) {
+    case 'n': tries        = strtoul(optarg, NULL, 0); break;
+    case 'l': levels       = parse_levels(optarg);     break;
+    case 'w': write_path   = optarg;                   break;
+    case 'c': compare_path = optarg;                   break;
+    case 't': threshold    = strtod(optarg, NULL);     break;
+    default:
+      fprintf(stderr, usage, argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind == argc || tries == 0) {
+    fprintf(stderr, usage, argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  tinf_init();
+
+  /* All files back to back for the content independent routines. */
+  struct buffers all = { NULL, NULL, 0, 0 };
+
+  for (int i = optind; i < argc; i++) {
+    size_t len;
+    unsigned char *raw = read_file(argv[i], &len);
+
+    if (len > 0xFFFFFFFFU) {
+      fprintf(stderr, "%s is too large for tinf.\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+
+    bench_inflate(argv[i], raw, len, levels);
+
+    all.src = realloc(all.src, all.src_len + len);
+    if (!all.src) { perror("realloc"); return EXIT_FAILURE; }
+    memcpy(all.src + all.src_len, raw, len);
+    all.src_len += len;
+    free(raw);
+  }
+
+  if (all.src_len > 0xFFFFFFFFU) {
+    fprintf(stderr, "The corpus is too large for tinf.\n");
+    return EXIT_FAILURE;
+  }
+
+  all.dst = malloc(all.src_len);
+  if (!all.dst) { perror("malloc"); return EXIT_FAILURE; }
+
+  bench_checksums(&all);
+  bench_mem(&all);
+  bench_printf();
+  bench_mbi();
+
+  if (write_path)
+    write_baseline(write_path);
+
+  if (compare_path && compare_baseline(compare_path, threshold) > 0)
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
+
+/* EOF */
@@ -0,0 +1,81 @@
+/* -*- Mode: C -*- */
+
+/* Compares the throughput of the tinf_crc32 kernels on the host. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tinf.h"
+
+static const struct {
+  int kernel;
+  const char *name;
+} kernels[] = {
+  { TINF_CRC32_NIBBLE, "nibble" },
+  { TINF_CRC32_SLICE8, "slice8" },
+  { TINF_CRC32_PCLMUL, "pclmul" },
+};
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char **argv)
+{
+  unsigned size  = (argc > 1) ? strtoul(argv[1], NULL, 0) : 64U << 20;
+  unsigned tries = (argc > 2) ? strtoul(argv[2], NULL, 0) : 5;
+  unsigned char *buf = malloc(size);
+
+  if (!buf) {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  /* Something that does not compress well, like a kernel image. */
+  srand(0);
+  for (unsigned i = 0; i < size; i++)
+    buf[i] = rand();
+
+  unsigned reference = 0;
+  double   nibble_mbs = 0;
+
+  for (unsigned k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++) {
+    if (tinf_crc32_select(kernels[k].kernel) != kernels[k].kernel) {
+      printf("%-8s not supported by this CPU\n", kernels[k].name);
+      continue;
+    }
+
+    unsigned crc  = 0;
+    double   best = 0;
+
+    for (unsigned t = 0; t < tries; t++) {
+      double start = now();
+      crc = tinf_crc32(buf, size);
+      double dur = now() - start;
+      if (best == 0 || dur < best) best = dur;
+    }
+
+    if (kernels[k].kernel == TINF_CRC32_NIBBLE) {
+      reference  = crc;
+      nibble_mbs = size / best / 1e6;
+    }
+
+    printf("%-8s crc %08x %8.1f MB/s %6.1fx %s\n", kernels[k].name, crc,
+           size / best / 1e6, size / best / 1e6 / nibble_mbs,
+           (crc == reference) ? "ok" : "MISMATCH");
+
+    if (crc != reference)
+      return EXIT_FAILURE;
+  }
+
+  free(buf);
+  return EXIT_SUCCESS;
+}
+
+/* EOF */
@@ -0,0 +1,40 @@
+/* -*- Mode: C -*- */
+/*
+ * Boot log ring shared by all loader stages
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* Everything the loaders print also goes into this ring. The first
+   stage puts it into memory it takes from the multiboot memory map
+   and adds an entry of type MMAP_BOOTLOG for it, later stages append
+   to it. Morbo also publishes its address in the ConfigROM, so it
+   can be read over FireWire while we boot. */
+enum {
+  MMAP_BOOTLOG      = 0x674c426d,  /* "mBLg" */
+  BOOTLOG_MAGIC     = 0x674c426d,
+  BOOTLOG_SIZE      = 64 << 10,    /* default, a power of two */
+};
+
+struct bootlog {
+  uint32_t magic;
+  uint32_t size;                   /* of data, a power of two */
+  uint32_t head;                   /* bytes ever written, wraps */
+  uint32_t reserved;
+  char     data[];                 /* byte n is at data[n % size] */
+};
+
+/* EOF */
@@ -57,6 +57,21 @@ struct module
   uint32_t reserved;
 };
 
+/* A stage that moved modules out of the way publishes where they are
+   now in an mmap entry of type MMAP_RELOCATED, so later stages leave
+   them alone. module.reserved stays 0, as the spec wants. */
+enum {
+  MMAP_RELOCATED  = 0x6c65526d, /* "mRel" */
+  RELOCATED_MAGIC = 0x6c65526d,
+};
+
+struct mbi_relocated {
+  uint32_t magic;
+  uint32_t max;                 /* room in mod_start */
+  uint32_t count;
+  uint32_t mod_start[];         /* of the modules that were moved */
+};
+
 typedef struct memory_map
 {
   uint32_t size;
@@ -0,0 +1,61 @@
+/* -*- Mode: C -*- */
+/*
+ * PCI device inventory shared by all loader stages
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* The first stage that looks at PCI enumerates it once and puts the
+   result into memory it takes from the multiboot memory map, with an
+   entry of type MMAP_PCI_INVENTORY. Later stages and the final kernel
+   find devices there instead of probing config space again. */
+enum {
+  MMAP_PCI_INVENTORY     = 0x4943506d,  /* "mPCI" */
+  PCI_INVENTORY_MAGIC    = 0x4943506d,
+  PCI_INVENTORY_MAX      = 512,
+  PCI_INVENTORY_CAPS     = 8,
+
+  PCI_INVENTORY_COMPLETE = 1 << 0,      /* all devices fit */
+
+  PCI_INVENTORY_ROOT     = 0xFFFF,      /* parent of root bus devices */
+};
+
+struct pci_inventory_device {
+  uint32_t cfg_address;         /* 0xCF8 format, bus/dev/fn in bits 8-23 */
+  uint16_t vendor;
+  uint16_t device;
+  uint32_t class_rev;           /* config dword 0x08 */
+  uint8_t  header_type;
+  uint8_t  secondary;           /* bus numbers of bridges */
+  uint8_t  subordinate;
+  uint8_t  ncaps;               /* PCI_INVENTORY_CAPS + 1, if more */
+  uint16_t parent;              /* index of the bridge above us */
+  uint16_t reserved;
+  uint32_t bar[6];              /* as read, not sized */
+  uint8_t  cap_id[PCI_INVENTORY_CAPS];
+  uint8_t  cap_offset[PCI_INVENTORY_CAPS];
+};
+
+struct pci_inventory {
+  uint32_t magic;
+  uint32_t count;
+  uint32_t flags;
+  uint32_t reserved;
+  uint16_t bus_first[256];      /* index of the first device on a bus */
+  struct pci_inventory_device device[];  /* sorted by cfg_address */
+};
+
+/* EOF */
@@ -0,0 +1,48 @@
+/* -*- Mode: C -*- */
+/*
+ * Boot timeline shared by all loader stages
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* The first stage puts the timeline into memory it takes from the
+   multiboot memory map and adds an entry of type MMAP_TIMELINE for
+   it. Later stages and the final kernel find it there. Timestamps
+   are raw TSC values, which keep counting across stages. */
+enum {
+  MMAP_TIMELINE    = 0x6e6c546d,  /* "mTln" */
+  TIMELINE_MAGIC   = 0x6e6c546d,
+  TIMELINE_PHASES  = 96,
+  TIMELINE_NAME    = 16,
+};
+
+struct timeline_phase {
+  char     name[TIMELINE_NAME];   /* NUL-terminated, unless full */
+  uint8_t  depth;                 /* 0 for a stage, nested phases count up */
+  uint8_t  reserved[7];
+  uint64_t begin;
+  uint64_t end;                   /* 0 while still running */
+};
+
+struct timeline {
+  uint32_t magic;
+  uint32_t count;                 /* used entries of phase */
+  uint32_t tsc_khz;               /* calibrated against the PIT */
+  uint32_t reserved;
+  struct timeline_phase phase[TIMELINE_PHASES];
+};
+
+/* EOF */
@@ -65,6 +65,20 @@ struct acpi_table **acpi_get_table_ptr(struct acpi_table *rsdt, const char signa
   return 0;
 }
 
+/**
+ * Return the I/O port of the ACPI PM timer or 0, if there is none.
+ */
+uint16_t acpi_pm_timer_port(void)
+{
+  struct rsdp *rsdp = acpi_get_rsdp();
+  if (!rsdp) return 0;
+
+  struct acpi_table **fadt = acpi_get_table_ptr((struct acpi_table *)rsdp->rsdt, "FACP");
+  if (!fadt || (*fadt)->size < FADT_PM_TMR_BLK + 4) return 0;
+
+  return *(uint32_t *)((char *)*fadt + FADT_PM_TMR_BLK);
+}
+
 /** Duplicate an ACPI table. */
 struct acpi_table *acpi_dup_table(struct acpi_table *rsdt, const char signature[4],
 				  memory_alloc_t alloc)
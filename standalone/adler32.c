@@ -36,17 +36,22 @@
  * Copyright (C) 1995-1998 Jean-loup Gailly and Mark Adler
  */
 
+/*
+ * SSSE3 and AVX2 variants added for Morbo. They follow the block
+ * scheme of Chromium's adler32_simd.c: byte sums with PSADBW, weighted
+ * sums with PMADDUBSW and one modulo per NMAX bytes.
+ */
+
 #include "tinf.h"
 
 #define A32_BASE 65521
 #define A32_NMAX 5552
 
-unsigned int tinf_adler32(const void *data, unsigned int length)
+/* scalar, 16 bytes per iteration */
+static unsigned int tinf_adler32_scalar(unsigned int adler, const unsigned char *buf, unsigned int length)
 {
-   const unsigned char *buf = (const unsigned char *)data;
-
-   unsigned int s1 = 1;
-   unsigned int s2 = 0;
+   unsigned int s1 = adler & 0xffff;
+   unsigned int s2 = adler >> 16;
 
    while (length > 0)
    {
@@ -76,3 +81,229 @@ unsigned int tinf_adler32(const void *data, unsigned int length)
 
    return (s2 << 16) | s1;
 }
+
+#if defined(__i386__) || defined(__x86_64__)
+
+/*
+ * Both vector kernels split the data into blocks of B bytes. Per block
+ * s1 grows by the byte sum and s2 by B times the old s1 plus the byte
+ * sum weighted B..1. The old s1 values are collected in ps and
+ * multiplied by B once, after at most NMAX / B blocks.
+ */
+
+typedef char TINF_V16QI __attribute__((vector_size(16)));
+typedef short TINF_V8HI __attribute__((vector_size(16)));
+typedef unsigned int TINF_V4SU __attribute__((vector_size(16)));
+
+typedef char TINF_V32QI __attribute__((vector_size(32)));
+typedef short TINF_V16HI __attribute__((vector_size(32)));
+typedef unsigned int TINF_V8SU __attribute__((vector_size(32)));
+
+/* SSSE3, 32 bytes per block */
+__attribute__((target("ssse3")))
+static unsigned int tinf_adler32_ssse3(unsigned int adler, const unsigned char *buf, unsigned int length)
+{
+   const TINF_V16QI tap1 = { 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17 };
+   const TINF_V16QI tap2 = { 16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1 };
+   const TINF_V16QI zero = { 0 };
+   const TINF_V8HI ones = { 1, 1, 1, 1, 1, 1, 1, 1 };
+   unsigned int s1 = adler & 0xffff;
+   unsigned int s2 = adler >> 16;
+   unsigned int blocks = length / 32;
+
+   length %= 32;
+
+   while (blocks)
+   {
+      unsigned int n = blocks < A32_NMAX / 32 ? blocks : A32_NMAX / 32;
+      TINF_V4SU vps = { s1 * n, 0, 0, 0 };
+      TINF_V4SU vs1 = { 0 };
+      TINF_V4SU vs2 = { s2, 0, 0, 0 };
+
+      blocks -= n;
+
+      do {
+         TINF_V16QI b1, b2;
+
+         __builtin_memcpy(&b1, buf, 16);
+         __builtin_memcpy(&b2, buf + 16, 16);
+
+         vps += vs1;
+         vs1 += (TINF_V4SU)__builtin_ia32_psadbw128(b1, zero);
+         vs1 += (TINF_V4SU)__builtin_ia32_psadbw128(b2, zero);
+         vs2 += (TINF_V4SU)__builtin_ia32_pmaddwd128(__builtin_ia32_pmaddubsw128(b1, tap1), ones);
+         vs2 += (TINF_V4SU)__builtin_ia32_pmaddwd128(__builtin_ia32_pmaddubsw128(b2, tap2), ones);
+
+         buf += 32;
+      } while (--n);
+
+      vs2 += vps << 5;
+
+      /* PSADBW leaves its sums in lanes 0 and 2 */
+      s1 += vs1[0] + vs1[2];
+      s2 = vs2[0] + vs2[1] + vs2[2] + vs2[3];
+
+      s1 %= A32_BASE;
+      s2 %= A32_BASE;
+   }
+
+   return tinf_adler32_scalar((s2 << 16) | s1, buf, length);
+}
+
+/* AVX2, 64 bytes per block */
+__attribute__((target("avx2")))
+static unsigned int tinf_adler32_avx2(unsigned int adler, const unsigned char *buf, unsigned int length)
+{
+   const TINF_V32QI tap1 = { 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49,
+                             48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33 };
+   const TINF_V32QI tap2 = { 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                             16, 15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1 };
+   const TINF_V32QI zero = { 0 };
+   const TINF_V16HI ones = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+   unsigned int s1 = adler & 0xffff;
+   unsigned int s2 = adler >> 16;
+   unsigned int blocks = length / 64;
+
+   length %= 64;
+
+   while (blocks)
+   {
+      unsigned int n = blocks < A32_NMAX / 64 ? blocks : A32_NMAX / 64;
+      TINF_V8SU vps = { s1 * n };
+      TINF_V8SU vs1 = { 0 };
+      TINF_V8SU vs2 = { s2 };
+
+      blocks -= n;
+
+      do {
+         TINF_V32QI b1, b2;
+
+         __builtin_memcpy(&b1, buf, 32);
+         __builtin_memcpy(&b2, buf + 32, 32);
+
+         vps += vs1;
+         vs1 += (TINF_V8SU)__builtin_ia32_psadbw256(b1, zero);
+         vs1 += (TINF_V8SU)__builtin_ia32_psadbw256(b2, zero);
+         vs2 += (TINF_V8SU)__builtin_ia32_pmaddwd256(__builtin_ia32_pmaddubsw256(b1, tap1), ones);
+         vs2 += (TINF_V8SU)__builtin_ia32_pmaddwd256(__builtin_ia32_pmaddubsw256(b2, tap2), ones);
+
+         buf += 64;
+      } while (--n);
+
+      vs2 += vps << 6;
+
+      s1 += vs1[0] + vs1[2] + vs1[4] + vs1[6];
+      s2 = vs2[0] + vs2[1] + vs2[2] + vs2[3] +
+           vs2[4] + vs2[5] + vs2[6] + vs2[7];
+
+      s1 %= A32_BASE;
+      s2 %= A32_BASE;
+   }
+
+   /* finish with SSSE3, which any AVX2 CPU has */
+   return tinf_adler32_ssse3((s2 << 16) | s1, buf, length);
+}
+
+/* check CPUID for SSSE3 support */
+static int tinf_has_ssse3(void)
+{
+   unsigned int r[4];
+
+   tinf_cpuid(1, r);
+
+   return (r[2] >> 9) & 1;
+}
+
+/* check CPUID for AVX2 support and that the YMM state is enabled */
+static int tinf_has_avx2(void)
+{
+   unsigned int r[4], xcr0, edx;
+
+   tinf_cpuid(0, r);
+   if (r[0] < 7) return 0;
+
+   /* OSXSAVE and AVX */
+   tinf_cpuid(1, r);
+   if ((r[2] & 0x18000000) != 0x18000000) return 0;
+
+   __asm__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+   if ((xcr0 & 6) != 6) return 0;
+
+   tinf_cpuid(7, r);
+
+   return (r[1] >> 5) & 1;
+}
+
+#endif
+
+static unsigned int tinf_adler32_first(unsigned int adler, const unsigned char *buf, unsigned int length);
+
+static unsigned int (*tinf_adler32_kernel)(unsigned int, const unsigned char *, unsigned int) = tinf_adler32_first;
+
+/* pick a kernel on the first call */
+static unsigned int tinf_adler32_first(unsigned int adler, const unsigned char *buf, unsigned int length)
+{
+   tinf_adler32_select(TINF_ADLER32_AUTO);
+
+   return tinf_adler32_kernel(adler, buf, length);
+}
+
+/* use the given kernel, or the fastest one for TINF_ADLER32_AUTO, and
+   return the kernel in use; kernels the CPU lacks fall back to the
+   next slower one */
+int tinf_adler32_select(int kernel)
+{
+   if (kernel == TINF_ADLER32_AUTO) kernel = TINF_ADLER32_AVX2;
+
+#if defined(__i386__) || defined(__x86_64__)
+   if (kernel == TINF_ADLER32_AVX2)
+   {
+      if (tinf_has_avx2())
+      {
+         tinf_adler32_kernel = tinf_adler32_avx2;
+         return kernel;
+      }
+      kernel = TINF_ADLER32_SSSE3;
+   }
+
+   if (kernel == TINF_ADLER32_SSSE3 && tinf_has_ssse3())
+   {
+      tinf_adler32_kernel = tinf_adler32_ssse3;
+      return kernel;
+   }
+#endif
+
+   tinf_adler32_kernel = tinf_adler32_scalar;
+
+   return TINF_ADLER32_SCALAR;
+}
+
+/* continue adler, the Adler-32 of the preceding data, over length bytes */
+unsigned int tinf_adler32_update(unsigned int adler, const void *data, unsigned int length)
+{
+   return tinf_adler32_kernel(adler, (const unsigned char *)data, length);
+}
+
+unsigned int tinf_adler32(const void *data, unsigned int length)
+{
+   return tinf_adler32_update(1, data, length);
+}
+
+/* the Adler-32 of two pieces joined, from adler1 of the first piece,
+   adler2 of the second and the length of the second */
+unsigned int tinf_adler32_combine(unsigned int adler1, unsigned int adler2, unsigned int length2)
+{
+   unsigned int rem = length2 % A32_BASE;
+   unsigned int s1 = adler1 & 0xffff;
+   unsigned int s2 = (rem * s1) % A32_BASE;
+
+   s1 += (adler2 & 0xffff) + A32_BASE - 1;
+   s2 += (adler1 >> 16) + (adler2 >> 16) + A32_BASE - rem;
+
+   if (s1 >= A32_BASE) s1 -= A32_BASE;
+   if (s1 >= A32_BASE) s1 -= A32_BASE;
+   if (s2 >= 2 * A32_BASE) s2 -= 2 * A32_BASE;
+   if (s2 >= A32_BASE) s2 -= A32_BASE;
+
+   return (s2 << 16) | s1;
+}
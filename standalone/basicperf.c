@@ -6,6 +6,7 @@
 #include <version.h>
 #include <serial.h>
 #include <mbi-tools.h>
+#include <dispatch.h>
 
 static void
 t_empty(void)
@@ -73,6 +74,78 @@ static float sqrtf(float v)
   return v;
 }
 
+/* memcpy/memset bandwidth */
+
+struct mem_test {
+  const char *name;
+  int kernel;
+  size_t nt_threshold;
+};
+
+static const struct mem_test mem_tests[] = {
+  { "movsb", MEM_MOVSB, MEM_NT_OFF },
+  { "movsd", MEM_MOVSD, MEM_NT_OFF },
+  { "nt   ", MEM_AUTO,  1 },
+};
+
+static const size_t mem_sizes[] = { 64 << 10, 64 << 20 };
+
+/** Returns the best of a few runs in bytes per 1000 cycles. */
+static uint32_t
+mem_bandwidth(bool copy, char *dst, const char *src, size_t len)
+{
+  uint64_t best = ~0ULL;
+
+  for (unsigned i = 0; i < 5; i++) {
+    uint64_t start = rdtsc();
+    if (copy)
+      memcpy(dst, src, len);
+    else
+      memset(dst, i, len);
+    uint64_t dur = rdtsc() - start;
+
+    /* The first round warms up caches and TLB. */
+    if (i > 0)
+      best = MIN(best, dur);
+  }
+
+  return (uint64_t)len * 1000 / best;
+}
+
+static void
+mem_tests_run(struct mbi *mbi)
+{
+  size_t max = mem_sizes[sizeof(mem_sizes)/sizeof(mem_sizes[0]) - 1];
+  void *block;
+  size_t block_len;
+
+  if (!mbi_find_memory(mbi, 2 * max, &block, &block_len, true, 1ULL << 32)) {
+    printf("No memory for the memcpy test.\n");
+    return;
+  }
+
+  char *dst = block;
+  char *src = dst + max;
+
+  for (unsigned i = 0; i < sizeof(mem_tests)/sizeof(mem_tests[0]); i++) {
+    mem_select(mem_tests[i].kernel, mem_tests[i].nt_threshold);
+
+    for (unsigned j = 0; j < sizeof(mem_sizes)/sizeof(mem_sizes[0]); j++) {
+      size_t len = mem_sizes[j];
+
+      printf("! PERF: memcpy %s %6uK %u bytes/kcycle ok\n", mem_tests[i].name,
+             len >> 10, mem_bandwidth(true, dst, src, len));
+      printf("! PERF: memset %s %6uK %u bytes/kcycle ok\n", mem_tests[i].name,
+             len >> 10, mem_bandwidth(false, dst, src, len));
+    }
+  }
+
+  int kernel = mem_select(MEM_AUTO, 0);
+  printf("memcpy/memset use %s, non-temporal from %uK.\n",
+         kernel == MEM_MOVSB ? "rep movsb" : "rep movsd",
+         mem_nt_threshold == MEM_NT_OFF ? 0 : mem_nt_threshold >> 10);
+}
+
 int
 main(uint32_t magic, struct mbi *mbi)
 {
@@ -83,9 +156,13 @@ main(uint32_t magic, struct mbi *mbi)
     return 1;
   }
 
+  console_configure(mbi);
+
   printf("\nbasicperf %s\n", version_str);
   printf("Blame Julian Stecklina <jsteckli@os.inf.tu-dresden.de> for bugs.\n\n");
 
+  cpu_dispatch(mbi);
+
   printf("Testing \"Basic VM performance\" in %s:\n", __FILE__);
 
   static const unsigned max_stddev = 1000;
@@ -133,6 +210,10 @@ main(uint32_t magic, struct mbi *mbi)
     printf("! PERF: %s %u cycles (retries=%u stddev=%u min=%u max=%u) ok\n",
            tests[i].name, (uint32_t)mean, retries, (uint32_t)stddev, min, max);
   }
+
+  printf("Testing \"memcpy/memset bandwidth\" in %s:\n", __FILE__);
+  mem_tests_run(mbi);
+
   printf("wvtest: done\n");
 
   return 0;
@@ -7,6 +7,9 @@
 #include <version.h>
 #include <serial.h>
 #include <bda.h>
+#include <dispatch.h>
+#include <timeline-tools.h>
+#include <bootlog-tools.h>
 
 /* Configuration (set by command line parser) */
 static bool be_promisc = false;
@@ -56,6 +59,10 @@ main(uint32_t magic, struct mbi *mbi)
   if (magic == MBI_MAGIC) {
     if ((mbi->flags & MBI_FLAG_CMDLINE) != 0)
       parse_cmdline((const char *)mbi->cmdline);
+    console_configure(mbi);
+    timeline_init(mbi, "bender");
+    bootlog_init(mbi);
+    pci_inventory_init(mbi);
   } else {
     printf("Not loaded by Multiboot-compliant loader. Bye.\n");
     return 1;
@@ -64,6 +71,8 @@ main(uint32_t magic, struct mbi *mbi)
   printf("\nBender %s\n", version_str);
   printf("Blame Julian Stecklina <jsteckli@os.inf.tu-dresden.de> for bugs.\n\n");
 
+  cpu_dispatch(mbi);
+
   printf("Looking for serial controllers on the PCI bus...\n");
 
   struct pci_device serial_ctrl;
@@ -0,0 +1,107 @@
+/* -*- Mode: C -*- */
+/*
+ * Boot log ring.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <bootlog-tools.h>
+#include <mbi-tools.h>
+#include <util.h>
+
+enum {
+  BOOTLOG_MAX = 16 << 20,
+};
+
+static struct bootlog *bootlog;
+
+/** Returns the ring size from the command line, 0 if it is off. */
+static size_t
+bootlog_size(const struct mbi *mbi)
+{
+  size_t size = BOOTLOG_SIZE;
+
+  if ((mbi->flags & MBI_FLAG_CMDLINE) == 0)
+    return size;
+
+  char *last_ptr = NULL;
+  char cmdline_buf[256];
+  char *token;
+
+  strncpy(cmdline_buf, (const char *)mbi->cmdline, sizeof(cmdline_buf));
+  cmdline_buf[sizeof(cmdline_buf) - 1] = 0;
+
+  for (token = strtok_r(cmdline_buf, " ", &last_ptr);
+       token != NULL;
+       token = strtok_r(NULL, " ", &last_ptr)) {
+    if (strncmp(token, "bootlog=", 8) == 0)
+      size = MIN(strtoull(token + 8, NULL, 0), BOOTLOG_MAX >> 10) << 10;
+  }
+
+  /* Round up to a power of two, so byte counts may wrap. */
+  if (size & (size - 1)) {
+    size_t p = 1;
+    while (p < size)
+      p <<= 1;
+    size = p;
+  }
+
+  return size;
+}
+
+void
+bootlog_init(struct mbi *mbi)
+{
+  if ((mbi->flags & MBI_FLAG_MMAP) == 0)
+    return;
+
+  struct bootlog *b = mbi_find_published(mbi, MMAP_BOOTLOG);
+  if (b && b->magic == BOOTLOG_MAGIC) {
+    bootlog = b;
+    return;
+  }
+
+  size_t size = bootlog_size(mbi);
+  if (size == 0)
+    return;
+
+  b = mbi_publish_memory(mbi, sizeof(*b) + size, MMAP_BOOTLOG);
+  b->size     = size;
+  b->head     = 0;
+  b->reserved = 0;
+  memory_barrier();
+  b->magic    = BOOTLOG_MAGIC;
+  bootlog = b;
+}
+
+void
+bootlog_putc(unsigned c)
+{
+  struct bootlog *b = bootlog;
+
+  if (!b)
+    return;
+
+  b->data[b->head & (b->size - 1)] = c;
+
+  /* Readers over FireWire see the byte before the head moves. */
+  memory_barrier();
+  b->head++;
+}
+
+struct bootlog *
+bootlog_get(void)
+{
+  return bootlog;
+}
+
+/* EOF */
@@ -0,0 +1,65 @@
+/* -*- Mode: C -*- */
+/*
+ * Module codecs.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <codec.h>
+#include <tinf.h>
+#include <util.h>
+
+static bool
+gzip_size(const void *src, size_t len, size_t *out_len)
+{
+  unsigned int size;
+
+  if (tinf_gzip_uncompress(NULL, &size, src, len) != TINF_OK)
+    return false;
+
+  *out_len = size;
+  return true;
+}
+
+static bool
+gzip_decode(void *dst, size_t dst_len, const void *src, size_t len,
+            void *scratch)
+{
+  unsigned int size = dst_len;
+
+  return tinf_gzip_uncompress_data(scratch, dst, &size, src, len) == TINF_OK &&
+    size == dst_len;
+}
+
+/* Checked in order, so longer magics have to come first, should two
+   ever share a prefix. */
+static const struct codec codecs[] = {
+  { "zstd", { 0x28, 0xB5, 0x2F, 0xFD }, 4, ZSTD_SCRATCH,
+    zstd_size, zstd_decode },
+  { "lz4",  { 0x04, 0x22, 0x4D, 0x18 }, 4, 0,
+    lz4_size,  lz4_decode  },
+  { "gzip", { 0x1F, 0x8B },             2, sizeof(TINF_DATA),
+    gzip_size, gzip_decode },
+};
+
+const struct codec *
+codec_find(const void *src, size_t len)
+{
+  for (unsigned i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++)
+    if (len >= codecs[i].magic_len &&
+        memcmp(src, codecs[i].magic, codecs[i].magic_len) == 0)
+      return &codecs[i];
+
+  return NULL;
+}
+
+/* EOF */
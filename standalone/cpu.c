@@ -0,0 +1,67 @@
+/* -*- Mode: C -*- */
+/*
+ * SIMD register state setup.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <asm.h>
+#include <cpuid.h>
+
+enum {
+  CR0_MP         = 1 << 1,
+  CR0_EM         = 1 << 2,
+  CR0_TS         = 1 << 3,
+
+  CR4_OSFXSR     = 1 << 9,
+  CR4_OSXMMEXCPT = 1 << 10,
+  CR4_OSXSAVE    = 1 << 18,
+
+  XCR0_X87       = 1 << 0,
+  XCR0_SSE       = 1 << 1,
+  XCR0_AVX       = 1 << 2,
+};
+
+/**
+ * Enables the SSE and, if the CPU has XSAVE, the AVX register
+ * state. The multiboot loader leaves CR4 alone, so without this the
+ * first SSE instruction in tinf raises #UD. Called from _start.
+ */
+void
+cpu_enable_simd(void)
+{
+  uint32_t r[4];
+
+  cpuid(1, 0, r);
+
+  uint32_t ecx = r[2];
+  uint32_t edx = r[3];
+
+  if (((edx >> 25) & 1) == 0)   /* SSE */
+    return;
+
+  set_cr0((get_cr0() & ~(CR0_EM | CR0_TS)) | CR0_MP);
+  set_cr4(get_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+
+  if (((ecx >> 26) & 1) == 0)   /* XSAVE */
+    return;
+
+  uint32_t xcr0 = XCR0_X87 | XCR0_SSE;
+
+  if ((ecx >> 28) & 1)          /* AVX */
+    xcr0 |= XCR0_AVX;
+
+  set_cr4(get_cr4() | CR4_OSXSAVE);
+  asm volatile ("xsetbv" :: "a" (xcr0), "d" (0), "c" (0));
+}
+
+/* EOF */
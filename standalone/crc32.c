@@ -36,6 +36,12 @@
  * Copyright (C) 1995-1998 Jean-loup Gailly and Mark Adler
  */
 
+/*
+ * Slice-by-8 and PCLMULQDQ folding variants added for Morbo. The
+ * folding constants and the final reduction follow Intel's "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ */
+
 #include "tinf.h"
 
 static const unsigned int tinf_crc32tab[16] = {
@@ -45,14 +51,16 @@ static const unsigned int tinf_crc32tab[16] = {
    0xbdbdf21c
 };
 
-unsigned int tinf_crc32(const void *data, unsigned int length)
+/* byte tables for slice-by-8, built by tinf_crc32_select */
+static unsigned int tinf_crc32tab8[8][256];
+
+/* the kernels work on the inverted crc register */
+
+/* nibble table, two lookups per byte */
+static unsigned int tinf_crc32_nibble(unsigned int crc, const unsigned char *buf, unsigned int length)
 {
-   const unsigned char *buf = (const unsigned char *)data;
-   unsigned int crc = 0xffffffff;
    unsigned int i;
 
-   if (length == 0) return 0;
-
    for (i = 0; i < length; ++i)
    {
       crc ^= buf[i];
@@ -60,5 +68,198 @@ unsigned int tinf_crc32(const void *data, unsigned int length)
       crc = tinf_crc32tab[crc & 0x0f] ^ (crc >> 4);
    }
 
-   return crc ^ 0xffffffff;
+   return crc;
+}
+
+/* slice-by-8, eight lookups per 8 bytes */
+static unsigned int tinf_crc32_slice8(unsigned int crc, const unsigned char *buf, unsigned int length)
+{
+   const unsigned int (*t)[256] = (const unsigned int (*)[256])tinf_crc32tab8;
+
+   for (; length >= 8; length -= 8, buf += 8)
+   {
+      unsigned int one, two;
+
+      __builtin_memcpy(&one, buf, 4);
+      __builtin_memcpy(&two, buf + 4, 4);
+      one ^= crc;
+
+      crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^
+            t[5][(one >> 16) & 0xff] ^ t[4][one >> 24] ^
+            t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^
+            t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+   }
+
+   for (; length; --length) crc = t[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+   return crc;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+
+typedef long long TINF_V2DI __attribute__((vector_size(16)));
+typedef unsigned int TINF_V4SI __attribute__((vector_size(16)));
+
+__attribute__((target("pclmul,sse2")))
+static TINF_V2DI tinf_load128(const unsigned char *p)
+{
+   TINF_V2DI v;
+
+   __builtin_memcpy(&v, p, 16);
+
+   return v;
+}
+
+/* multiply both halves of x with their constants in k and add */
+__attribute__((target("pclmul,sse2")))
+static TINF_V2DI tinf_fold128(TINF_V2DI x, TINF_V2DI k)
+{
+   return __builtin_ia32_pclmulqdq128(x, k, 0x00) ^
+          __builtin_ia32_pclmulqdq128(x, k, 0x11);
+}
+
+/* carry-less multiply folding over length bytes, length must be a
+   multiple of 16 and at least 64 */
+__attribute__((target("pclmul,sse2")))
+static unsigned int tinf_crc32_fold(unsigned int crc, const unsigned char *buf, unsigned int length)
+{
+   const TINF_V2DI k1k2   = { 0x154442bd4LL, 0x1c6e41596LL };
+   const TINF_V2DI k3k4   = { 0x1751997d0LL, 0x0ccaa009eLL };
+   const TINF_V2DI k5     = { 0x163cd6124LL, 0 };
+   const TINF_V2DI poly   = { 0x1db710641LL, 0x1f7011641LL };
+   const TINF_V2DI mask32 = { 0xffffffffLL, 0 };
+   TINF_V2DI crcv = { crc, 0 };
+   TINF_V2DI x1, x2, x3, x4;
+
+   x1 = tinf_load128(buf) ^ crcv;
+   x2 = tinf_load128(buf + 16);
+   x3 = tinf_load128(buf + 32);
+   x4 = tinf_load128(buf + 48);
+
+   /* fold 64 bytes at a time into four accumulators */
+   for (buf += 64, length -= 64; length >= 64; buf += 64, length -= 64)
+   {
+      x1 = tinf_fold128(x1, k1k2) ^ tinf_load128(buf);
+      x2 = tinf_fold128(x2, k1k2) ^ tinf_load128(buf + 16);
+      x3 = tinf_fold128(x3, k1k2) ^ tinf_load128(buf + 32);
+      x4 = tinf_fold128(x4, k1k2) ^ tinf_load128(buf + 48);
+   }
+
+   /* fold the accumulators and the remaining 16-byte blocks into one */
+   x1 = tinf_fold128(x1, k3k4) ^ x2;
+   x1 = tinf_fold128(x1, k3k4) ^ x3;
+   x1 = tinf_fold128(x1, k3k4) ^ x4;
+
+   for (; length >= 16; buf += 16, length -= 16)
+      x1 = tinf_fold128(x1, k3k4) ^ tinf_load128(buf);
+
+   /* fold 128 to 64 bits */
+   x1 = __builtin_ia32_psrldqi128(x1, 64) ^ __builtin_ia32_pclmulqdq128(k3k4, x1, 0x01);
+
+   /* fold 64 to 32 bits */
+   x2 = __builtin_ia32_psrldqi128(x1, 32);
+   x1 = __builtin_ia32_pclmulqdq128(x1 & mask32, k5, 0x00) ^ x2;
+
+   /* Barrett reduction */
+   x2 = __builtin_ia32_pclmulqdq128(x1 & mask32, poly, 0x10);
+   x2 = __builtin_ia32_pclmulqdq128(x2 & mask32, poly, 0x00);
+   x1 ^= x2;
+
+   return ((TINF_V4SI)x1)[1];
+}
+
+/* PCLMULQDQ folding for the bulk, slice-by-8 for the rest */
+static unsigned int tinf_crc32_pclmul(unsigned int crc, const unsigned char *buf, unsigned int length)
+{
+   if (length >= 64)
+   {
+      unsigned int bulk = length & ~15u;
+
+      crc = tinf_crc32_fold(crc, buf, bulk);
+      buf += bulk;
+      length -= bulk;
+   }
+
+   return tinf_crc32_slice8(crc, buf, length);
+}
+
+/* check CPUID for PCLMULQDQ support */
+static int tinf_has_pclmul(void)
+{
+   unsigned int r[4];
+
+   tinf_cpuid(1, r);
+
+   return (r[2] >> 1) & 1;
+}
+
+#endif
+
+static unsigned int tinf_crc32_first(unsigned int crc, const unsigned char *buf, unsigned int length);
+
+static unsigned int (*tinf_crc32_kernel)(unsigned int, const unsigned char *, unsigned int) = tinf_crc32_first;
+
+/* pick a kernel on the first call */
+static unsigned int tinf_crc32_first(unsigned int crc, const unsigned char *buf, unsigned int length)
+{
+   tinf_crc32_select(TINF_CRC32_AUTO);
+
+   return tinf_crc32_kernel(crc, buf, length);
+}
+
+/* use the given kernel, or the fastest one for TINF_CRC32_AUTO, and
+   return the kernel in use; kernels the CPU lacks fall back to
+   slice-by-8 */
+int tinf_crc32_select(int kernel)
+{
+   static int tables_built;
+
+   if (!tables_built)
+   {
+      unsigned int i, k, crc;
+
+      for (i = 0; i < 256; ++i)
+      {
+         crc = tinf_crc32tab[i & 0x0f] ^ (i >> 4);
+         crc = tinf_crc32tab[crc & 0x0f] ^ (crc >> 4);
+         tinf_crc32tab8[0][i] = crc;
+      }
+
+      for (k = 1; k < 8; ++k)
+         for (i = 0; i < 256; ++i)
+            tinf_crc32tab8[k][i] = (tinf_crc32tab8[k - 1][i] >> 8) ^
+                                   tinf_crc32tab8[0][tinf_crc32tab8[k - 1][i] & 0xff];
+
+      tables_built = 1;
+   }
+
+   if (kernel == TINF_CRC32_AUTO) kernel = TINF_CRC32_PCLMUL;
+
+   switch (kernel)
+   {
+   case TINF_CRC32_NIBBLE:
+      tinf_crc32_kernel = tinf_crc32_nibble;
+      return kernel;
+#if defined(__i386__) || defined(__x86_64__)
+   case TINF_CRC32_PCLMUL:
+      if (!tinf_has_pclmul()) break;
+      tinf_crc32_kernel = tinf_crc32_pclmul;
+      return kernel;
+#endif
+   }
+
+   tinf_crc32_kernel = tinf_crc32_slice8;
+
+   return TINF_CRC32_SLICE8;
+}
+
+/* continue crc, the CRC32 of the preceding data, over length bytes */
+unsigned int tinf_crc32_update(unsigned int crc, const void *data, unsigned int length)
+{
+   return tinf_crc32_kernel(crc ^ 0xffffffff, (const unsigned char *)data, length) ^ 0xffffffff;
+}
+
+unsigned int tinf_crc32(const void *data, unsigned int length)
+{
+   return tinf_crc32_update(0, data, length);
 }
@@ -0,0 +1,133 @@
+/* -*- Mode: C -*- */
+/*
+ * Selection of CPU specific variants of hot routines.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <dispatch.h>
+#include <util.h>
+#include <tinf.h>
+
+#define AUTO (-1)
+
+/* 0 picks the cache size, see mem_select. */
+static size_t mem_nt;
+
+static int
+select_mem(int kernel)
+{
+  return mem_select(kernel, mem_nt);
+}
+
+/* Names are indexed by the kernel constants of each routine. */
+static const char *const mem_names[]     = { "movsb", "movsd" };
+static const char *const crc32_names[]   = { "nibble", "slice8", "pclmul" };
+static const char *const adler32_names[] = { "scalar", "ssse3", "avx2" };
+static const char *const copy_names[]    = { "words", "sse2" };
+
+#define ROUTINE(name, select, names) { name, select, names, sizeof(names)/sizeof(names[0]) }
+
+static const struct routine {
+  const char        *name;
+  int              (*select)(int kernel);
+  const char *const *variants;
+  unsigned           nvariants;
+} routines[] = {
+  ROUTINE("memcpy",  select_mem,          mem_names),
+  ROUTINE("crc32",   tinf_crc32_select,   crc32_names),
+  ROUTINE("adler32", tinf_adler32_select, adler32_names),
+  ROUTINE("inflate", tinf_copy_select,    copy_names),
+};
+
+enum { ROUTINES = sizeof(routines)/sizeof(routines[0]) };
+
+/** Returns the variant number of name or AUTO for "auto". Returns
+    -2, if routine r has no such variant. */
+static int
+variant_by_name(const struct routine *r, const char *name)
+{
+  if (strcmp(name, "auto") == 0)
+    return AUTO;
+
+  for (unsigned i = 0; i < r->nvariants; i++)
+    if (strcmp(name, r->variants[i]) == 0)
+      return i;
+
+  return -2;
+}
+
+/** Handles one routine=variant argument. Other arguments belong to
+    the program and are ignored. */
+static void
+parse_override(char *token, int kernel[ROUTINES])
+{
+  char *value = token;
+
+  while (*value && *value != '=')
+    value++;
+  if (*value == 0)
+    return;
+  *value++ = 0;
+
+  if (strcmp(token, "memcpy_nt") == 0) {
+    mem_nt = strcmp(value, "off") == 0 ? MEM_NT_OFF : strtoull(value, NULL, 0);
+    return;
+  }
+
+  for (unsigned i = 0; i < ROUTINES; i++) {
+    if (strcmp(token, routines[i].name) != 0)
+      continue;
+
+    int v = variant_by_name(&routines[i], value);
+    if (v < AUTO)
+      printf("Unknown %s variant: %s\n", token, value);
+    else
+      kernel[i] = v;
+    return;
+  }
+}
+
+void
+cpu_dispatch(const struct mbi *mbi)
+{
+  int kernel[ROUTINES];
+
+  for (unsigned i = 0; i < ROUTINES; i++)
+    kernel[i] = AUTO;
+
+  if (mbi && (mbi->flags & MBI_FLAG_CMDLINE)) {
+    char *last_ptr = NULL;
+    char cmdline_buf[256];
+    char *token;
+
+    strncpy(cmdline_buf, (const char *)mbi->cmdline, sizeof(cmdline_buf));
+    cmdline_buf[sizeof(cmdline_buf) - 1] = 0;
+
+    for (token = strtok_r(cmdline_buf, " ", &last_ptr);
+         token != NULL;
+         token = strtok_r(NULL, " ", &last_ptr))
+      parse_override(token, kernel);
+  }
+
+  printf("Dispatch:");
+  for (unsigned i = 0; i < ROUTINES; i++)
+    printf(" %s=%s", routines[i].name,
+           routines[i].variants[routines[i].select(kernel[i])]);
+
+  if (mem_nt_threshold == MEM_NT_OFF)
+    printf(" memcpy_nt=off\n");
+  else
+    printf(" memcpy_nt=%u\n", mem_nt_threshold);
+}
+
+/* EOF */
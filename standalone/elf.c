@@ -15,6 +15,10 @@
 #include <elf.h>
 #include <util.h>
 #include <mbi-tools.h>
+#include <tinf.h>
+#include <smp.h>
+#include <timeline-tools.h>
+#include <vga.h>
 
 enum {
   EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI
@@ -57,18 +61,432 @@ gen_elf_segment(uint8_t **code, uintptr_t target, void *src, size_t len,
   byte_out(code, 0xAA);         /* STOSB */
 }
 
+/* Direct loading of gzip'd ELF modules */
+
+enum {
+  ELF_MAX_SEGMENTS = 16,
+
+  /* The code that copies the segments of a plain ELF into place. It
+     fits into TRAMPOLINE_SIZE for ELF_MAX_SEGMENTS segments. */
+  TRAMPOLINE       = 0x7C00,
+  TRAMPOLINE_SIZE  = 0x400,
+};
+
+struct elf_segment {
+  uint64_t offset;
+  uint64_t paddr;
+  uint64_t filesz;
+  uint64_t memsz;
+};
+
+struct elf_image {
+  unsigned head_len;            /* Bytes of the file in elf_head. */
+  uint64_t pos;                 /* File offset of the stream. */
+  unsigned sum;                 /* CRC32 of the file up to pos. */
+  uint32_t entry;
+  unsigned nseg;
+  struct elf_segment seg[ELF_MAX_SEGMENTS]; /* Sorted by offset. */
+};
+
+extern char _image_start[], _image_end[];
+
+static TINF_STREAM elf_stream;
+static uint8_t elf_head[4096];    /* Start of the inflated file. */
+static uint8_t elf_scratch[4096]; /* Sink for bytes outside segments. */
+
+static bool
+overlaps(uint64_t a, uint64_t a_len, uint64_t b, uint64_t b_len)
+{
+  return a < b + b_len && b < a + a_len;
+}
+
+/**
+ * Starts inflating the module and reads the head of the file into
+ * elf_head.
+ */
+static bool
+elf_gz_open(struct module *m, struct elf_image *img)
+{
+  unsigned len = m->mod_end - m->mod_start;
+  unsigned hlen;
+
+  if (tinf_gzip_header((void *)m->mod_start, len, &hlen) != TINF_OK)
+    return false;
+
+  img->sum = 0;
+  tinf_stream_init(&elf_stream, tinf_crc32_update, &img->sum);
+  tinf_stream_feed(&elf_stream, (void *)(m->mod_start + hlen), len - hlen);
+
+  img->head_len = sizeof(elf_head);
+  if (tinf_stream_drain(&elf_stream, elf_head, &img->head_len) == TINF_DATA_ERROR)
+    return false;
+
+  img->pos = img->head_len;
+  return true;
+}
+
+/**
+ * Collects the PT_LOAD segments from the program headers in
+ * elf_head. Fails for anything the stream cannot serve in one pass.
+ */
+static bool
+elf_gz_parse(struct elf_image *img)
+{
+  struct eh *elf = (struct eh *)elf_head;
+
+  if (img->head_len < sizeof(struct eh64) ||
+      memcmp(elf->e_ident, ELFMAG, SELFMAG) != 0)
+    return false;
+
+  img->nseg = 0;
+
+#define SEGMENTS(EH, PH) {                                              \
+    struct EH *elfc = (struct EH *)elf;                                 \
+    if (!(elfc->e_type==2 && ((elfc->e_machine == EM_386) || (elfc->e_machine == EM_X86_64)) && elfc->e_version==1) || \
+        sizeof(struct PH) > elfc->e_phentsize ||                        \
+        elfc->e_phoff + (uint64_t)elfc->e_phnum*elfc->e_phentsize > img->head_len || \
+        (uint64_t)elfc->e_entry > ~0U)                                  \
+      return false;                                                     \
+    img->entry = elfc->e_entry;                                         \
+                                                                        \
+    for (unsigned i = 0; i < elfc->e_phnum; i++) {                      \
+      struct PH *ph = (struct PH *)(elf_head + elfc->e_phoff + i*elfc->e_phentsize); \
+      if (ph->p_type != 1)                                              \
+        continue;                                                       \
+      if (img->nseg == ELF_MAX_SEGMENTS)                                \
+        return false;                                                   \
+      img->seg[img->nseg++] = (struct elf_segment){ ph->p_offset, ph->p_paddr, \
+                                                    ph->p_filesz, ph->p_memsz }; \
+    }                                                                   \
+  }
+
+  switch (elf->e_ident[EI_CLASS]) {
+  case ELFCLASS32:
+    SEGMENTS(eh, ph);
+    break;
+  case ELFCLASS64:
+    SEGMENTS(eh64, ph64);
+    break;
+  default:
+    return false;
+  }
+
+  /* The stream only goes forward, so order segments by offset. */
+  for (unsigned i = 1; i < img->nseg; i++)
+    for (unsigned j = i; j > 0 && img->seg[j].offset < img->seg[j-1].offset; j--) {
+      struct elf_segment t = img->seg[j];
+      img->seg[j] = img->seg[j-1];
+      img->seg[j-1] = t;
+    }
+
+  uint64_t file_end = 0;
+  for (unsigned i = 0; i < img->nseg; i++) {
+    struct elf_segment *seg = &img->seg[i];
+
+    if (seg->offset < file_end || seg->filesz > seg->memsz ||
+        seg->paddr + seg->memsz > (1ULL << 32))
+      return false;
+    file_end = seg->offset + seg->filesz;
+
+    /* Only the trampoline can load over ourselves. */
+    if (overlaps(seg->paddr, seg->memsz, (uintptr_t)_image_start,
+                 _image_end - _image_start))
+      return false;
+  }
+
+  return true;
+}
+
+/** Inflates exactly len bytes to dst. */
+static bool
+elf_gz_drain(struct elf_image *img, uint8_t *dst, unsigned len)
+{
+  while (len) {
+    unsigned n = len;
+    int res = tinf_stream_drain(&elf_stream, dst, &n);
+
+    img->pos += n;
+    dst += n;
+    len -= n;
+    if (len && res != TINF_OK)
+      return false;
+  }
+
+  return true;
+}
+
+/** Copies len bytes of the file at offset, which must not lie behind
+    the stream unless it is in elf_head, to dst. */
+static bool
+elf_gz_read(struct elf_image *img, uint64_t offset, uint8_t *dst, uint64_t len)
+{
+  if (offset < img->head_len) {
+    unsigned n = MIN(len, img->head_len - offset);
+    memcpy(dst, elf_head + offset, n);
+    offset += n;
+    dst += n;
+    len -= n;
+  }
+
+  if (len == 0)
+    return true;
+
+  while (img->pos < offset)
+    if (!elf_gz_drain(img, elf_scratch, MIN(offset - img->pos, sizeof(elf_scratch))))
+      return false;
+
+  for (unsigned n; len; len -= n, dst += n) {
+    n = MIN(len, 1U << 30);
+    if (!elf_gz_drain(img, dst, n))
+      return false;
+  }
+
+  return true;
+}
+
+/** Inflates the rest of the file and checks it against the gzip
+    trailer. */
+static bool
+elf_gz_finish(struct elf_image *img)
+{
+  uint8_t trailer[8];
+  unsigned len = sizeof(trailer);
+  int res;
+
+  do {
+    unsigned n = sizeof(elf_scratch);
+    res = tinf_stream_drain(&elf_stream, elf_scratch, &n);
+    img->pos += n;
+  } while (res == TINF_OK);
+
+  if (res != TINF_STREAM_END ||
+      tinf_stream_finish(&elf_stream, trailer, &len) != TINF_OK ||
+      len != sizeof(trailer))
+    return false;
+
+  uint32_t crc, isize;
+  memcpy(&crc, trailer, sizeof(crc));
+  memcpy(&isize, trailer + 4, sizeof(isize));
+  return crc == img->sum && isize == (uint32_t)img->pos;
+}
+
+/**
+ * Checks whether the module is a gzip'd ELF whose segments can be
+ * inflated straight to their physical addresses.
+ */
+static bool
+elf_gz_probe(struct module *m, struct elf_image *img)
+{
+  tinf_init();
+  return elf_gz_open(m, img) && elf_gz_parse(img);
+}
+
+/** Checks whether [start, start+len) lies within a single available
+    entry of the memory map. */
+static bool
+mmap_available(const struct mbi *mbi, uint64_t start, uint64_t len)
+{
+  memory_map_t *mmap = (memory_map_t *)mbi->mmap_addr;
+
+  if ((mbi->flags & MBI_FLAG_MMAP) == 0)
+    return false;
+
+  for (; (uint32_t)mmap < mbi->mmap_addr + mbi->mmap_length;
+       mmap = (memory_map_t *)(mmap->size + (uint32_t)mmap + sizeof(mmap->size))) {
+    uint64_t block_len  = (uint64_t)mmap->length_high<<32 | mmap->length_low;
+    uint64_t block_addr = (uint64_t)mmap->base_addr_high<<32 | mmap->base_addr_low;
+
+    if (mmap->type == MMAP_AVAILABLE && block_addr <= start &&
+        start + len <= block_addr + block_len)
+      return true;
+  }
+
+  return false;
+}
+
+/**
+ * Checks whether the segments may be written right now: they have to
+ * lie in available memory, which excludes everything we protected or
+ * published, and must not touch the multiboot information itself.
+ * Modules are not checked, relocation moves them out of the way.
+ */
+static bool
+elf_gz_fits(const struct mbi *mbi, const struct elf_image *img)
+{
+  for (unsigned i = 0; i < img->nseg; i++) {
+    const struct elf_segment *seg = &img->seg[i];
+
+    if (!mmap_available(mbi, seg->paddr, seg->memsz) ||
+        overlaps(seg->paddr, seg->memsz, (uintptr_t)mbi, sizeof(*mbi)) ||
+        overlaps(seg->paddr, seg->memsz, mbi->mmap_addr, mbi->mmap_length) ||
+        ((mbi->flags & MBI_FLAG_MODS) &&
+         overlaps(seg->paddr, seg->memsz, mbi->mods_addr,
+                  mbi->mods_count * sizeof(struct module))) ||
+        ((mbi->flags & MBI_FLAG_CMDLINE) &&
+         overlaps(seg->paddr, seg->memsz, mbi->cmdline,
+                  strlen((const char *)mbi->cmdline) + 1))) {
+      printf("Segment %llx-%llx is not free memory.\n",
+             seg->paddr, seg->paddr + seg->memsz - 1);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Inflates the segments of module m to their physical addresses and
+ * zero-fills their BSS. Modules must not move anymore.
+ */
+static void
+elf_gz_load(struct mbi *mbi, struct module *m, struct elf_image *img)
+{
+  struct module *mods = (struct module *)mbi->mods_addr;
+
+  /* Relocation may have moved the module, so start over. */
+  assert(elf_gz_open(m, img) && elf_gz_parse(img), "ELF header incorrect");
+
+  /* prepare_module() checked this already, but relocation publishes
+     memory of its own. */
+  assert(elf_gz_fits(mbi, img), "Relocation took memory of the kernel.");
+
+  for (unsigned i = 0; i < img->nseg; i++) {
+    struct elf_segment *seg = &img->seg[i];
+
+    for (unsigned j = 0; j < mbi->mods_count; j++)
+      assert(!overlaps(seg->paddr, seg->memsz, mods[j].mod_start,
+                       mods[j].mod_end - mods[j].mod_start) &&
+             !overlaps(seg->paddr, seg->memsz, mods[j].string,
+                       strlen((const char *)mods[j].string) + 1),
+             "Segment %llx-%llx overlaps module %u.",
+             seg->paddr, seg->paddr + seg->memsz - 1, j);
+  }
+
+  for (unsigned i = 0; i < img->nseg; i++) {
+    struct elf_segment *seg = &img->seg[i];
+    uint8_t *target = (uint8_t *)(uintptr_t)seg->paddr;
+
+    printf("Inflating segment to %llx (%llu bytes)...\n", seg->paddr, seg->memsz);
+    assert(elf_gz_read(img, seg->offset, target, seg->filesz),
+           "Error decompressing data.");
+    memset(target + seg->filesz, 0, seg->memsz - seg->filesz);
+  }
+
+  assert(elf_gz_finish(img), "Error decompressing data.");
+}
+
+/**
+ * Collects the memory that loading the plain ELF module m overwrites
+ * in busy: the trampoline and the PT_LOAD segments. Returns the
+ * number of ranges or -1, if the module is no ELF or has too many
+ * segments.
+ */
+static int
+elf_busy(struct module *m, struct mbi_range *busy)
+{
+  struct eh *elf = (struct eh *)m->mod_start;
+  unsigned len = m->mod_end - m->mod_start;
+  int n = 0;
+
+  if (len < sizeof(struct eh64) || memcmp(elf->e_ident, ELFMAG, SELFMAG) != 0)
+    return -1;
+
+  busy[n++] = (struct mbi_range){ TRAMPOLINE, TRAMPOLINE_SIZE };
+
+#define BUSY(EH, PH) {                                                  \
+    struct EH *elfc = (struct EH *)elf;                                 \
+    if (elfc->e_phoff + (uint64_t)elfc->e_phnum*elfc->e_phentsize > len || \
+        sizeof(struct PH) > elfc->e_phentsize)                          \
+      return -1;                                                        \
+                                                                        \
+    for (unsigned i = 0; i < elfc->e_phnum; i++) {                      \
+      struct PH *ph = (struct PH *)(uintptr_t)(m->mod_start + elfc->e_phoff + i*elfc->e_phentsize); \
+      if (ph->p_type != 1)                                              \
+        continue;                                                       \
+      if (n == ELF_MAX_SEGMENTS + 1)                                    \
+        return -1;                                                      \
+      busy[n++] = (struct mbi_range){ ph->p_paddr, ph->p_memsz };       \
+    }                                                                   \
+  }
+
+  switch (elf->e_ident[EI_CLASS]) {
+  case ELFCLASS32:
+    BUSY(eh, ph);
+    break;
+  case ELFCLASS64:
+    BUSY(eh64, ph64);
+    break;
+  default:
+    return -1;
+  }
+
+  return n;
+}
+
+/* What prepare_module() did for start_module() */
+static struct elf_image img;
+static bool direct;
+static bool prepared;
+
 int
-start_module(struct mbi *mbi, bool uncompress, uint64_t phys_max)
+prepare_module(struct mbi *mbi, bool uncompress, uint64_t phys_max)
 {
   if (((mbi->flags & MBI_FLAG_MODS) == 0) || (mbi->mods_count == 0)) {
     printf("No module to start.\n");
     return -1;
   }
 
-  mbi_relocate_modules(mbi, uncompress, phys_max);
+  struct module *m  = (struct module *) mbi->mods_addr;
+
+  /* A compressed ELF is inflated straight into place, unless one of
+     its segments overlaps ourselves or memory that is not free. Then
+     it is inflated like any other module and loaded from there. */
+  direct = uncompress && elf_gz_probe(m, &img) && elf_gz_fits(mbi, &img);
+
+  /* Only modules in the way of what we are about to load have to
+     move. If we cannot tell, because the ELF is still compressed,
+     mbi_relocate_modules falls back to moving everything. */
+  struct mbi_range busy[ELF_MAX_SEGMENTS + 1];
+  int nbusy = 0;
+
+  if (direct)
+    for (unsigned i = 0; i < img.nseg; i++)
+      busy[nbusy++] = (struct mbi_range){ img.seg[i].paddr, img.seg[i].memsz };
+  else
+    nbusy = elf_busy(m, busy);
+
+  mbi_relocate_modules(mbi, uncompress, direct, phys_max,
+                       nbusy < 0 ? NULL : busy, nbusy);
+
+  if (direct) {
+    /* The segments may cover the AP startup page, which smp_park()
+       restores. Get that out of the way first. */
+    smp_park();
+
+    int inflate = timeline_begin("inflate");
+
+    elf_gz_load(mbi, m, &img);
+    timeline_end(inflate);
+  }
+
+  prepared = true;
+  return 0;
+}
+
+int
+start_module(struct mbi *mbi, bool uncompress, uint64_t phys_max)
+{
+  if (!prepared && prepare_module(mbi, uncompress, phys_max) != 0)
+    return -1;
 
-  // skip module after loading
   struct module *m  = (struct module *) mbi->mods_addr;
+
+  /* The next kernel expects the APs in INIT. */
+  smp_park();
+  timeline_finish();
+  vga_handoff();
+
+  // skip module after loading
   mbi->mods_addr += sizeof(struct module);
   mbi->mods_count--;
   mbi->cmdline = m->string;
@@ -76,11 +494,14 @@ start_module(struct mbi *mbi, bool uncompress, uint64_t phys_max)
   // switch it on unconditionally, we assume that m->string is always initialized
   mbi->flags |=  MBI_FLAG_CMDLINE;
 
+  if (direct)
+    jmp_multiboot(mbi, img.entry);
+
   // check elf header
   struct eh *elf = (struct eh *) m->mod_start;
   assert(memcmp(elf->e_ident, ELFMAG, SELFMAG) == 0, "ELF header incorrect");
 
-  uint8_t *code = (uint8_t *)0x7C00;
+  uint8_t *code = (uint8_t *)TRAMPOLINE;
 
 #define LOADER(EH, PH) {                                                \
     struct EH *elfc = (struct EH *)elf;                                               \
@@ -111,7 +532,7 @@ start_module(struct mbi *mbi, bool uncompress, uint64_t phys_max)
   }
 
   gen_jmp_edx(&code);
-  asm volatile  ("jmp *%%edx" :: "a" (0), "d" (0x7C00), "b" (mbi));
+  asm volatile  ("jmp *%%edx" :: "a" (0), "d" (TRAMPOLINE), "b" (mbi));
 
   /* NOT REACHED */
   return 0;
@@ -6,6 +6,9 @@
 #include <version.h>
 #include <serial.h>
 #include <mbi-tools.h>
+#include <dispatch.h>
+#include <timeline-tools.h>
+#include <bootlog-tools.h>
 
 int
 main(uint32_t magic, struct mbi *mbi)
@@ -17,15 +20,21 @@ main(uint32_t magic, struct mbi *mbi)
     return 1;
   }
 
+  console_configure(mbi);
+  timeline_init(mbi, "farnsworth");
+  bootlog_init(mbi);
+
   printf("\nFarnsworth %s\n", version_str);
   printf("Blame Julian Stecklina <jsteckli@os.inf.tu-dresden.de> for bugs.\n\n");
 
+  cpu_dispatch(mbi);
+
   if (mbi->flags & MBI_FLAG_MODS) {
     printf("MBI Modules List:\n");
     struct module *mods = (struct module *)mbi->mods_addr;
     for (unsigned i = 0; i < mbi->mods_count; i++) {
       const char *s = (const char *)mods[i].string;
-      printf("  %2u: start %8x end %8x cmd %8p '%s'\n", i, mods[i].mod_start, mods[i].mod_end, s, s);
+      printf("  %2u: start %08x end %08x cmd %08p '%s'\n", i, mods[i].mod_start, mods[i].mod_end, s, s);
     }
   } else {
     printf("No modules!\n");
@@ -40,7 +49,7 @@ main(uint32_t magic, struct mbi *mbi)
       uint64_t base = (uint64_t)mmap->base_addr_low | ((uint64_t)mmap->base_addr_high<<32);
       uint64_t len  = (uint64_t)mmap->length_low | ((uint64_t)mmap->length_high<<32);
       
-      printf(" type %2x start %16llx end %16llx len %16llx\n", mmap->type, base, base+len-1, len);
+      printf(" type %02x start %016llx end %016llx len %016llx\n", mmap->type, base, base+len-1, len);
 
       /* Skip to next entry. */
       mmap = (memory_map_t *)(mmap->size + (uint32_t)mmap + sizeof(mmap->size));
@@ -50,5 +59,8 @@ main(uint32_t magic, struct mbi *mbi)
     printf("No memory map!\n");
   }
 
+  timeline_print();
+  printf("\n");
+
   return start_module(mbi, false, PHYS_MAX_RELOCATE);
 }
@@ -5,25 +5,32 @@
 void hexdump(const void *p, unsigned len)
 {
   const unsigned chars_per_row = 16;
-  const char *data = (const char *)(p);
-  const char *data_end = data + len;
+  const unsigned char *data = (const unsigned char *)(p);
+  static const char hex[] = "0123456789abcdef";
 
+  /* Each row is formatted completely and written at once. */
   for (unsigned cur = 0; cur < len; cur += chars_per_row) {
-    printf("%08x:", cur);
-    for (unsigned i = 0; i < chars_per_row; i++)
-      if (data+i < data_end)
-        printf(" %02x", ((const unsigned char *)data)[i]);
-      else
-        printf("   ");
-    printf(" | ");
-    for (unsigned i = 0; i < chars_per_row; i++) {
-      if (data < data_end)
-        printf("%c", ((data[0] >= 32) && (data[0] > 0)) ? data[0] : '.');
-      else
-        printf(" ");
-      data++;
+    char row[10 + 3 * chars_per_row + 3 + chars_per_row + 1];
+    char *s = row;
+
+    for (int shift = 28; shift >= 0; shift -= 4)
+      *s++ = hex[(cur >> shift) & 0xF];
+    *s++ = ':';
+
+    for (unsigned i = cur; i < cur + chars_per_row; i++) {
+      *s++ = ' ';
+      *s++ = (i < len) ? hex[data[i] >> 4]  : ' ';
+      *s++ = (i < len) ? hex[data[i] & 0xF] : ' ';
     }
-    printf("\n");
+
+    *s++ = ' ';
+    *s++ = '|';
+    *s++ = ' ';
+    for (unsigned i = cur; i < cur + chars_per_row; i++)
+      *s++ = (i >= len) ? ' ' : (data[i] >= 32 && data[i] < 127) ? data[i] : '.';
+    *s++ = '\n';
+
+    out_write(row, s - row);
   }
 }
 
@@ -59,6 +59,11 @@ struct device_scope {
   //uint8_t path[];
 } __attribute__((packed));
 
+enum {
+  FADT_PM_TMR_BLK    = 76,      /* offset in the FADT */
+  PM_TIMER_HZ        = 3579545,
+};
+
 enum {
   TYPE_DMAR          = 0,
   TYPE_RMRR          = 1,
@@ -94,11 +99,27 @@ struct dmar {
   struct dmar_entry first_entry;
 };
 
+/* PCI Express memory mapped configuration space */
+struct mcfg_entry {
+  uint64_t base;                /* of bus 0 */
+  uint16_t segment;
+  uint8_t  start_bus;
+  uint8_t  end_bus;
+  uint32_t _res;
+} __attribute__((packed));
+
+struct mcfg {
+  struct acpi_table generic;
+  char _res[8];
+  struct mcfg_entry entry[];
+} __attribute__((packed));
+
 char acpi_checksum(const char *table, size_t count);
 void acpi_fix_checksum(struct acpi_table *tab);
 
 struct rsdp *acpi_get_rsdp(void);
 struct acpi_table **acpi_get_table_ptr(struct acpi_table *rsdt, const char signature[4]);
+uint16_t acpi_pm_timer_port(void);
 
 static inline struct dmar_entry *acpi_dmar_next(struct dmar_entry *cur)
 { return (struct dmar_entry *)((char *)cur + cur->size); }
@@ -31,6 +31,13 @@ ntohl(uint32_t v)
 }
 
 
+/** Hints to the CPU that we are spinning. */
+static inline void
+cpu_pause(void)
+{
+  asm volatile ("pause" ::: "memory");
+}
+
 static inline uint64_t
 rdtsc(void)
 {
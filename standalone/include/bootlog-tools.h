@@ -0,0 +1,35 @@
+/* -*- Mode: C -*- */
+/*
+ * Boot log ring.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <mbi.h>
+#include <bootlog.h>
+
+/**
+ * Finds the boot log of earlier stages or creates it in protected
+ * memory. Its size in KB comes from bootlog= on the command line,
+ * bootlog=0 turns it off. Without a memory map nothing is logged.
+ */
+void bootlog_init(struct mbi *mbi);
+
+/** Appends c to the ring, if there is one. */
+void bootlog_putc(unsigned c);
+
+/** Returns the ring or NULL. */
+struct bootlog *bootlog_get(void);
+
+/* EOF */
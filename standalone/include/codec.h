@@ -0,0 +1,102 @@
+/* -*- Mode: C -*- */
+/*
+ * Module codecs.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * A compressed module format, recognized by the magic bytes at the
+ * start of the module. Decoders write the whole output into one
+ * buffer, which doubles as their window, and need no heap. Their
+ * tables live in scratch memory provided by the caller, so modules
+ * can be decoded in parallel.
+ */
+struct codec {
+  const char *name;
+  uint8_t     magic[4];
+  unsigned    magic_len;
+  size_t      scratch;          /* bytes of scratch memory for decode */
+
+  /** Stores the decoded size of src in out_len. Returns false, if
+      the data is malformed or the size cannot be determined without
+      decoding. */
+  bool (*size)(const void *src, size_t len, size_t *out_len);
+
+  /** Decodes src into dst, which must be exactly as large as the
+      decoded data. scratch points to scratch bytes of 8 byte aligned
+      memory that no other decoder uses at the same time. Returns
+      false on malformed input. */
+  bool (*decode)(void *dst, size_t dst_len, const void *src, size_t len,
+                 void *scratch);
+};
+
+/* Scratch memory of the zstd decoder, checked in zstd.c. */
+enum {
+  ZSTD_SCRATCH = 148 << 10,
+};
+
+/** Returns the codec for the data at src or NULL, if it is not in a
+    known compressed format. */
+const struct codec *codec_find(const void *src, size_t len);
+
+bool lz4_size(const void *src, size_t len, size_t *out_len);
+bool lz4_decode(void *dst, size_t dst_len, const void *src, size_t len,
+                void *scratch);
+
+bool zstd_size(const void *src, size_t len, size_t *out_len);
+bool zstd_decode(void *dst, size_t dst_len, const void *src, size_t len,
+                 void *scratch);
+
+static inline void
+codec_copy8(uint8_t *dst, const uint8_t *src)
+{
+  uint64_t w;
+
+  __builtin_memcpy(&w, src, 8);
+  __builtin_memcpy(dst, &w, 8);
+}
+
+/** Copies len bytes between buffers that do not overlap. LZ77 data
+    consists mostly of short runs, for which the startup cost of
+    memcpy dominates, so copy in words. */
+static inline void
+codec_copy(uint8_t *dst, const uint8_t *src, size_t len)
+{
+  if (len < 8) {
+    while (len--)
+      *dst++ = *src++;
+    return;
+  }
+
+  for (size_t i = 0; i < len - 8; i += 8)
+    codec_copy8(dst + i, src + i);
+  codec_copy8(dst + len - 8, src + len - 8);
+}
+
+/** Copies len bytes rounded up to whole words. Both buffers need
+    7 bytes of slack beyond len. If they overlap, src has to lie at
+    least 8 bytes before dst. */
+static inline void
+codec_copy_wild(uint8_t *dst, const uint8_t *src, size_t len)
+{
+  for (size_t i = 0; i < len; i += 8)
+    codec_copy8(dst + i, src + i);
+}
+
+/* EOF */
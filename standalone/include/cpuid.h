@@ -32,18 +32,28 @@ enum IA32_APIC_MSR {
   APIC_ENABLE            = 1<<11,
 };
 
+/**
+ * Executes CPUID for leaf and subleaf and stores EAX, EBX, ECX and
+ * EDX in r.
+ */
+static inline void
+cpuid(uint32_t leaf, uint32_t subleaf, uint32_t r[4])
+{
+  asm ("cpuid" : "=a" (r[0]), "=b" (r[1]), "=c" (r[2]), "=d" (r[3])
+       : "a" (leaf), "c" (subleaf));
+}
+
 /**
  * Uses CPUID to find out if the CPU has an enabled APIC.
  */
 static inline bool
 has_apic(void)
 {
-  uint32_t eax = 1;
-  uint32_t edx;
+  uint32_t r[4];
 
-  asm ("cpuid" : "+a" (eax), "=d" (edx) :: "ebx", "ecx");
+  cpuid(1, 0, r);
 
-  return ((edx >> 9) & 1) != 0;
+  return ((r[3] >> 9) & 1) != 0;
 }
 
 /**
@@ -66,4 +76,6 @@ enable_apic(void)
   asm volatile ("wrmsr" :: "a" (low), "d" (hi), "c" (IA32_APIC_BASE));
 }
 
+void cpu_enable_simd(void);
+
 /* EOF */
@@ -0,0 +1,32 @@
+/* -*- Mode: C -*- */
+/*
+ * Selection of CPU specific variants of hot routines.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <mbi.h>
+
+/**
+ * Picks the variants of memcpy/memset, tinf_crc32, tinf_adler32 and
+ * the inflate match copy for this CPU and prints them on one
+ * line. Arguments of the form routine=variant on the multiboot
+ * command line override the choice, e.g. "crc32=slice8" or
+ * "memcpy=movsd memcpy_nt=off". A variant the CPU lacks falls back
+ * to the next slower one. Call it once early in main, routines used
+ * before pick the automatic variant on their own.
+ */
+void cpu_dispatch(const struct mbi *mbi);
+
+/* EOF */
@@ -24,6 +24,13 @@
 
 enum { PHYS_MAX_RELOCATE = 1ULL << 32 };
 
+/* Moves modules out of the way of the first one and inflates it, if
+   it is a compressed ELF. start_module() does this itself, unless it
+   was done before, so callers can do it while they wait for
+   something else. Returns 0 on success. */
+int prepare_module(struct mbi *mbi, bool uncompress, uint64_t phys_max);
+
+/* Starts the first module. Does not return on success. */
 int start_module(struct mbi *mbi, bool uncompress, uint64_t phys_max);
 
 /* Definitions taken from elf.h. Copyright follows: */
@@ -23,13 +23,28 @@
 #include <stdbool.h>
 #include <mbi.h>
 
+bool mbi_find_phys(const struct mbi *multiboot_info, uint64_t len,
+                   uint64_t *block_start, bool highest, uint64_t limit_to);
+
 bool mbi_find_memory(const struct mbi *multiboot_info, size_t len,
                      void **block_start, size_t *block_len,
-                     bool highest);
+                     bool highest, uint64_t limit_to);
 
 void *mbi_alloc_protected_memory(struct mbi *multiboot_info, size_t len, unsigned align);
 
-void mbi_relocate_modules(struct mbi *mbi, bool uncompress, uint64_t phys_max);
+/** Memory handed to later stages through the memory map, see mbi.c. */
+void *mbi_find_published(const struct mbi *mbi, uint32_t type);
+void *mbi_publish_memory(struct mbi *mbi, size_t len, uint32_t type);
+
+/** A physical memory range the next stage overwrites. */
+struct mbi_range {
+  uint64_t start;
+  uint64_t len;
+};
+
+void mbi_relocate_modules(struct mbi *mbi, bool uncompress, bool keep_first,
+                          uint64_t phys_max, const struct mbi_range *busy,
+                          unsigned nbusy);
 
 
 /* EOF */
@@ -22,9 +22,33 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <pci.h>
+#include <util.h>
 
 #include <ohci-crm.h>
 
+enum link_speed {
+  SPEED_S100 = 0U,
+  SPEED_S200 = 1U,
+  SPEED_S400 = 2U,
+
+  SPEED_MAX  = ~0U,
+};
+
+/* Bring-up states in the order we go through them */
+enum ohci_state {
+  OHCI_SOFTRESET,
+  OHCI_LINK_OFF,
+  OHCI_LPS_ON,
+  OHCI_SCLK,
+  OHCI_PHY_READ,
+  OHCI_LPS_OFF,			/* before trying LPS again */
+  OHCI_LINK_ON,
+  OHCI_SETTLE,			/* until no bus reset follows ours */
+
+  OHCI_UP,
+  OHCI_FAILED,
+};
+
 struct ohci_controller {
 
   const struct pci_device *pci;	/* PCI device info. */
@@ -38,21 +62,30 @@ struct ohci_controller {
   bool enhanced_phy_map;
   bool posted_writes;
 
-};
+  /* Bring-up, see ohci_step() */
+  enum link_speed speed;
+  enum ohci_state state;
+  deadline_t deadline;		/* for leaving state */
+  deadline_t wait;		/* within a state */
+  unsigned lps_retries;
+  unsigned wait_more;
+  uint8_t generation;		/* of SelfIDCount before our reset */
+  uint8_t seen;			/* last generation we saw */
 
-enum link_speed {
-  SPEED_S100 = 0U,
-  SPEED_S200 = 1U,
-  SPEED_S400 = 2U,
-
-  SPEED_MAX  = ~0U,
 };
 
 void    ohci_poll_events(struct ohci_controller *ohci);
-bool    ohci_initialize(const struct pci_device *pci_dev,
-			struct ohci_controller *ohci,
-			bool posted_writes,
-			enum link_speed speed);
+
+/* Brings a controller up without blocking, so other work can go on
+   while the PHY and link come up: ohci_start() checks the controller
+   and resets it, then call ohci_step() until it returns OHCI_UP or
+   OHCI_FAILED. Each state has a deadline, after which the controller
+   fails. */
+bool    ohci_start(const struct pci_device *pci_dev,
+		   struct ohci_controller *ohci,
+		   bool posted_writes,
+		   enum link_speed speed);
+enum ohci_state ohci_step(struct ohci_controller *ohci);
 
 uint8_t ohci_wait_nodeid(struct ohci_controller *ohci);
 void    ohci_force_bus_reset(struct ohci_controller *ohci);
@@ -22,11 +22,15 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <pci_db.h>
+#include <pci_inventory.h>
+#include <mbi.h>
 
 enum pci_class {
   PCI_CLASS_BRIDGE_DEV      = 0x06,
   PCI_CLASS_SIMPLE_COMM     = 0x07,
   PCI_CLASS_SERIAL_BUS_CTRL = 0x0C,
+
+  PCI_CLASS_ANY             = 0xFF,
 };
 
 enum pci_subclass {
@@ -45,10 +49,20 @@ enum pci_subclass {
 enum pci_config_space {
   PCI_CFG_VENDOR_ID = 0x0,
   PCI_CFG_REVID = 0x08,         /* Read uint32 to get class code in upper 16bit */
+  PCI_CFG_HEADER_TYPE = 0x0E,
   PCI_CFG_BAR0  = 0x10,
   PCI_CFG_BAR1  = 0x14,
   PCI_CFG_BAR2  = 0x18,
   PCI_CFG_BAR3  = 0x1C,
+  PCI_CFG_SECONDARY_BUS   = 0x19, /* bridges */
+  PCI_CFG_SUBORDINATE_BUS = 0x1A,
+};
+
+enum pci_header_type {
+  PCI_HEADER_MULTIFUNC = 0x80,
+  PCI_HEADER_TYPE_MASK = 0x7F,
+  PCI_HEADER_BRIDGE    = 0x01,
+  PCI_HEADER_CARDBUS   = 0x02,
 };
 
 enum pci_constants {
@@ -62,6 +76,8 @@ enum pci_constants {
   PCI_BAR_TYPE_MASK = 1U,
   PCI_BAR_TYPE_IO   = 1U,
   PCI_BAR_IO_MASK   = ~1U,
+  PCI_ID_ANY        = 0xFFFF,
+  PCI_BDF_ANY       = ~0U,
 };
 
 struct pci_device {
@@ -69,13 +85,56 @@ struct pci_device {
   uint32_t cfg_address;		/* Address of config space */
 };
 
-/* Low-Level PCI Access */
+/* Low-Level PCI Access. Addresses are in the format of the 0xCF8
+   port, but go to memory mapped configuration space, if ACPI has an
+   MCFG table for the bus. */
 uint8_t pci_read_uint8(unsigned addr);
 uint32_t pci_read_uint32(unsigned addr);
+void pci_write_uint32(unsigned addr, uint32_t value);
+
+/* Calls visit for every function that exists, following bridges
+   from bus 0 and then other root buses. Stops when visit returns
+   true and returns true then. */
+typedef bool (*pci_visit_t)(uint32_t cfg_address, void *arg);
+bool pci_walk(pci_visit_t visit, void *arg);
+
+/* Finds the inventory of an earlier stage or enumerates PCI once
+   and publishes the result in the memory map. Afterwards pci_walk,
+   pci_find_device_by_class and pci_find_cap do not probe hardware. */
+void pci_inventory_init(struct mbi *mbi);
+
+/* Returns the inventory entry of a function or NULL. */
+const struct pci_inventory_device *pci_inventory_lookup(uint32_t cfg_address);
 
 
 uint32_t pci_cfg_read_uint32(const struct pci_device *dev, uint32_t offset);
 
+/* Selects functions. Fields with their ANY value match every
+   function. */
+struct pci_filter {
+  uint8_t  class;               /* PCI_CLASS_ANY */
+  uint8_t  subclass;            /* PCI_SUBCLASS_ANY */
+  uint16_t vendor;              /* PCI_ID_ANY */
+  uint16_t device;              /* PCI_ID_ANY */
+  uint32_t bdf;                 /* bus << 8 | dev << 3 | func or PCI_BDF_ANY */
+};
+
+/* Sets up a filter for class and subclass that matches any IDs and
+   location. */
+void pci_filter_init(struct pci_filter *f, uint8_t class, uint8_t subclass);
+
+/* Narrows a filter down to the IDs or location in spec, which is
+   either vendor:device or bus:dev.func, all in hex. Returns false if
+   spec is neither. */
+bool pci_filter_parse(struct pci_filter *f, const char *spec);
+
+bool pci_filter_match(const struct pci_filter *f, uint32_t cfg_address);
+
+/* Iterates over the functions that match f in the order of their
+   addresses. Start with dev->cfg_address set to 0. On success,
+   returns true and fills out dev with the next function. */
+bool pci_next(const struct pci_filter *f, struct pci_device *dev);
+
 /* Find a device by its class. Always finds the last device of the
    given class. On success, returns true and fills out the given
    pci_device structure. If subclass is 0xFF, it will be
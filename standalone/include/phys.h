@@ -0,0 +1,31 @@
+/* -*- Mode: C -*- */
+/*
+ * Copies between any physical addresses.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Copies len bytes from physical address src to dst, which must not
+ * overlap. If either lies above 4GB, PAE paging maps them into the
+ * top gigabyte of the address space for the duration of the copy,
+ * so our own image must be below 3GB. Returns false, if that needs
+ * PAE and the CPU has none.
+ */
+bool phys_copy(uint64_t dst, uint64_t src, uint64_t len);
+
+/* EOF */
@@ -19,5 +19,10 @@
 
 #pragma once
 
+#include <mbi.h>
+
 void serial_init(void);
 void serial_send(int c);
+
+/** Applies baud= and uartclk= from the command line, see serial.c. */
+void serial_configure(const struct mbi *mbi);
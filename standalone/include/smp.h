@@ -0,0 +1,54 @@
+/* -*- Mode: C -*- */
+/*
+ * Application processor bring-up and a small work queue.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <mbi-tools.h>
+
+enum {
+  SMP_MAX_CPUS  = 16,           /* including the BSP */
+  SMP_STACK     = 4096,         /* per AP */
+  SMP_MAX_JOBS  = 64,
+};
+
+typedef void (*smp_job_fn)(void *arg);
+
+/**
+ * Starts the APs with INIT-SIPI-SIPI, if the CPU has a local
+ * APIC. They wait for jobs until smp_park() is called. Needs a page
+ * of available memory below 1MB for the startup code, which must not
+ * lie in target, where the modules are relocated to, or in any of the
+ * busy ranges. Returns the number of CPUs that take jobs, including
+ * the BSP.
+ */
+unsigned smp_init(struct mbi *mbi, struct mbi_range target,
+                  const struct mbi_range *busy, unsigned nbusy);
+
+/** Queues fn(arg) to run on any CPU. Only the BSP submits jobs. */
+void smp_submit(smp_job_fn fn, void *arg);
+
+/** Runs queued jobs on the BSP as well until all of them are
+    finished. */
+void smp_wait(void);
+
+/**
+ * Finishes all jobs and puts the APs back into INIT, where the next
+ * kernel expects them. Restores the memory used for the startup
+ * code. Does nothing, if smp_init() started no APs.
+ */
+void smp_park(void);
+
+/* EOF */
@@ -0,0 +1,44 @@
+/* -*- Mode: C -*- */
+/*
+ * Recording the boot timeline.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <mbi.h>
+#include <timeline.h>
+
+/**
+ * Finds the timeline of earlier stages or creates it in protected
+ * memory and starts a phase called stage, which lasts until
+ * timeline_finish(). Without a memory map nothing is recorded.
+ */
+void timeline_init(struct mbi *mbi, const char *stage);
+
+/** Starts a phase nested in the running ones. Returns a handle for
+    timeline_end(), which ignores -1 when the table is full or
+    missing. */
+int timeline_begin(const char *name);
+
+/** Ends phase and the phases nested in it that still run. */
+void timeline_end(int phase);
+
+/** Ends all phases that still run. Call it right before handing over
+    to the next stage. */
+void timeline_finish(void);
+
+/** Prints all phases with their offsets in microseconds. */
+void timeline_print(void);
+
+/* EOF */
@@ -26,25 +26,184 @@ extern "C" {
 #endif
 
 #define TINF_OK             0
+#define TINF_STREAM_END     1
+#define TINF_NEED_INPUT     2
 #define TINF_DATA_ERROR    (-3)
 
+/* continues a checksum over more data (see tinf_crc32_update) */
+typedef unsigned int (TINFCC *TINF_CHECK)(unsigned int sum, const void *data,
+                                          unsigned int length);
+
+/* ---------------------------------------------------------- *
+ * -- decoder state, public so that streams can be static -- *
+ * ---------------------------------------------------------- */
+
+#ifndef TINF_BITSERIAL
+
+/* size of primary plus sub-tables for a complete literal/length code
+   (see enough.c in zlib), which also covers the other trees */
+#define TINF_FAST_SIZE 852
+
+/* bit buffer, a machine word: 32 bits on i386, 64 bits on x86-64 */
+typedef unsigned long TINF_BITBUF;
+
+typedef struct {
+   unsigned short sym;  /* symbol, or offset of the sub-table */
+   unsigned char bits;  /* bits consumed by this entry */
+   unsigned char sub;   /* index bits of the sub-table, 0 for symbols */
+} TINF_ENTRY;
+
+#else
+
+typedef unsigned int TINF_BITBUF;
+
+#endif
+
+typedef struct {
+   unsigned short table[16];  /* table of code length counts */
+   unsigned short trans[288]; /* code -> symbol translation table */
+#ifndef TINF_BITSERIAL
+   unsigned int root;         /* index bits of the primary table */
+   TINF_ENTRY fast[TINF_FAST_SIZE]; /* primary table and sub-tables */
+#endif
+} TINF_TREE;
+
+typedef struct {
+   const unsigned char *source;
+   const unsigned char *source_end;
+   unsigned int overrun; /* zero bytes fed to tag beyond source_end */
+   TINF_BITBUF tag;
+   unsigned int bitcount;
+
+   /* a stream decodes from its hold buffer until source reaches
+      hold_next, then goes on in the chunk [next, next_end) */
+   const unsigned char *hold_next;
+   const unsigned char *next;
+   const unsigned char *next_end;
+
+   unsigned char *dest;
+   unsigned char *dest_start; /* oldest output a match may refer to */
+   unsigned char *dest_end;
+
+   int state;            /* block decoder state */
+   int bfinal;           /* current block is the last one */
+   unsigned int left;    /* bytes left in a stored block */
+   TINF_TREE *lt, *dt;   /* trees of the current block */
+
+   TINF_CHECK check;     /* checksum to keep over the output, or 0 */
+   unsigned int *sum;
+   unsigned char *check_pos; /* output not yet covered by sum */
+
+   TINF_TREE ltree; /* dynamic length/symbol tree */
+   TINF_TREE dtree; /* dynamic distance tree */
+   TINF_TREE ctree; /* code length tree */
+} TINF_DATA;
+
+/* history a match may refer to */
+#define TINF_WINDOW 32768
+
+/* input kept between chunks, enough for a split block header */
+#define TINF_HOLD 1024
+
+typedef struct {
+   TINF_DATA d;
+   unsigned char *pending;   /* output in window not yet drained */
+   TINF_CHECK check;
+   unsigned int *sum;
+   unsigned char hold[TINF_HOLD];
+   unsigned char window[2 * TINF_WINDOW];
+} TINF_STREAM;
+
 /* function prototypes */
 
 void TINFCC tinf_init();
 
+/* on entry *destLen is the size of dest, on return that of the output */
+
 int TINFCC tinf_uncompress(void *dest, unsigned int *destLen,
                            const void *source, unsigned int sourceLen);
 
+int TINFCC tinf_uncompress_check(void *dest, unsigned int *destLen,
+                                 const void *source, unsigned int sourceLen,
+                                 TINF_CHECK check, unsigned int *sum);
+
+int TINFCC tinf_uncompress_data(TINF_DATA *d, void *dest, unsigned int *destLen,
+                                const void *source, unsigned int sourceLen,
+                                TINF_CHECK check, unsigned int *sum);
+
+/* streaming inflate: feed chunks of input and drain the output into
+   buffers of any size until drain returns TINF_STREAM_END */
+
+void TINFCC tinf_stream_init(TINF_STREAM *s, TINF_CHECK check, unsigned int *sum);
+
+int TINFCC tinf_stream_feed(TINF_STREAM *s, const void *source, unsigned int sourceLen);
+
+int TINFCC tinf_stream_drain(TINF_STREAM *s, void *dest, unsigned int *destLen);
+
+int TINFCC tinf_stream_finish(TINF_STREAM *s, void *rest, unsigned int *restLen);
+
+int TINFCC tinf_gzip_header(const void *source, unsigned int sourceLen,
+                            unsigned int *headerLen);
+
 int TINFCC tinf_gzip_uncompress(void *dest, unsigned int *destLen,
                                 const void *source, unsigned int sourceLen);
 
+int TINFCC tinf_gzip_uncompress_data(TINF_DATA *d, void *dest, unsigned int *destLen,
+                                     const void *source, unsigned int sourceLen);
+
 int TINFCC tinf_zlib_uncompress(void *dest, unsigned int *destLen,
                                 const void *source, unsigned int sourceLen);
 
 unsigned int TINFCC tinf_adler32(const void *data, unsigned int length);
 
+unsigned int TINFCC tinf_adler32_update(unsigned int adler, const void *data,
+                                        unsigned int length);
+
+unsigned int TINFCC tinf_adler32_combine(unsigned int adler1, unsigned int adler2,
+                                         unsigned int length2);
+
 unsigned int TINFCC tinf_crc32(const void *data, unsigned int length);
 
+unsigned int TINFCC tinf_crc32_update(unsigned int crc, const void *data,
+                                      unsigned int length);
+
+/* CRC32 kernels for tinf_crc32_select */
+#define TINF_CRC32_AUTO    (-1)
+#define TINF_CRC32_NIBBLE    0
+#define TINF_CRC32_SLICE8    1
+#define TINF_CRC32_PCLMUL    2
+
+int TINFCC tinf_crc32_select(int kernel);
+
+/* Adler-32 kernels for tinf_adler32_select */
+#define TINF_ADLER32_AUTO    (-1)
+#define TINF_ADLER32_SCALAR    0
+#define TINF_ADLER32_SSSE3     1
+#define TINF_ADLER32_AVX2      2
+
+int TINFCC tinf_adler32_select(int kernel);
+
+/* match copy kernels for tinf_copy_select */
+#define TINF_COPY_AUTO     (-1)
+#define TINF_COPY_WORDS      0
+#define TINF_COPY_SSE2       1
+
+int TINFCC tinf_copy_select(int kernel);
+
+void TINFCC tinf_copy_match(unsigned char *dst, unsigned int offs, unsigned int length);
+
+#if defined(__i386__) || defined(__x86_64__)
+
+/* CPUID of leaf with subleaf 0 into eax, ebx, ecx, edx; for the
+   kernel selectors */
+static __inline__ void tinf_cpuid(unsigned int leaf, unsigned int *r)
+{
+   __asm__ ("cpuid" : "=a" (r[0]), "=b" (r[1]), "=c" (r[2]), "=d" (r[3])
+                    : "a" (leaf), "c" (0));
+}
+
+#endif
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -55,7 +55,37 @@ void *memcpy(void *dest, const void *src, size_t n);
 void *memset(void *s, int c, size_t n);
 int memcmp(const void *s1, const void *s2, size_t n);
 
+/* memcpy/memset kernels for mem_select */
+enum {
+  MEM_AUTO   = -1,
+  MEM_MOVSB  = 0,               /* rep movsb, fast with ERMS */
+  MEM_MOVSD  = 1,               /* rep movsd, aligned head and tail */
+};
+
+/* nt_threshold for mem_select: never use non-temporal stores */
+#define MEM_NT_OFF (~(size_t)0)
+
+int mem_select(int kernel, size_t nt_threshold);
+
+/* Chosen by mem_select, used by memcpy and memset */
+extern int    mem_kernel;
+extern size_t mem_nt_threshold;
+
+/* Where out_char() writes to */
+enum {
+  CONSOLE_VGA    = 1 << 0,
+  CONSOLE_SERIAL = 1 << 1,
+};
+
+extern unsigned console_sinks;
+
+struct mbi;
+
+/** Applies console= and the serial settings from the command line. */
+void console_configure(const struct mbi *mbi);
+
 /* Low-level output functions */
+void out_write(const char *s, size_t len);
 int  out_char(unsigned value);
 void out_string(const char *value);
 
@@ -68,6 +98,18 @@ void hexdump(const void *p, unsigned len);
 
 /* Helper functions. */
 void wait(int ms);
+uint32_t tsc_khz(void);
+void tsc_khz_set(uint32_t khz);
+
+/* Timeouts as TSC values, see deadline_in() */
+typedef uint64_t deadline_t;
+
+deadline_t deadline_in(unsigned ms);
+bool deadline_passed(deadline_t deadline);
+
+/* Sleeps until *word no longer holds value or deadline passes. May
+   return early. */
+void wait_change(volatile uint32_t *word, uint32_t value, deadline_t deadline);
 void __exit(unsigned status) __attribute__((regparm(1), noreturn));
 void reboot(void) __attribute__((noreturn));
 
@@ -0,0 +1,29 @@
+/* -*- Mode: C -*- */
+/*
+ * VGA text console.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+/** Puts a char on the last line of the screen, scrolling it up on
+    newline or when the line is full. */
+void vga_putc(unsigned c);
+
+/**
+ * Moves the visible screen back to the start of video memory. Call it
+ * before handing over to code that writes to 0xB8000 directly.
+ */
+void vga_handoff(void);
+
+/* EOF */
@@ -0,0 +1,25 @@
+/* -*- Mode: C -*- */
+/*
+ * xxHash checksums as used by the LZ4 and zstd frame formats.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t xxh32(const void *data, size_t len, uint32_t seed);
+uint64_t xxh64(const void *data, size_t len, uint64_t seed);
+
+/* EOF */
@@ -0,0 +1,319 @@
+/* -*- Mode: C -*- */
+/*
+ * LZ4 frame decoder.
+ *
+ * Decodes LZ4 frames (as written by the lz4 tool) into a buffer that
+ * holds the complete output, so linked blocks simply refer back into
+ * what was already decoded. Dictionaries are not supported.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <codec.h>
+#include <tinf.h>
+#include <xxhash.h>
+#include <util.h>
+
+enum {
+  LZ4_MAGIC           = 0x184D2204,
+  LZ4_SKIP_MAGIC      = 0x184D2A50, /* low nibble is user defined */
+
+  LZ4_FLG_VERSION     = 0x40,
+  LZ4_FLG_BCHECKSUM   = 0x10,
+  LZ4_FLG_CSIZE       = 0x08,
+  LZ4_FLG_CCHECKSUM   = 0x04,
+  LZ4_FLG_DICTID      = 0x01,
+
+  LZ4_BLOCK_RAW       = 0x80000000U,
+  LZ4_MIN_MATCH       = 4,
+};
+
+struct lz4_frame {
+  size_t header_len;
+  size_t block_max;
+  bool   block_checksum;
+  bool   content_checksum;
+};
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+  uint32_t v;
+  __builtin_memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/** Reads an LZ4 length extension: bytes are added to len as long as
+    they are 255. */
+static bool
+lz4_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+  unsigned b;
+
+  do {
+    if (*ip >= iend)
+      return false;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+
+  return true;
+}
+
+/**
+ * Walks the sequences of one compressed block and adds its decoded
+ * length to *pos. Matches may reach back to fstart. The output may
+ * not grow beyond olen. Returns false on malformed input.
+ */
+static bool
+lz4_block_size(const uint8_t *ip, size_t len, size_t fstart, size_t *pos,
+               size_t olen)
+{
+  const uint8_t *iend = ip + len;
+  size_t op = *pos;
+
+  for (;;) {
+    if (ip >= iend)
+      return false;
+
+    unsigned token = *ip++;
+    size_t lit = token >> 4;
+
+    if (lit == 15 && !lz4_length(&ip, iend, &lit))
+      return false;
+    if (lit > (size_t)(iend - ip) || lit > olen - op)
+      return false;
+    op += lit;
+    ip += lit;
+
+    /* The last sequence has no match. */
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return false;
+
+    size_t offset = ip[0] | (ip[1] << 8);
+    size_t mlen   = token & 15;
+    ip += 2;
+
+    if (mlen == 15 && !lz4_length(&ip, iend, &mlen))
+      return false;
+    mlen += LZ4_MIN_MATCH;
+
+    if (offset == 0 || offset > op - fstart || mlen > olen - op)
+      return false;
+    op += mlen;
+  }
+
+  *pos = op;
+  return true;
+}
+
+/**
+ * Decodes one compressed block to out + *pos. Otherwise like
+ * lz4_block_size.
+ */
+static bool
+lz4_block(const uint8_t *ip, size_t len, uint8_t *out, size_t fstart,
+          size_t *pos, size_t olen)
+{
+  const uint8_t *iend  = ip + len;
+  uint8_t       *op    = out + *pos;
+  uint8_t       *oend  = out + olen;
+  uint8_t       *start = out + fstart;
+
+  for (;;) {
+    if (ip >= iend)
+      return false;
+
+    unsigned token = *ip++;
+    size_t lit  = token >> 4;
+    size_t mlen = token & 15;
+    size_t offset;
+
+    /* Most sequences are short. If there is enough room around them,
+       copy fixed amounts of whole words and only advance by the
+       actual lengths. The last sequence never qualifies, because it
+       ends the input. */
+    if (lit < 15 && iend - ip >= 18 && oend - op >= 40) {
+      codec_copy8(op, ip);
+      codec_copy8(op + 8, ip + 8);
+      op += lit;
+      ip += lit;
+
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      if (mlen < 15 && offset >= 8 && offset <= (size_t)(op - start)) {
+        codec_copy8(op, op - offset);
+        codec_copy8(op + 8, op - offset + 8);
+        codec_copy8(op + 16, op - offset + 16);
+        op += mlen + LZ4_MIN_MATCH;
+        continue;
+      }
+    } else {
+      if (lit == 15 && !lz4_length(&ip, iend, &lit))
+        return false;
+      if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+        return false;
+      codec_copy(op, ip, lit);
+      op += lit;
+      ip += lit;
+
+      /* The last sequence has no match. */
+      if (ip == iend)
+        break;
+
+      if (iend - ip < 2)
+        return false;
+      offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+    }
+
+    if (mlen == 15 && !lz4_length(&ip, iend, &mlen))
+      return false;
+    mlen += LZ4_MIN_MATCH;
+
+    if (offset == 0 || offset > (size_t)(op - start) ||
+        mlen > (size_t)(oend - op))
+      return false;
+    tinf_copy_match(op, offset, mlen);
+    op += mlen;
+  }
+
+  *pos = op - out;
+  return true;
+}
+
+/** Parses the frame descriptor at the start of src. */
+static bool
+lz4_header(const uint8_t *src, size_t len, struct lz4_frame *f)
+{
+  size_t pos = 6;
+
+  if (len < 7 || read32(src) != LZ4_MAGIC)
+    return false;
+
+  uint8_t flg = src[4];
+  uint8_t bd  = src[5];
+  unsigned bmax = (bd >> 4) & 7;
+
+  if ((flg & 0xC2) != LZ4_FLG_VERSION || (flg & LZ4_FLG_DICTID) ||
+      (bd & 0x8F) || bmax < 4)
+    return false;
+
+  if (flg & LZ4_FLG_CSIZE)
+    pos += 8;
+  if (pos >= len || ((xxh32(src + 4, pos - 4, 0) >> 8) & 0xFF) != src[pos])
+    return false;
+
+  f->header_len       = pos + 1;
+  f->block_max        = (size_t)1 << (8 + 2 * bmax);
+  f->block_checksum   = flg & LZ4_FLG_BCHECKSUM;
+  f->content_checksum = flg & LZ4_FLG_CCHECKSUM;
+  return true;
+}
+
+/**
+ * Walks the frames in src and decodes them to out, which holds olen
+ * bytes. If out is NULL, nothing is written. The decoded length is
+ * returned in *out_len. Returns false on malformed input.
+ */
+static bool
+lz4_frames(const uint8_t *src, size_t len, uint8_t *out, size_t olen,
+           size_t *out_len)
+{
+  size_t pos = 0;
+  size_t op  = 0;
+
+  while (pos < len) {
+    const uint8_t *frame = src + pos;
+    size_t left = len - pos;
+    struct lz4_frame f;
+
+    if (left < 8)
+      return false;
+
+    if ((read32(frame) & ~0xFU) == LZ4_SKIP_MAGIC) {
+      size_t skip = read32(frame + 4);
+      if (skip > left - 8)
+        return false;
+      pos += 8 + skip;
+      continue;
+    }
+
+    if (!lz4_header(frame, left, &f))
+      return false;
+    pos += f.header_len;
+
+    size_t fstart = op;
+    for (;;) {
+      if (len - pos < 4)
+        return false;
+      uint32_t bh = read32(src + pos);
+      size_t   n  = bh & ~LZ4_BLOCK_RAW;
+      pos += 4;
+
+      if (bh == 0)
+        break;
+      if (n > f.block_max || n > len - pos)
+        return false;
+
+      if (bh & LZ4_BLOCK_RAW) {
+        if (n > olen - op)
+          return false;
+        if (out)
+          memcpy(out + op, src + pos, n);
+        op += n;
+      } else if (out ? !lz4_block(src + pos, n, out, fstart, &op, olen) :
+                 !lz4_block_size(src + pos, n, fstart, &op, olen))
+        return false;
+
+      pos += n;
+      if (f.block_checksum) {
+        if (len - pos < 4)
+          return false;
+        pos += 4;
+      }
+    }
+
+    if (f.content_checksum) {
+      if (len - pos < 4 ||
+          (out && xxh32(out + fstart, op - fstart, 0) != read32(src + pos)))
+        return false;
+      pos += 4;
+    }
+  }
+
+  *out_len = op;
+  return pos == len;
+}
+
+bool
+lz4_size(const void *src, size_t len, size_t *out_len)
+{
+  /* The frame header may carry the content size, but it is optional
+     and the lz4 tool does not write it by default. Walking the
+     sequences is cheap compared to decoding, so always count. */
+  return lz4_frames(src, len, NULL, ~(size_t)0, out_len);
+}
+
+bool
+lz4_decode(void *dst, size_t dst_len, const void *src, size_t len,
+           void *scratch)
+{
+  size_t out_len;
+
+  return lz4_frames(src, len, dst, dst_len, &out_len) && out_len == dst_len;
+}
+
+/* EOF */
@@ -1,17 +1,25 @@
 /* -*- Mode: C -*- */
 
 #include <mbi.h>
+#include <mbi-tools.h>
 #include <stddef.h>
 #include <util.h>
 #include <tinf.h>
+#include <codec.h>
+#include <smp.h>
+#include <phys.h>
+#include <timeline-tools.h>
 
 
-/** Find a sufficiently large block of free memory that is page aligned.
+/**
+ * Finds a sufficiently large block of free memory that is page
+ * aligned and ends below limit_to, which may be far above 4GB. Takes
+ * the block in the highest memory region, if highest is set, and the
+ * first one that fits otherwise.
  */
 bool
-mbi_find_memory(const struct mbi *multiboot_info, size_t len,
-                void **block_start_out, size_t *block_len_out,
-                bool highest, uint64_t const limit_to)
+mbi_find_phys(const struct mbi *multiboot_info, uint64_t len,
+              uint64_t *block_start_out, bool highest, uint64_t const limit_to)
 {
   bool found         = false;
   size_t mmap_len    = multiboot_info->mmap_length;
@@ -21,22 +29,23 @@ mbi_find_memory(const struct mbi *multiboot_info, size_t len,
   if (limit_to <= len)
     return false;
 
-  while ((uint32_t)mmap < multiboot_info->mmap_addr + mmap_len) {
+  for (; (uint32_t)mmap < multiboot_info->mmap_addr + mmap_len;
+       mmap = (memory_map_t *)(mmap->size + (uint32_t)mmap + sizeof(mmap->size))) {
     uint64_t block_len  = (uint64_t)mmap->length_high<<32 | mmap->length_low;
     uint64_t block_addr = (uint64_t)mmap->base_addr_high<<32 | mmap->base_addr_low;
 
     /* Memory blocks may not be page aligned. Round length and address
        to page granularity. */
-    uint64_t nblock_addr = (block_addr + 0xFFF) & ~0xFFF;
+    uint64_t nblock_addr = (block_addr + 0xFFF) & ~0xFFFULL;
     if (nblock_addr > (block_addr + block_len)) continue;
     block_len -= (nblock_addr - block_addr);
-    block_len  = block_len & ~0xFFF;
+    block_len  = block_len & ~0xFFFULL;
     block_addr = nblock_addr;
 
     if ((mmap->type == MMAP_AVAILABLE) && (block_len >= len) &&
         (block_addr <= limit_to - len)) {
 
-      if ((found == true) && ((uintptr_t)*block_start_out > block_addr))
+      if ((found == true) && (*block_start_out > block_addr))
         continue;
 
       found = true;
@@ -46,19 +55,34 @@ mbi_find_memory(const struct mbi *multiboot_info, size_t len,
       if (top_addr > limit_to)
         top_addr = limit_to;
 
-      *block_start_out = (void *)(uintptr_t)top_addr - len;
-      *block_len_out   = (size_t)len;
+      *block_start_out = top_addr - len;
 
       if (!highest) return true;
     }
-  
-    /* Skip to next entry. */
-    mmap = (memory_map_t *)(mmap->size + (uint32_t)mmap + sizeof(mmap->size));
   }
   
   return found;
 }
 
+/** Find a sufficiently large block of free memory that is page
+    aligned and that we can reach, i.e. below 4GB.
+ */
+bool
+mbi_find_memory(const struct mbi *multiboot_info, size_t len,
+                void **block_start_out, size_t *block_len_out,
+                bool highest, uint64_t const limit_to)
+{
+  uint64_t start;
+
+  if (!mbi_find_phys(multiboot_info, len, &start, highest,
+                     MIN(limit_to, 1ULL << 32)))
+    return false;
+
+  *block_start_out = (void *)(uintptr_t)start;
+  *block_len_out   = len;
+  return true;
+}
+
 /** Allocates an aligned block of memory from the multiboot memory
     map. */
 void *
@@ -95,31 +119,201 @@ mbi_alloc_protected_memory(struct mbi *multiboot_info, size_t len, unsigned alig
   assert(0, "No space for ConfigROM.");
 }
 
+/**
+ * Returns the memory an earlier stage published with type in the
+ * memory map or NULL.
+ */
+void *
+mbi_find_published(const struct mbi *mbi, uint32_t type)
+{
+  memory_map_t *mmap = (memory_map_t *)mbi->mmap_addr;
+
+  if ((mbi->flags & MBI_FLAG_MMAP) == 0)
+    return NULL;
+
+  for (; (uint32_t)mmap < mbi->mmap_addr + mbi->mmap_length;
+       mmap = (memory_map_t *)(mmap->size + (uint32_t)mmap + sizeof(mmap->size)))
+    if (mmap->type == type && mmap->base_addr_high == 0)
+      return (void *)mmap->base_addr_low;
+
+  return NULL;
+}
+
+/**
+ * Takes len bytes of protected memory and a copy of the memory map,
+ * which gets another entry of type that covers both. Later stages and
+ * the final kernel find the memory with mbi_find_published().
+ */
+void *
+mbi_publish_memory(struct mbi *mbi, size_t len, uint32_t type)
+{
+  size_t map_len    = mbi->mmap_length + sizeof(memory_map_t);
+  size_t total      = (len + map_len + 0xFFF) & ~0xFFF;
+  char *mem         = mbi_alloc_protected_memory(mbi, total, 12);
+  memory_map_t *map = (memory_map_t *)(mem + len);
+
+  /* Copy the map only now, the allocation shrank one of its entries. */
+  memcpy(map, (const void *)mbi->mmap_addr, mbi->mmap_length);
+
+  memory_map_t *e = (memory_map_t *)((char *)map + mbi->mmap_length);
+  *e = (memory_map_t){ sizeof(*e) - sizeof(e->size), (uintptr_t)mem, 0,
+                       total, 0, type };
+
+  mbi->mmap_addr    = (uintptr_t)map;
+  mbi->mmap_length += sizeof(*e);
+  return mem;
+}
+
+
+/**
+ * Returns the codec of a compressed module that can be decoded or
+ * NULL. The decoded size is returned in decoded.
+ */
+static const struct codec *
+module_codec(struct module *mod, size_t *decoded)
+{
+  const void *data = (const void *)mod->mod_start;
+  size_t len = mod->mod_end - mod->mod_start;
+  const struct codec *codec = codec_find(data, len);
+
+  return (codec && codec->size(data, len, decoded)) ? codec : NULL;
+}
+
+struct decode_job {
+  const struct codec *codec;
+  void       *dst;
+  size_t      dst_len;
+  const void *src;
+  size_t      len;
+  void       *scratch;
+  bool        ok;
+};
+
+static void
+decode_job(void *arg)
+{
+  struct decode_job *job = arg;
+
+  job->ok = job->codec->decode(job->dst, job->dst_len, job->src, job->len,
+                               job->scratch);
+}
+
+extern char _image_start[], _image_end[];
+
+static bool
+overlaps(uint64_t a, uint64_t a_len, uint64_t b, uint64_t b_len)
+{
+  return a < b + b_len && b < a + a_len;
+}
+
+/** Returns whether the module or its string lies in [start, start+len). */
+static bool
+module_overlaps(const struct module *mod, uint64_t start, uint64_t len)
+{
+  return overlaps(start, len, mod->mod_start, mod->mod_end - mod->mod_start) ||
+    overlaps(start, len, mod->string, strlen((const char *)mod->string) + 1);
+}
+
+/** Returns whether an earlier stage moved the module out of the way. */
+static bool
+module_relocated(const struct mbi_relocated *rel, const struct module *mod)
+{
+  for (unsigned i = 0; rel && i < rel->count; i++)
+    if (rel->mod_start[i] == mod->mod_start)
+      return true;
+
+  return false;
+}
 
 /**
- * Returns true of module is compressed and can be inflated. Inflated
- * size is returned in uncompressed.
+ * Returns whether a module has to move: it is to be decoded, lies
+ * above phys_max or would be overwritten by the next stage. If we do
+ * not know what the next stage overwrites (busy is NULL), only
+ * modules that an earlier stage already pushed up stay.
  */
 static bool
-gzip_info(struct module *mod, size_t *uncompressed)
+module_must_move(const struct module *mod, bool decode, bool relocated,
+                 uint64_t phys_max, const struct mbi_range *busy,
+                 unsigned nbusy)
+{
+  if (decode || mod->mod_end > phys_max ||
+      mod->string + strlen((const char *)mod->string) + 1 > phys_max)
+    return true;
+
+  if (!busy)
+    return !relocated;
+
+  for (unsigned i = 0; i < nbusy; i++)
+    if (module_overlaps(mod, busy[i].start, busy[i].len))
+      return true;
+
+  return false;
+}
+
+/**
+ * Returns the lowest address in [start, start+len) that is in use by
+ * a module, the next stage or ourselves, or start+len if there is
+ * none. Modules that are parked elsewhere (if parked is not NULL) do
+ * not count.
+ */
+static uint64_t
+first_clash(const struct mbi *mbi, uint64_t start, uint64_t len,
+            const struct mbi_range *busy, unsigned nbusy, const bool *parked)
 {
-  int ret = tinf_gzip_uncompress(NULL, uncompressed,
-                                 (void *)mod->mod_start,
-                                 mod->mod_end - mod->mod_start);
-  return (ret == TINF_OK);    
+  const struct module *mods = (const struct module *)mbi->mods_addr;
+  uint64_t clash = start + len;
+
+#define CLASH(B, BLEN)                                                  \
+  if (overlaps(start, len, (B), (BLEN)) && MAX((uint64_t)(B), start) < clash) \
+    clash = MAX((uint64_t)(B), start);
+
+  for (unsigned i = 0; i < mbi->mods_count; i++) {
+    if (parked && parked[i])
+      continue;
+    CLASH(mods[i].mod_start, mods[i].mod_end - mods[i].mod_start);
+    CLASH(mods[i].string, strlen((const char *)mods[i].string) + 1);
+  }
+  for (unsigned i = 0; busy && i < nbusy; i++)
+    CLASH(busy[i].start, busy[i].len);
+  CLASH(mbi->mods_addr, mbi->mods_count * sizeof(*mods));
+  CLASH((uintptr_t)mbi, sizeof(*mbi));
+  CLASH((uintptr_t)_image_start, _image_end - _image_start);
+
+#undef CLASH
+
+  return clash;
 }
 
 /**
- * Push all modules to the highest location in memory.  This is
- * somewhat EXPERIMENTAL. If uncompress is true, we transparently
- * uncompress all modules. If uncompress is set and relocation fails,
- * we consider this as fatal error (panic).
+ * Moves modules out of the way of the next stage, which overwrites
+ * the nbusy ranges in busy (or anything, if busy is NULL), and
+ * packs them at the highest location in memory below phys_max. This
+ * is somewhat EXPERIMENTAL. Modules that are not in the way stay
+ * where they are, so a chain of loaders copies each module only
+ * once. Moved modules are published as MMAP_RELOCATED for later
+ * stages.
+ *
+ * If uncompress is true, we transparently uncompress all modules in
+ * any format known to codec_find(), except the first one if
+ * keep_first is set (start_module then inflates it straight into
+ * place). If uncompress is set and relocation fails, we consider this
+ * as fatal error (panic). Modules are decoded in parallel, if there
+ * are several; the APs keep running until smp_park().
+ *
+ * If there is no block large enough between the modules that stay,
+ * the modules that are only copied are parked above 4GB first. Their
+ * old places are then free for the block, which the next stage still
+ * finds below 4GB.
  */
-void
-mbi_relocate_modules(struct mbi *mbi, bool uncompress, uint64_t phys_max)
+static void
+relocate_modules(struct mbi *mbi, bool uncompress, bool keep_first,
+                 uint64_t phys_max, const struct mbi_range *busy,
+                 unsigned nbusy)
 {
   size_t size = 0;
-  bool need_inflate = false;
+  size_t scratch = 0;
+  unsigned need_inflate = 0;
+  unsigned need_move = 0;
 
   if (uncompress)
     tinf_init();
@@ -129,78 +323,196 @@ mbi_relocate_modules(struct mbi *mbi, bool uncompress, uint64_t phys_max)
     size_t modlen;
     size_t slen;
     size_t inflated_size;
-    bool   do_inflate;
+    const struct codec *codec;
+    bool move;
+    bool relocated;             /* by an earlier stage */
+    uint64_t parked_at;
+    struct decode_job job;
   } minfo[mbi->mods_count];
+  bool parked[mbi->mods_count];
+
+  memset(parked, 0, sizeof(parked));
+
+  struct mbi_relocated *rel = mbi_find_published(mbi, MMAP_RELOCATED);
+  if (rel && rel->magic != RELOCATED_MAGIC)
+    rel = NULL;
 
   for (unsigned i = 0; i < mbi->mods_count; i++) {
 
     minfo[i].modlen = mods[i].mod_end - mods[i].mod_start;
     minfo[i].slen   = strlen((const char *)mods[i].string) + 1;
 
-    minfo[i].do_inflate = uncompress && gzip_info(&mods[i], &minfo[i].inflated_size);
-    if (minfo[i].do_inflate)
-      need_inflate = true;
+    minfo[i].codec = (uncompress && !(keep_first && i == 0)) ?
+      module_codec(&mods[i], &minfo[i].inflated_size) : NULL;
+    minfo[i].relocated = module_relocated(rel, &mods[i]);
+    minfo[i].move = module_must_move(&mods[i], minfo[i].codec,
+                                     minfo[i].relocated, phys_max,
+                                     busy, nbusy);
+    if (!minfo[i].move)
+      continue;
+
+    need_move++;
+    if (minfo[i].codec) {
+      need_inflate++;
+      /* Every module gets its own decoder state below the relocated
+         modules, so the decoders do not have to wait for each
+         other. The memory is free again once they are done. */
+      scratch += (minfo[i].codec->scratch + 0xFFF) & ~0xFFF;
+    }
 
-    size += minfo[i].do_inflate ? minfo[i].inflated_size : minfo[i].modlen;
+    size += minfo[i].codec ? minfo[i].inflated_size : minfo[i].modlen;
     size += minfo[i].slen;
 
     /* Round up to page size */
     size = (size + 0xFFF) & ~0xFFF;
   }
 
+  if (need_move == 0) {
+    printf("Modules stay where they are.\n");
+    return;
+  }
+
+  /* Take the memory for the list before we look for a block, so it
+     cannot end up in there. No stage has more modules than the
+     first. */
+  if (!rel && (mbi->flags & MBI_FLAG_MMAP)) {
+    rel = mbi_publish_memory(mbi, sizeof(*rel) + mbi->mods_count * sizeof(uint32_t),
+                             MMAP_RELOCATED);
+    rel->magic = RELOCATED_MAGIC;
+    rel->max   = mbi->mods_count;
+  }
+
   void *block;
   size_t block_len;
+  uint64_t limit;
+  bool tried_parking = false;
+
+ search:
+  limit = phys_max;
 
-  if (mbi_find_memory(mbi, size, &block, &block_len, true, phys_max)) {
-    /* Check for overlap */
-    uintptr_t reladdr = (uintptr_t)block + block_len - size;
-    for (unsigned i = 0; i < mbi->mods_count; i++) {
-      if (mods[i].mod_end > reladdr) {
-        if (reladdr == mods[i].mod_start) {
-          printf("Modules seem to be relocated. Good.\n");
-          goto silent_fail;
-        } else {
-          printf("Modules might overlap.\nRelocate to %p, but module at %8x-%8x.\n",
-                 reladdr, mods[i].mod_start, mods[i].mod_end-1);
+  /* Take the highest free memory that nothing else uses. Whenever
+     there is a clash, search again below it. */
+  while (mbi_find_memory(mbi, size + scratch, &block, &block_len, true, limit)) {
+    uint64_t clash = first_clash(mbi, (uintptr_t)block, block_len, busy, nbusy,
+                                 parked);
+
+    if (clash == (uintptr_t)block + block_len)
+      goto found;
+    limit = clash & ~0xFFFULL;
+  }
+
+  if (!tried_parking) {
+    uint64_t park_size = 0;
+    uint64_t at;
+
+    tried_parking = true;
+    for (unsigned i = 0; i < mbi->mods_count; i++)
+      if (minfo[i].move && !minfo[i].codec)
+        park_size += (minfo[i].modlen + minfo[i].slen + 0xFFF) & ~0xFFF;
+
+    /* The originals stay intact until we found a block, so we can
+       give up at any point. */
+    if (park_size && mbi_find_phys(mbi, park_size, &at, true, ~0ULL) &&
+        at >= 1ULL << 32) {
+      printf("Parking modules at %llx.\n", at);
+
+      for (unsigned i = 0; i < mbi->mods_count; i++) {
+        if (!minfo[i].move || minfo[i].codec)
+          continue;
+        if (!phys_copy(at, mods[i].mod_start, minfo[i].modlen) ||
+            !phys_copy(at + minfo[i].modlen, mods[i].string, minfo[i].slen)) {
+          printf("Cannot reach memory above 4GB.\n");
           goto fail;
         }
+        minfo[i].parked_at = at;
+        parked[i] = true;
+        at += (minfo[i].modlen + minfo[i].slen + 0xFFF) & ~0xFFF;
       }
+      goto search;
     }
+  }
+
+ fail:
+  printf("Cannot relocate.\n");
+  assert(!need_inflate, "Couldn't relocate, which is required for decompressing.");
+  return;
+
+ found:
+  printf("Need %08x bytes to relocate %u of %u modules.\n", size, need_move,
+         mbi->mods_count);
+  printf("Relocating to %08x: \n", (uintptr_t)block + block_len - size);
 
-    printf("Need %8x bytes to relocate modules.\n", size);
-    printf("Relocating to %8x: \n", reladdr);
+  int decode = need_inflate ? timeline_begin("decode") : -1;
 
-    for (int i = mbi->mods_count - 1; i >= 0; i--) {
-      size_t target_len = minfo[i].do_inflate ? minfo[i].inflated_size : minfo[i].modlen;
-      block_len -= (minfo[i].slen + target_len + 0xFFF) & ~0xFFF;
+  if (need_inflate > 1)
+    smp_init(mbi, (struct mbi_range){ (uintptr_t)block, block_len },
+             busy, busy ? nbusy : 0);
+
+  for (int i = mbi->mods_count - 1; i >= 0; i--) {
+    if (!minfo[i].move)
+      continue;
+
+    size_t target_len = minfo[i].codec ? minfo[i].inflated_size : minfo[i].modlen;
+    block_len -= (minfo[i].slen + target_len + 0xFFF) & ~0xFFF;
     
-      if (minfo[i].do_inflate) {
-        size_t uncompressed;
-        printf("Inflating %u -> %u bytes...\n", minfo[i].modlen, target_len);
-        int res = tinf_gzip_uncompress((char *)block + block_len, &uncompressed,
-                                       (void *)mods[i].mod_start, minfo[i].modlen);
-        assert((res == TINF_OK) && (uncompressed == target_len),
-               "Error decompressing data.");
-      } else {
-        printf("Copying %u bytes...\n", minfo[i].modlen);
-        memcpy((char *)block + block_len, (void *)mods[i].mod_start,
-               minfo[i].modlen);
-      }
-      mods[i].mod_start = (size_t)((char *)block + block_len);
-      mods[i].mod_end = mods[i].mod_start + target_len;
+    if (minfo[i].codec) {
+      struct decode_job *job = &minfo[i].job;
+
+      printf("Inflating %s %u -> %u bytes...\n", minfo[i].codec->name,
+             minfo[i].modlen, target_len);
+      job->codec   = minfo[i].codec;
+      job->dst     = (char *)block + block_len;
+      job->dst_len = target_len;
+      job->src     = (void *)mods[i].mod_start;
+      job->len     = minfo[i].modlen;
+      scratch     -= (minfo[i].codec->scratch + 0xFFF) & ~0xFFF;
+      job->scratch = (char *)block + scratch;
+      smp_submit(decode_job, job);
+    } else if (parked[i]) {
+      printf("Copying %u bytes from %llx...\n", minfo[i].modlen,
+             minfo[i].parked_at);
+      phys_copy((uintptr_t)block + block_len, minfo[i].parked_at,
+                minfo[i].modlen);
+    } else {
+      printf("Copying %u bytes...\n", minfo[i].modlen);
+      memcpy((char *)block + block_len, (void *)mods[i].mod_start,
+             minfo[i].modlen);
+    }
+    mods[i].mod_start = (size_t)((char *)block + block_len);
+    mods[i].mod_end = mods[i].mod_start + target_len;
 
+    if (parked[i])
+      phys_copy((uintptr_t)block + block_len + target_len,
+                minfo[i].parked_at + minfo[i].modlen, minfo[i].slen);
+    else
       memcpy((char *)block + block_len + target_len, 
              (void *)mods[i].string, minfo[i].slen);
-      mods[i].string = (uintptr_t)((char *)block + block_len + target_len);
-    }
-    printf("\n");
+    mods[i].string = (uintptr_t)((char *)block + block_len + target_len);
+  }
 
-  } else {
-  fail:
-    printf("Cannot relocate.\n");
-  silent_fail:
-    assert(!need_inflate, "Couldn't relocate, which is required for decompressing.");
+  if (rel) {
+    rel->count = 0;
+    for (unsigned i = 0; i < mbi->mods_count && rel->count < rel->max; i++)
+      if (minfo[i].move || minfo[i].relocated)
+        rel->mod_start[rel->count++] = mods[i].mod_start;
   }
+
+  smp_wait();
+  timeline_end(decode);
+  for (unsigned i = 0; i < mbi->mods_count; i++)
+    assert(!minfo[i].codec || minfo[i].job.ok, "Error decompressing data.");
+  printf("\n");
+}
+
+void
+mbi_relocate_modules(struct mbi *mbi, bool uncompress, bool keep_first,
+                     uint64_t phys_max, const struct mbi_range *busy,
+                     unsigned nbusy)
+{
+  int phase = timeline_begin("relocate");
+
+  relocate_modules(mbi, uncompress, keep_first, phys_max, busy, nbusy);
+  timeline_end(phase);
 }
 
 
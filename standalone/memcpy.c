@@ -1,12 +1,158 @@
 /* -*- Mode: C -*- */
 
 #include <util.h>
+#include <cpuid.h>
+
+int    mem_kernel       = MEM_AUTO;
+size_t mem_nt_threshold = MEM_NT_OFF;
+
+/**
+ * Returns the size of the largest cache in bytes or 0, if CPUID does
+ * not tell.
+ */
+static size_t
+mem_cache_size(void)
+{
+  uint32_t r[4];
+  size_t size = 0;
+
+  cpuid(0, 0, r);
+  if (r[0] >= 4)
+    /* Deterministic cache parameters */
+    for (unsigned i = 0; i < 16; i++) {
+      cpuid(4, i, r);
+      if ((r[0] & 0x1F) == 0)
+        break;
+
+      size = MAX(size, (size_t)((r[1] >> 22) + 1) * (((r[1] >> 12) & 0x3FF) + 1) *
+                 ((r[1] & 0xFFF) + 1) * (r[2] + 1));
+    }
+
+  if (size == 0) {
+    /* AMD reports L2 and L3 in extended leaves. */
+    cpuid(0x80000000, 0, r);
+    if (r[0] >= 0x80000006) {
+      cpuid(0x80000006, 0, r);
+      size = MAX((size_t)(r[2] >> 16) << 10, (size_t)(r[3] >> 18) << 19);
+    }
+  }
+
+  return size;
+}
+
+/**
+ * Selects the string instructions memcpy and memset use and from
+ * which size on they bypass the cache with non-temporal SSE2
+ * stores. MEM_AUTO takes rep movsb on CPUs with fast short strings
+ * (ERMS or FSRM), otherwise rep movsd. An nt_threshold of 0 picks
+ * the size of the largest cache, copies beyond it would evict
+ * everything anyway. Returns the kernel in use.
+ */
+int
+mem_select(int kernel, size_t nt_threshold)
+{
+  uint32_t r[4];
+  uint32_t max_leaf;
+  bool sse2;
+
+  cpuid(0, 0, r);
+  max_leaf = r[0];
+  cpuid(1, 0, r);
+  sse2 = (r[3] >> 26) & 1;
+
+  if (kernel == MEM_AUTO) {
+    bool fast_strings = false;
+
+    if (max_leaf >= 7) {
+      cpuid(7, 0, r);
+      fast_strings = ((r[1] >> 9) & 1) || ((r[3] >> 4) & 1);
+    }
+    kernel = fast_strings ? MEM_MOVSB : MEM_MOVSD;
+  }
+
+  if (nt_threshold == 0) {
+    nt_threshold = mem_cache_size();
+    if (nt_threshold == 0)
+      nt_threshold = 4 << 20;
+  }
+
+  /* The streaming loop needs at least one aligned block. */
+  mem_nt_threshold = sse2 ? MAX(nt_threshold, (size_t)128) : MEM_NT_OFF;
+  /* Other CPUs may check mem_kernel at any time. */
+  memory_barrier();
+  mem_kernel       = kernel;
+  return kernel;
+}
+
+static inline void
+memcpy_movsb(char *d, const char *s, size_t n)
+{
+  asm volatile  ("rep movsb" : "+D" (d), "+S" (s) , "+c" (n) : : "memory");
+}
+
+/** Copies bytes until the destination is aligned and then dwords. */
+static void
+memcpy_movsd(char *d, const char *s, size_t n)
+{
+  if (n >= 16) {
+    size_t head  = -(uintptr_t)d & 3;
+    size_t words = (n - head) >> 2;
+
+    n = (n - head) & 3;
+    asm volatile ("rep movsb" : "+D" (d), "+S" (s), "+c" (head) : : "memory");
+    asm volatile ("rep movsl" : "+D" (d), "+S" (s), "+c" (words) : : "memory");
+  }
+  memcpy_movsb(d, s, n);
+}
+
+/** Copies with non-temporal 16 byte stores, which write whole cache
+    lines without reading them first. n is at least 128. */
+__attribute__((target("sse2")))
+static void
+memcpy_nt(char *d, const char *s, size_t n)
+{
+  size_t head = -(uintptr_t)d & 15;
+
+  memcpy_movsb(d, s, head);
+  d += head;
+  s += head;
+  n -= head;
+
+  size_t blocks = n >> 6;
+  n &= 63;
+
+  asm volatile ("1:\n"
+                "movdqu    (%1), %%xmm0\n"
+                "movdqu  16(%1), %%xmm1\n"
+                "movdqu  32(%1), %%xmm2\n"
+                "movdqu  48(%1), %%xmm3\n"
+                "movntdq %%xmm0,   (%0)\n"
+                "movntdq %%xmm1, 16(%0)\n"
+                "movntdq %%xmm2, 32(%0)\n"
+                "movntdq %%xmm3, 48(%0)\n"
+                "add $64, %0\n"
+                "add $64, %1\n"
+                "dec %2\n"
+                "jnz 1b\n"
+                "sfence\n"
+                : "+r" (d), "+r" (s), "+r" (blocks)
+                :
+                : "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc");
+
+  memcpy_movsb(d, s, n);
+}
 
 void *
 memcpy(void *dest, const void *src, size_t n)
 {
-  char *d = dest;
-  const char *s = src;
-  asm volatile  ("rep movsb" : "+D" (d), "+S" (s) , "+c" (n) : : "memory");
+  if (mem_kernel == MEM_AUTO)
+    mem_select(MEM_AUTO, 0);
+
+  if (n >= mem_nt_threshold)
+    memcpy_nt(dest, src, n);
+  else if (mem_kernel == MEM_MOVSD)
+    memcpy_movsd(dest, src, n);
+  else
+    memcpy_movsb(dest, src, n);
   return dest;
 }
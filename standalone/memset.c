@@ -2,10 +2,73 @@
 
 #include <util.h>
 
+static inline void
+memset_stosb(char *d, uint32_t v, size_t n)
+{
+  asm volatile  ("rep stosb" : "+D" (d), "+c" (n) : "a" (v) : "memory");
+}
+
+/** Stores bytes until the destination is aligned and then dwords. */
+static void
+memset_stosd(char *d, uint32_t v, size_t n)
+{
+  if (n >= 16) {
+    size_t head  = -(uintptr_t)d & 3;
+    size_t words = (n - head) >> 2;
+
+    n = (n - head) & 3;
+    asm volatile ("rep stosb" : "+D" (d), "+c" (head) : "a" (v) : "memory");
+    asm volatile ("rep stosl" : "+D" (d), "+c" (words) : "a" (v) : "memory");
+  }
+  memset_stosb(d, v, n);
+}
+
+/** Fills with non-temporal 16 byte stores, see memcpy_nt. n is at
+    least 128. */
+__attribute__((target("sse2")))
+static void
+memset_nt(char *d, uint32_t v, size_t n)
+{
+  size_t head = -(uintptr_t)d & 15;
+
+  memset_stosb(d, v, head);
+  d += head;
+  n -= head;
+
+  size_t blocks = n >> 6;
+  n &= 63;
+
+  asm volatile ("movd %2, %%xmm0\n"
+                "pshufd $0, %%xmm0, %%xmm0\n"
+                "1:\n"
+                "movntdq %%xmm0,   (%0)\n"
+                "movntdq %%xmm0, 16(%0)\n"
+                "movntdq %%xmm0, 32(%0)\n"
+                "movntdq %%xmm0, 48(%0)\n"
+                "add $64, %0\n"
+                "dec %1\n"
+                "jnz 1b\n"
+                "sfence\n"
+                : "+r" (d), "+r" (blocks)
+                : "r" (v)
+                : "xmm0", "memory", "cc");
+
+  memset_stosb(d, v, n);
+}
+
 void *
 memset(void *dst, int c, size_t n)
 {
-  const char *d = dst;
-  asm volatile  ("rep stosb" : "+D" (d), "+c" (n) : "a" (c) : "memory");
+  uint32_t v = (uint8_t)c * 0x01010101U;
+
+  if (mem_kernel == MEM_AUTO)
+    mem_select(MEM_AUTO, 0);
+
+  if (n >= mem_nt_threshold)
+    memset_nt(dst, v, n);
+  else if (mem_kernel == MEM_MOVSD)
+    memset_stosd(dst, v, n);
+  else
+    memset_stosb(dst, v, n);
   return dst;
 }
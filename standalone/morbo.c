@@ -12,8 +12,16 @@
 #include <ohci.h>
 #include <cpuid.h>
 #include <elf.h>
+#include <dispatch.h>
+#include <timeline-tools.h>
+#include <bootlog-tools.h>
+#include <asm.h>
 
-/* TODO: Select OHCI if there is more than one. */
+/* Controllers we bring up at most */
+#define OHCI_MAX 4
+
+/* How often we look for bus resets while we wait to be booted */
+#define EVENT_POLL_MS 1
 
 /* Globals */
 struct mbi *multiboot_info = 0;
@@ -25,6 +33,38 @@ static bool keep_going = false;
 static bool do_wait = false;
 static bool posted_writes = false;
 static enum link_speed speed = SPEED_MAX;
+static struct pci_filter ohci_filter[OHCI_MAX]; /* all, if empty */
+static unsigned ohci_filters = 0;
+
+/** Parses ohci=<spec>[,<spec>...], see pci_filter_parse(). */
+static void
+parse_ohci_filters(char *specs)
+{
+  char *last_ptr = NULL;
+
+  for (char *spec = strtok_r(specs, ",", &last_ptr);
+       spec != NULL && ohci_filters < OHCI_MAX;
+       spec = strtok_r(NULL, ",", &last_ptr)) {
+    struct pci_filter *f = &ohci_filter[ohci_filters];
+
+    pci_filter_init(f, PCI_CLASS_ANY, PCI_SUBCLASS_ANY);
+    if (pci_filter_parse(f, spec))
+      ohci_filters++;
+  }
+}
+
+static bool
+ohci_selected(uint32_t cfg_address)
+{
+  if (ohci_filters == 0)
+    return true;
+
+  for (unsigned i = 0; i < ohci_filters; i++)
+    if (pci_filter_match(&ohci_filter[i], cfg_address))
+      return true;
+
+  return false;
+}
 
 void
 parse_cmdline(const char *cmdline)
@@ -60,6 +100,8 @@ parse_cmdline(const char *cmdline)
       speed = SPEED_S200;
     } else if (strcmp(token, "s400") == 0) {
       speed = SPEED_S400;
+    } else if (strncmp(token, "ohci=", 5) == 0) {
+      parse_ohci_filters(token + 5);
     } else {
       /* printf not possible yet. */
       //printf("Ignoring unrecognized argument: %s.\n", token);
@@ -75,6 +117,10 @@ main(uint32_t magic, struct mbi *mbi)
     multiboot_info = mbi;
     if ((mbi->flags & MBI_FLAG_CMDLINE) != 0)
       parse_cmdline((const char *)mbi->cmdline);
+    console_configure(mbi);
+    timeline_init(mbi, "morbo");
+    bootlog_init(mbi);
+    pci_inventory_init(mbi);
   } else {
     serial_init();
     printf("Not loaded by Multiboot-compliant loader. Bye.\n");
@@ -85,6 +131,8 @@ main(uint32_t magic, struct mbi *mbi)
   printf("\nMorbo %s\n", version_str);
   printf("Blame Julian Stecklina <jsteckli@os.inf.tu-dresden.de> for bugs.\n\n");
 
+  cpu_dispatch(mbi);
+
   /* Check for APIC support */
   if (force_enable_apic && !has_apic()) {
 
@@ -104,24 +152,54 @@ main(uint32_t magic, struct mbi *mbi)
   if (posted_writes)
     printf("Posted writes will be enabled. Disable them, if you experience problems.\n");
 
-  printf("Trying to find an OHCI controller... ");
+  printf("Trying to find OHCI controllers... ");
+
+  static struct pci_device pci_ohci[OHCI_MAX];
+  static struct ohci_controller ohci[OHCI_MAX];
+  struct pci_filter any_ohci;
+  struct pci_device dev = { .cfg_address = 0 };
+  unsigned ohci_count = 0;
+  unsigned ohci_up = 0;
 
-  struct pci_device pci_ohci;
-  struct ohci_controller ohci;
+  pci_filter_init(&any_ohci, PCI_CLASS_SERIAL_BUS_CTRL, PCI_SUBCLASS_IEEE_1394);
+  while (ohci_count < OHCI_MAX && pci_next(&any_ohci, &dev))
+    if (ohci_selected(dev.cfg_address))
+      pci_ohci[ohci_count++] = dev;
 
-  if (!pci_find_device_by_class(PCI_CLASS_SERIAL_BUS_CTRL, PCI_SUBCLASS_IEEE_1394, &pci_ohci)) {
+  if (ohci_count == 0) {
     printf("No OHCI found.\n");
     goto error;
   } else {
-    printf("OK\n");
+    printf("%u found.\n", ohci_count);
   }
 
-  if (!ohci_initialize(&pci_ohci, &ohci, posted_writes, speed)) {
-    printf("Could not initialize controller.\n");
-    goto error;
-  } else {
-    printf("Initialization complete.\n");
+  /* All controllers come up at the same time. Meanwhile we move the
+     modules we already have into place, unless we wait for the
+     remote end, which might still change them. */
+  int phase = timeline_begin("ohci init");
+  for (unsigned i = 0; i < ohci_count; i++)
+    if (!ohci_start(&pci_ohci[i], &ohci[i], posted_writes, speed))
+      printf("Could not initialize controller %u.\n", i);
+
+  if (mbi->mods_count != 0 && !do_wait)
+    prepare_module(mbi, false, PHYS_MAX_RELOCATE);
+
+  for (bool pending = true; pending; cpu_pause()) {
+    pending = false;
+    for (unsigned i = 0; i < ohci_count; i++)
+      pending |= ohci_step(&ohci[i]) < OHCI_UP;
   }
+  timeline_end(phase);
+
+  /* Keep the controllers that came up. */
+  for (unsigned i = 0; i < ohci_count; i++)
+    if (ohci[i].state == OHCI_UP)
+      ohci[ohci_up++] = ohci[i];
+
+  if (ohci_up < ohci_count)
+    goto error;
+
+  printf("Initialization complete.\n");
 
   goto no_error;
  error:
@@ -141,7 +219,15 @@ main(uint32_t magic, struct mbi *mbi)
        module... */
     *modules = 0;
     while (*modules == 0) {
-      ohci_poll_events(&ohci);
+      deadline_t poll = deadline_in(EVENT_POLL_MS);
+
+      for (unsigned i = 0; i < ohci_up; i++)
+        ohci_poll_events(&ohci[i]);
+
+      /* Reading controller registers competes with the writes we
+         wait for. In between, sleep until the remote end writes. */
+      while (*modules == 0 && !deadline_passed(poll))
+        wait_change(modules, 0, poll);
     }
   }
 
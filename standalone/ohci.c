@@ -15,6 +15,7 @@
 
 #include <mbi.h>
 #include <mbi-tools.h>
+#include <bootlog-tools.h>
 #include <morbo.h>
 
 #include <util.h>
@@ -26,9 +27,12 @@
 
 /* Constants */
 
+/* Timeouts in milliseconds */
 #define RESET_TIMEOUT 10000
 #define PHY_TIMEOUT   10000
 #define MISC_TIMEOUT  10000
+#define BUS_RESET_TIMEOUT 1000
+#define BUS_SETTLE_TIME     20	/* without another bus reset */
 
 /* Globals */
 
@@ -94,9 +98,10 @@ ohci_generate_crom(struct ohci_controller *ohci, enum link_speed speed)
   crom->field[16] = ' v2\0';
   crom->field[10] |= crc16(&(crom->field[11]), 6);
 
-  crom->field[17] = 0x001 << 16; /* 1 words follow */
+  crom->field[17] = 0x002 << 16; /* 2 words follow */
   crom->field[18] = (uint32_t)multiboot_info; /* Pointer to multiboot info */
-  crom->field[17] |= crc16(&(crom->field[18]), 1);
+  crom->field[19] = (uint32_t)bootlog_get();  /* Boot log ring or 0 */
+  crom->field[17] |= crc16(&(crom->field[18]), 2);
 
 }
 
@@ -140,17 +145,19 @@ ohci_load_crom(struct ohci_controller *ohci)
 
 
 
+/** Polls reg until the bits in mask have the given value. Gives up
+    after timeout milliseconds. */
 static void
-wait_loop(struct ohci_controller *ohci, uint32_t reg, uint32_t mask, uint32_t value, uint32_t max_ticks)
+wait_loop(struct ohci_controller *ohci, uint32_t reg, uint32_t mask, uint32_t value, uint32_t timeout)
 {
-  unsigned i = 0;
+  deadline_t deadline = deadline_in(timeout);
 
   while ((OHCI_REG(ohci, reg) & mask) != value) {
-    wait(1);
-    if (i++ > max_ticks) {
+    if (deadline_passed(deadline)) {
       printf("waiting for reg %x mask %x value %x\n", reg, mask, value);
       __exit(0xdeeed);
     }
+    cpu_pause();
   }
 }
 
@@ -200,17 +207,6 @@ ohci_force_bus_reset(struct ohci_controller *ohci)
   phy_write(ohci, 1, phy1);
 }
 
-/** Perform a soft-reset of the Open Host Controller and wait until it
- *  has reinitialized itself.
- */
-static void
-ohci_softreset(struct ohci_controller *ohci)
-{
-  OHCI_INFO("Soft-resetting controller...\n");
-  OHCI_REG(ohci, HCControlSet) = HCControl_softReset;
-  wait_loop(ohci, HCControlSet, HCControl_softReset, 0, RESET_TIMEOUT);
-}
-
 /* Check version of controller. Returns true, if it is supported. */
 static bool
 ohci_check_version(struct ohci_controller *ohci)
@@ -232,15 +228,25 @@ ohci_check_version(struct ohci_controller *ohci)
   return true;
 }
 
+/** Enters state, which must be left within timeout milliseconds. */
+static void
+ohci_enter(struct ohci_controller *ohci, enum ohci_state state, unsigned timeout)
+{
+  ohci->state    = state;
+  ohci->deadline = deadline_in(timeout);
+}
+
 bool
-ohci_initialize(const struct pci_device *pci_dev,
-		struct ohci_controller *ohci,
-		bool posted_writes,
-		enum link_speed speed)
+ohci_start(const struct pci_device *pci_dev,
+	   struct ohci_controller *ohci,
+	   bool posted_writes,
+	   enum link_speed speed)
 {
   ohci->pci = pci_dev;
   ohci->ohci_regs = (volatile uint32_t *) pci_cfg_read_uint32(ohci->pci, PCI_CFG_BAR0);
   ohci->posted_writes = posted_writes;
+  ohci->speed = speed;
+  ohci->state = OHCI_FAILED;
 
   assert((uint32_t)ohci->ohci_regs != 0xFFFFFFFF, "Invalid PCI read?");
 
@@ -259,85 +265,27 @@ ohci_initialize(const struct pci_device *pci_dev,
     return false;
   }
 
-  /* Do a softreset. */
-  ohci_softreset(ohci);
-
-  /* Disable linkEnable to be able to configure the low level stuff. */
-  OHCI_REG(ohci, HCControlClear) = HCControl_linkEnable;
-  wait_loop(ohci, HCControlSet, HCControl_linkEnable, 0, MISC_TIMEOUT);
-
-  /* Disable stuff we don't want/need, including byte swapping. */
-  OHCI_REG(ohci, HCControlClear) = HCControl_noByteSwapData | HCControl_ackTardyEnable;
-
-  /* Enable (or disable) posted writes. With posted writes enabled, the controller
-     may return ack_complete for physical write requests, even if the
-     data has not been written yet. For coherency considerations,
-     refer to Chapter 3.3.3 in the OHCI spec. */
-  OHCI_REG(ohci, posted_writes ? HCControlSet : HCControlClear) = HCControl_postedWriteEnable;
-
-  /* XXX BEGIN CRAP CODE Enable LPS. This is more complicated than it
-     should be, but hardware sucks... */
-  unsigned lps_retries;
-  for (lps_retries = 10; lps_retries > 0; lps_retries--) {
-    unsigned wait_more_cnt = 10;
-    uint32_t phycontrol, intevent;
-
-    OHCI_REG(ohci, HCControlSet) = HCControl_LPS;
-    wait_loop(ohci, HCControlSet, HCControl_LPS, HCControl_LPS, MISC_TIMEOUT);
-
-    wait(50);			/* SCLK should be up by now */
-
-    OHCI_REG(ohci, IntEventClear) = ~0U;
-    OHCI_REG(ohci, PhyControl) = PhyControl_Read(1);
-
-  wait_some_more:
-    wait(50);
-
-    phycontrol = OHCI_REG(ohci, PhyControl);
-    intevent   = OHCI_REG(ohci, IntEventSet);
-    if (((phycontrol & PhyControl_ReadDone) == 0) &&
-	((intevent   & regAccessFail) == 0)) {
-      /* Nothing happened yet. This can mean two things: a) the read
-	 is not completed, which is unlikely given that we waited 10ms
-	 for it. b) SCLK did not start and the PHY is not
-	 available. In the latter case regAccessFail should be set,
-	 but this does not seem to work. */
-      OHCI_INFO("SCLK seems not to be running.\n");
-      /* Start over. */
-      goto next;
-    }
-
-    if ((intevent & regAccessFail) != 0) {
-      /* SCLK has not started yet. Wait some more. */
-      OHCI_INFO("regAccessFail while waiting for SCLK to start.\n");
-      if (wait_more_cnt-- > 0)
-	goto wait_some_more;
-      else {
-	OHCI_INFO("LPS did not come up.\n");
-	return false;
-      }
-    }
-
-    /* Read done. */
-    break;
-
-  next:
-    OHCI_INFO("%d retries left.\n", lps_retries);
-
-    /* Disable LPS */
-    OHCI_REG(ohci, HCControlClear) = HCControl_LPS;
-    OHCI_INFO("Waiting for LPS clear.\n");
-    wait_loop(ohci, HCControlSet, HCControl_LPS, 0, MISC_TIMEOUT);
-    OHCI_INFO("Done.\n");
-  }
+  /* Take our buffers now. Callers may move modules around while we
+     are still coming up. */
+  ohci->selfid_buf = mbi_alloc_protected_memory(multiboot_info, sizeof(uint32_t[504]), 11);
+  OHCI_INFO("Allocated SelfID buffer at %p.\n", ohci->selfid_buf);
+  ohci->crom = mbi_alloc_protected_memory(multiboot_info, sizeof(ohci_config_rom_t), 10);
+  OHCI_INFO("ConfigROM allocated at %p.\n", ohci->crom);
 
-  if (lps_retries == 0) {
-    OHCI_INFO("LPS did not come up.\n");
-    return false;
-  }
+  /* Do a softreset. */
+  OHCI_INFO("Soft-resetting controller...\n");
+  OHCI_REG(ohci, HCControlSet) = HCControl_softReset;
+  ohci_enter(ohci, OHCI_SOFTRESET, RESET_TIMEOUT);
 
-  /* XXX END CRAP CODE */
+  return true;
+}
 
+/** Configures the PHY and the link once LPS is up and enables the
+    link. PHY accesses only take microseconds now, so we do them in
+    one go. */
+static void
+ohci_setup_link(struct ohci_controller *ohci)
+{
   /* Disable contender bit */
   uint8_t phy4 = phy_read(ohci, 4);
   phy_write(ohci, 4, phy4 & ~0x40);
@@ -398,9 +346,6 @@ ohci_initialize(const struct pci_device *pci_dev,
   /* } */
 
   /* Set SelfID buffer */
-  ohci->selfid_buf = mbi_alloc_protected_memory(multiboot_info, sizeof(uint32_t[504]), 11);
-  OHCI_INFO("Allocated SelfID buffer at %p.\n", ohci->selfid_buf);
-
   ohci->selfid_buf[0] = 0xDEADBEEF; /* error checking */
   OHCI_REG(ohci, SelfIDBuffer) = (uint32_t)ohci->selfid_buf;
   OHCI_REG(ohci, LinkControlSet) = LinkControl_rcvSelfID;
@@ -413,37 +358,175 @@ ohci_initialize(const struct pci_device *pci_dev,
   }
 
   /* Set Config ROM */
-  ohci->crom = mbi_alloc_protected_memory(multiboot_info, sizeof(ohci_config_rom_t), 10);
-  OHCI_INFO("ConfigROM allocated at %p.\n", ohci->crom);
-
-  ohci_generate_crom(ohci, speed);
+  ohci_generate_crom(ohci, ohci->speed);
   ohci_load_crom(ohci);
 
   /* enable link */
   OHCI_REG(ohci, HCControlSet) = HCControl_linkEnable;
+}
+
+/** Turns LPS on for another try. */
+static void
+ohci_lps_on(struct ohci_controller *ohci)
+{
+  OHCI_REG(ohci, HCControlSet) = HCControl_LPS;
+  ohci_enter(ohci, OHCI_LPS_ON, MISC_TIMEOUT);
+}
+
+enum ohci_state
+ohci_step(struct ohci_controller *ohci)
+{
+  if (ohci->state >= OHCI_UP)
+    return ohci->state;
+
+  uint32_t hccontrol = OHCI_REG(ohci, HCControlSet);
+
+  switch (ohci->state) {
+  case OHCI_SOFTRESET:
+    if (hccontrol & HCControl_softReset)
+      break;
+
+    /* Disable linkEnable to be able to configure the low level stuff. */
+    OHCI_REG(ohci, HCControlClear) = HCControl_linkEnable;
+    ohci_enter(ohci, OHCI_LINK_OFF, MISC_TIMEOUT);
+    break;
+
+  case OHCI_LINK_OFF:
+    if (hccontrol & HCControl_linkEnable)
+      break;
+
+    /* Disable stuff we don't want/need, including byte swapping. */
+    OHCI_REG(ohci, HCControlClear) = HCControl_noByteSwapData | HCControl_ackTardyEnable;
 
-  /* Wait for link to come up. */
-  wait_loop(ohci, HCControlSet, HCControl_linkEnable, HCControl_linkEnable, MISC_TIMEOUT);
-  OHCI_INFO("Link is up. Force bus reset.\n");
+    /* Enable (or disable) posted writes. With posted writes enabled, the controller
+       may return ack_complete for physical write requests, even if the
+       data has not been written yet. For coherency considerations,
+       refer to Chapter 3.3.3 in the OHCI spec. */
+    OHCI_REG(ohci, ohci->posted_writes ? HCControlSet : HCControlClear) = HCControl_postedWriteEnable;
+
+    /* XXX Enabling LPS is more complicated than it should be, but
+       hardware sucks... */
+    ohci->lps_retries = 10;
+    ohci_lps_on(ohci);
+    break;
+
+  case OHCI_LPS_ON:
+    if ((hccontrol & HCControl_LPS) == 0)
+      break;
+
+    ohci_enter(ohci, OHCI_SCLK, MISC_TIMEOUT);
+    ohci->wait = deadline_in(50);	/* SCLK should be up by then */
+    break;
+
+  case OHCI_SCLK:
+    if (!deadline_passed(ohci->wait))
+      break;
+
+    OHCI_REG(ohci, IntEventClear) = ~0U;
+    OHCI_REG(ohci, PhyControl) = PhyControl_Read(1);
+    ohci->wait_more = 10;
+    ohci_enter(ohci, OHCI_PHY_READ, MISC_TIMEOUT);
+    ohci->wait = deadline_in(50);
+    break;
+
+  case OHCI_PHY_READ: {
+    /* Give the read 50ms, but stop as soon as it is done. */
+    uint32_t phycontrol = OHCI_REG(ohci, PhyControl);
+
+    if (phycontrol & PhyControl_ReadDone) {
+      ohci_setup_link(ohci);
+      ohci_enter(ohci, OHCI_LINK_ON, MISC_TIMEOUT);
+      break;
+    }
 
-  /* Force bus reset and wait for it to complete and then some more
-     for the link to calm down. */
-  uint8_t generation = (OHCI_REG(ohci, SelfIDCount) >> 16) & 0xFF;
-  unsigned poll_count = 0;
-  ohci_force_bus_reset(ohci);
+    if (!deadline_passed(ohci->wait))
+      break;
 
-  while (poll_count++ < 1000) {
+    if (OHCI_REG(ohci, IntEventSet) & regAccessFail) {
+      /* SCLK has not started yet. Wait some more. */
+      OHCI_INFO("regAccessFail while waiting for SCLK to start.\n");
+      if (ohci->wait_more-- == 0) {
+	OHCI_INFO("LPS did not come up.\n");
+	ohci->state = OHCI_FAILED;
+	break;
+      }
+      ohci_enter(ohci, OHCI_PHY_READ, MISC_TIMEOUT);
+      ohci->wait = deadline_in(50);
+      break;
+    }
+
+    /* Nothing happened yet. This can mean two things: a) the read
+       is not completed, which is unlikely given that we waited 50ms
+       for it. b) SCLK did not start and the PHY is not
+       available. In the latter case regAccessFail should be set,
+       but this does not seem to work. */
+    OHCI_INFO("SCLK seems not to be running.\n");
+    if (--ohci->lps_retries == 0) {
+      OHCI_INFO("LPS did not come up.\n");
+      ohci->state = OHCI_FAILED;
+      break;
+    }
+    OHCI_INFO("%d retries left.\n", ohci->lps_retries);
+
+    /* Disable LPS and start over. */
+    OHCI_REG(ohci, HCControlClear) = HCControl_LPS;
+    ohci_enter(ohci, OHCI_LPS_OFF, MISC_TIMEOUT);
+    break;
+  }
+
+  case OHCI_LPS_OFF:
+    if ((hccontrol & HCControl_LPS) == 0)
+      ohci_lps_on(ohci);
+    break;
+
+  case OHCI_LINK_ON:
+    if ((hccontrol & HCControl_linkEnable) == 0)
+      break;
+
+    /* Force bus reset and wait for its self-ID phase to complete and
+       then until no other reset follows for a while. The generation
+       in SelfIDCount changes with every completed self-ID phase. */
+    OHCI_INFO("Link is up. Force bus reset.\n");
+    ohci->generation = (OHCI_REG(ohci, SelfIDCount) >> 16) & 0xFF;
+    ohci->seen       = ohci->generation;
+    ohci->wait       = 0;
+    ohci_enter(ohci, OHCI_SETTLE, BUS_RESET_TIMEOUT);
+    ohci_force_bus_reset(ohci);
+    break;
+
+  case OHCI_SETTLE: {
     ohci_poll_events(ohci);
-    wait(1);
+
+    uint8_t current = (OHCI_REG(ohci, SelfIDCount) >> 16) & 0xFF;
+    if (current != ohci->seen) {
+      ohci->seen = current;
+      ohci->wait = deadline_in(BUS_SETTLE_TIME);
+    }
+
+    if (!deadline_passed(ohci->deadline) &&
+	!(ohci->wait && deadline_passed(ohci->wait)))
+      break;
+
+    if (ohci->generation == current)
+      OHCI_INFO("No bus reset (or a lot of them)? Things may be b0rken.\n");
+
+    /* Print GUID for easy reference. */
+    OHCI_INFO("GUID: 0x%llx\n", (uint64_t)(OHCI_REG(ohci, GUIDHi)) << 32 | OHCI_REG(ohci, GUIDLo));
+    ohci->state = OHCI_UP;
+    break;
   }
 
-  if (generation == ((OHCI_REG(ohci, SelfIDCount) >> 16) & 0xFF))
-    OHCI_INFO("No bus reset (or a lot of them)? Things may be b0rken.\n");
+  case OHCI_UP:
+  case OHCI_FAILED:
+    break;
+  }
 
-  /* Print GUID for easy reference. */
-  OHCI_INFO("GUID: 0x%llx\n", (uint64_t)(OHCI_REG(ohci, GUIDHi)) << 32 | OHCI_REG(ohci, GUIDLo));
+  if (ohci->state < OHCI_UP && deadline_passed(ohci->deadline)) {
+    OHCI_INFO("Timeout in state %u.\n", ohci->state);
+    ohci->state = OHCI_FAILED;
+  }
 
-  return true;
+  return ohci->state;
 }
 
 /** Handle a bus reset condition. Does not return until the reset is
@@ -16,6 +16,65 @@
 
 #include <util.h>
 #include <pci.h>
+#include <acpi.h>
+#include <mbi-tools.h>
+#include <timeline-tools.h>
+
+/* Memory mapped configuration space of segment 0, if there is one
+   below 4GB. */
+static bool      ecam_probed;
+static uintptr_t ecam_base;
+static unsigned  ecam_start_bus;
+static unsigned  ecam_end_bus;
+
+static void
+pci_probe_ecam(void)
+{
+  ecam_probed = true;
+
+  struct rsdp *rsdp = acpi_get_rsdp();
+  if (!rsdp) return;
+
+  struct acpi_table **tab = acpi_get_table_ptr((struct acpi_table *)rsdp->rsdt, "MCFG");
+  if (!tab) return;
+
+  struct mcfg *mcfg = (struct mcfg *)*tab;
+  if (mcfg->generic.size < sizeof(*mcfg)) return;
+
+  size_t entries = (mcfg->generic.size - sizeof(*mcfg)) / sizeof(struct mcfg_entry);
+
+  for (struct mcfg_entry *e = mcfg->entry; e < mcfg->entry + entries; e++) {
+    if (e->segment != 0 || e->start_bus > e->end_bus ||
+        e->base + ((uint64_t)(e->end_bus + 1) << 20) > (1ULL << 32))
+      continue;
+
+    ecam_base      = e->base;
+    ecam_start_bus = e->start_bus;
+    ecam_end_bus   = e->end_bus;
+    printf("PCI: ECAM at %08x for buses %02x-%02x.\n", ecam_base,
+           ecam_start_bus, ecam_end_bus);
+    return;
+  }
+}
+
+/**
+ * Returns where addr is in memory mapped configuration space or NULL,
+ * if we have to use the ports.
+ */
+static volatile void *
+pci_ecam(unsigned addr)
+{
+  unsigned bus = (addr >> 16) & 0xFF;
+
+  if (!ecam_probed)
+    pci_probe_ecam();
+
+  if (!ecam_base || bus < ecam_start_bus || bus > ecam_end_bus)
+    return NULL;
+
+  /* Bus, device and function move from bit 8 to 12. */
+  return (volatile void *)(ecam_base + (((addr >> 8) & 0xFFFF) << 12) + (addr & 0xFF));
+}
 
 /**
  * Read a byte from the pci config space.
@@ -23,6 +82,10 @@
 uint8_t
 pci_read_uint8(unsigned addr)
 {
+  volatile uint8_t *p = pci_ecam(addr);
+  if (p)
+    return *p;
+
   outl(PCI_ADDR_PORT, addr);
   return inb(PCI_DATA_PORT + (addr & 3));
 }
@@ -33,6 +96,10 @@ pci_read_uint8(unsigned addr)
 uint32_t
 pci_read_uint32(unsigned addr)
 {
+  volatile uint32_t *p = pci_ecam(addr);
+  if (p)
+    return *p;
+
   outl(PCI_ADDR_PORT, addr);
   return inl(PCI_DATA_PORT);
 }
@@ -43,6 +110,12 @@ pci_read_uint32(unsigned addr)
 void
 pci_write_uint32(unsigned addr, uint32_t value)
 {
+  volatile uint32_t *p = pci_ecam(addr);
+  if (p) {
+    *p = value;
+    return;
+  }
+
   outl(PCI_ADDR_PORT, addr);
   outl(PCI_DATA_PORT, value);
 }
@@ -61,32 +134,468 @@ populate_device_info(uint32_t cfg_address, struct pci_device *dev)
 }
 
 
-bool
-pci_find_device_by_class(uint8_t class, uint8_t subclass,
-			 struct pci_device *dev)
+/* State of a hardware walk */
+struct pci_hw_walk {
+  pci_visit_t visit;
+  void       *arg;
+  uint32_t    seen[256 / 32];   /* buses walked or behind a bridge */
+  unsigned    functions;
+};
+
+static bool
+bus_seen(const struct pci_hw_walk *w, unsigned bus)
 {
-  uint32_t res = 0;
-  uint16_t full_class = class << 8 | subclass;
-  uint16_t class_mask = (subclass == PCI_SUBCLASS_ANY) ? 0xFF00 : 0xFFFF;
+  return (w->seen[bus / 32] & (1U << (bus % 32))) != 0;
+}
 
-  assert(dev != NULL, "Invalid dev pointer");
+/** Walks bus and the buses behind its bridges. */
+static bool
+pci_walk_bus(unsigned bus, struct pci_hw_walk *w)
+{
+  w->seen[bus / 32] |= 1U << (bus % 32);
+
+  for (unsigned dev = 0; dev < 32; dev++) {
+    unsigned maxfunc = 0;
 
-  for (unsigned i=0; i<1<<13; i++) {
-    uint8_t maxfunc = 0;
-    
     for (unsigned func = 0; func <= maxfunc; func++) {
-      uint32_t addr = 0x80000000 | i<<11 | func<<8;
+      uint32_t addr = 0x80000000 | bus << 16 | dev << 11 | func << 8;
+
+      /* Nothing in the slot, if function 0 is missing. */
+      if ((pci_read_uint32(addr + PCI_CFG_VENDOR_ID) & 0xFFFF) == 0xFFFF) {
+        if (func == 0)
+          break;
+        continue;
+      }
+
+      uint8_t header = pci_read_uint8(addr + PCI_CFG_HEADER_TYPE);
+      if (func == 0 && (header & PCI_HEADER_MULTIFUNC))
+        maxfunc = 7;
 
-      if (!maxfunc && pci_read_uint8(addr+14) & 0x80)
-	maxfunc=7;
+      w->functions++;
 
-      if ((full_class & class_mask) == ((pci_read_uint32(addr+0x8) >> 16) & class_mask))
-	res = addr;
+      if (w->visit(addr, w->arg))
+        return true;
+
+      if ((header & PCI_HEADER_TYPE_MASK) == PCI_HEADER_BRIDGE ||
+          (header & PCI_HEADER_TYPE_MASK) == PCI_HEADER_CARDBUS) {
+        unsigned secondary   = pci_read_uint8(addr + PCI_CFG_SECONDARY_BUS);
+        unsigned subordinate = pci_read_uint8(addr + PCI_CFG_SUBORDINATE_BUS);
+
+        if (secondary > bus && !bus_seen(w, secondary) &&
+            pci_walk_bus(secondary, w))
+          return true;
+
+        /* No root bus hides behind a bridge. */
+        for (unsigned b = secondary; b > bus && b <= subordinate; b++)
+          w->seen[b / 32] |= 1U << (b % 32);
+      }
     }
   }
 
-  if (res != 0) {
-    populate_device_info(res, dev);
+  return false;
+}
+
+/** Walks the buses in hardware, see pci_walk(). */
+static bool
+pci_walk_hw(pci_visit_t visit, void *arg)
+{
+  struct pci_hw_walk w = { .visit = visit, .arg = arg };
+
+  if (pci_walk_bus(0, &w))
+    return true;
+
+  /* Systems with several host bridges have root buses that no bridge
+     leads to, and these need not have a host bridge function of their
+     own. Look for them on all buses we have not seen. Buses behind
+     bridges count as seen and buses beyond the MCFG range do not
+     exist, which keeps this short. */
+  unsigned last = 255;
+
+  if (!ecam_probed)
+    pci_probe_ecam();
+  if (ecam_base)
+    last = ecam_end_bus;
+
+  if (w.functions == 0)
+    return false;
+
+  for (unsigned bus = 1; bus <= last; bus++) {
+    if (bus_seen(&w, bus))
+      continue;
+
+    for (unsigned dev = 0; dev < 32; dev++)
+      if ((pci_read_uint32(0x80000000 | bus << 16 | dev << 11) & 0xFFFF) != 0xFFFF) {
+        if (pci_walk_bus(bus, &w))
+          return true;
+        break;
+      }
+  }
+
+  return false;
+}
+
+static struct pci_inventory *inventory;
+
+bool
+pci_walk(pci_visit_t visit, void *arg)
+{
+  if (!inventory)
+    return pci_walk_hw(visit, arg);
+
+  for (unsigned i = 0; i < inventory->count; i++)
+    if (visit(inventory->device[i].cfg_address, arg))
+      return true;
+
+  return false;
+}
+
+const struct pci_inventory_device *
+pci_inventory_lookup(uint32_t cfg_address)
+{
+  if (!inventory)
+    return NULL;
+
+  unsigned bus = (cfg_address >> 16) & 0xFF;
+  unsigned end = (bus == 255) ? inventory->count : inventory->bus_first[bus + 1];
+
+  for (unsigned i = inventory->bus_first[bus]; i < end; i++)
+    if (((inventory->device[i].cfg_address ^ cfg_address) & 0xFFFF00) == 0)
+      return &inventory->device[i];
+
+  return NULL;
+}
+
+static bool
+inventory_add(uint32_t addr, void *arg)
+{
+  struct pci_inventory *inv = arg;
+
+  if (inv->count == PCI_INVENTORY_MAX) {
+    inv->flags &= ~PCI_INVENTORY_COMPLETE;
+    return true;
+  }
+
+  struct pci_inventory_device *d = &inv->device[inv->count++];
+  uint32_t id = pci_read_uint32(addr + PCI_CFG_VENDOR_ID);
+  unsigned bars = 6;
+
+  memset(d, 0, sizeof(*d));
+  d->cfg_address = addr;
+  d->vendor      = id & 0xFFFF;
+  d->device      = id >> 16;
+  d->class_rev   = pci_read_uint32(addr + PCI_CFG_REVID);
+  d->header_type = pci_read_uint8(addr + PCI_CFG_HEADER_TYPE);
+
+  switch (d->header_type & PCI_HEADER_TYPE_MASK) {
+  case PCI_HEADER_CARDBUS:
+    bars = 1;
+    d->secondary   = pci_read_uint8(addr + PCI_CFG_SECONDARY_BUS);
+    d->subordinate = pci_read_uint8(addr + PCI_CFG_SUBORDINATE_BUS);
+    /* Its capability pointer is elsewhere. */
+    break;
+  case PCI_HEADER_BRIDGE:
+    bars = 2;
+    d->secondary   = pci_read_uint8(addr + PCI_CFG_SECONDARY_BUS);
+    d->subordinate = pci_read_uint8(addr + PCI_CFG_SUBORDINATE_BUS);
+    /* FALLTHROUGH */
+  default:
+    if (pci_read_uint32(addr + PCI_CONF_HDR_CMD) & 0x100000) {
+      unsigned char cap = pci_read_uint8(addr + PCI_CONF_HDR_CAP) & ~3;
+
+      /* Bounded, a broken list may loop. */
+      for (unsigned n = 0; cap && n < 48; n++) {
+        if (d->ncaps < PCI_INVENTORY_CAPS) {
+          d->cap_id[d->ncaps]     = pci_read_uint8(addr + cap);
+          d->cap_offset[d->ncaps] = cap;
+        }
+        if (d->ncaps <= PCI_INVENTORY_CAPS)
+          d->ncaps++;
+        cap = pci_read_uint8(addr + cap + PCI_CAP_OFFSET) & ~3;
+      }
+    }
+    break;
+  }
+
+  for (unsigned i = 0; i < bars; i++)
+    d->bar[i] = pci_read_uint32(addr + PCI_CFG_BAR0 + 4 * i);
+
+  return false;
+}
+
+void
+pci_inventory_init(struct mbi *mbi)
+{
+  if ((mbi->flags & MBI_FLAG_MMAP) == 0)
+    return;
+
+  struct pci_inventory *inv = mbi_find_published(mbi, MMAP_PCI_INVENTORY);
+  if (inv && inv->magic == PCI_INVENTORY_MAGIC) {
+    if (inv->flags & PCI_INVENTORY_COMPLETE)
+      inventory = inv;
+    return;
+  }
+
+  int phase = timeline_begin("pci inventory");
+
+  inv = mbi_publish_memory(mbi, sizeof(*inv) + PCI_INVENTORY_MAX * sizeof(inv->device[0]),
+                           MMAP_PCI_INVENTORY);
+  memset(inv, 0, sizeof(*inv));
+  inv->flags = PCI_INVENTORY_COMPLETE;
+  pci_walk_hw(inventory_add, inv);
+
+  /* Sort by address, so each bus has a range of entries. */
+  for (unsigned i = 1; i < inv->count; i++)
+    for (unsigned j = i; j > 0 && inv->device[j - 1].cfg_address > inv->device[j].cfg_address; j--) {
+      struct pci_inventory_device tmp = inv->device[j];
+      inv->device[j]     = inv->device[j - 1];
+      inv->device[j - 1] = tmp;
+    }
+
+  for (unsigned bus = 0, i = 0; bus < 256; bus++) {
+    while (i < inv->count && ((inv->device[i].cfg_address >> 16) & 0xFF) < bus)
+      i++;
+    inv->bus_first[bus] = i;
+  }
+
+  for (unsigned i = 0; i < inv->count; i++) {
+    unsigned bus = (inv->device[i].cfg_address >> 16) & 0xFF;
+
+    inv->device[i].parent = PCI_INVENTORY_ROOT;
+    for (unsigned j = 0; j < inv->count; j++)
+      if ((inv->device[j].header_type & PCI_HEADER_TYPE_MASK) != 0 &&
+          inv->device[j].secondary == bus && bus != 0) {
+        inv->device[i].parent = j;
+        break;
+      }
+  }
+
+  memory_barrier();
+  inv->magic = PCI_INVENTORY_MAGIC;
+  timeline_end(phase);
+
+  printf("PCI: %u devices%s.\n", inv->count,
+         (inv->flags & PCI_INVENTORY_COMPLETE) ? "" : ", inventory is full");
+  if (inv->flags & PCI_INVENTORY_COMPLETE)
+    inventory = inv;
+}
+
+/** Returns the class code dword of a device. */
+static uint32_t
+pci_class_rev(uint32_t addr)
+{
+  const struct pci_inventory_device *d = pci_inventory_lookup(addr);
+
+  return d ? d->class_rev : pci_read_uint32(addr + PCI_CFG_REVID);
+}
+
+
+void
+pci_filter_init(struct pci_filter *f, uint8_t class, uint8_t subclass)
+{
+  f->class    = class;
+  f->subclass = subclass;
+  f->vendor   = PCI_ID_ANY;
+  f->device   = PCI_ID_ANY;
+  f->bdf      = PCI_BDF_ANY;
+}
+
+bool
+pci_filter_parse(struct pci_filter *f, const char *spec)
+{
+  char *end;
+  unsigned long long first = strtoull(spec, &end, 16);
+
+  if (end == spec || *end != ':')
+    return false;
+
+  const char *second_str = end + 1;
+  unsigned long long second = strtoull(second_str, &end, 16);
+
+  if (end == second_str)
+    return false;
+
+  if (*end == 0 && first < 0x10000 && second < 0x10000) {
+    f->vendor = first;
+    f->device = second;
+    return true;
+  }
+
+  const char *func_str = end + 1;
+  if (*end != '.' || first > 0xFF || second > 0x1F)
+    return false;
+
+  unsigned long long func = strtoull(func_str, &end, 16);
+  if (end == func_str || *end != 0 || func > 7)
+    return false;
+
+  f->bdf = first << 8 | second << 3 | func;
+  return true;
+}
+
+bool
+pci_filter_match(const struct pci_filter *f, uint32_t addr)
+{
+  if (f->bdf != PCI_BDF_ANY && f->bdf != ((addr >> 8) & 0xFFFF))
+    return false;
+
+  if (f->class != PCI_CLASS_ANY) {
+    uint32_t class = pci_class_rev(addr) >> 16;
+
+    if (f->class != (class >> 8) ||
+        (f->subclass != PCI_SUBCLASS_ANY && f->subclass != (class & 0xFF)))
+      return false;
+  }
+
+  if (f->vendor == PCI_ID_ANY && f->device == PCI_ID_ANY)
+    return true;
+
+  const struct pci_inventory_device *d = pci_inventory_lookup(addr);
+  uint32_t id = d ? (uint32_t)d->device << 16 | d->vendor
+                  : pci_read_uint32(addr + PCI_CFG_VENDOR_ID);
+
+  return (f->vendor == PCI_ID_ANY || f->vendor == (id & 0xFFFF)) &&
+         (f->device == PCI_ID_ANY || f->device == (id >> 16));
+}
+
+
+struct filter_match {
+  const struct pci_filter *filter;
+  uint32_t after;               /* only look at higher addresses */
+  uint32_t first;               /* lowest match or 0 */
+  uint32_t last;                /* highest match or 0 */
+};
+
+static bool
+match_filter(uint32_t addr, void *arg)
+{
+  struct filter_match *m = arg;
+
+  if (addr <= m->after || !pci_filter_match(m->filter, addr))
+    return false;
+
+  if (m->first == 0 || addr < m->first)
+    m->first = addr;
+  if (addr > m->last)
+    m->last = addr;
+
+  return false;
+}
+
+/* Matches after some address from the last hardware walk of
+   pci_next(), in address order */
+enum { PCI_MATCH_MAX = 16 };
+
+static struct {
+  bool     valid;
+  struct pci_filter filter;
+  uint32_t after;
+  unsigned count;
+  bool     full;                /* more matches follow the last one */
+  uint32_t addr[PCI_MATCH_MAX];
+} matches;
+
+static bool
+collect_match(uint32_t addr, void *arg)
+{
+  (void)arg;
+
+  if (addr <= matches.after || !pci_filter_match(&matches.filter, addr))
+    return false;
+
+  /* Keep the lowest addresses, sorted. */
+  unsigned i = matches.count;
+  if (i == PCI_MATCH_MAX) {
+    matches.full = true;
+    if (addr > matches.addr[i - 1])
+      return false;
+    i--;
+  } else
+    matches.count++;
+
+  for (; i > 0 && matches.addr[i - 1] > addr; i--)
+    matches.addr[i] = matches.addr[i - 1];
+  matches.addr[i] = addr;
+
+  return false;
+}
+
+/** Returns the next match after addr without an inventory or 0. One
+    hardware walk collects the following matches, later calls of an
+    iteration take them from there. */
+static uint32_t
+pci_next_hw(const struct pci_filter *f, uint32_t after)
+{
+  /* The list answers for after, if it starts there or has it. */
+  bool same = matches.valid &&
+    matches.filter.class  == f->class  && matches.filter.subclass == f->subclass &&
+    matches.filter.vendor == f->vendor && matches.filter.device   == f->device &&
+    matches.filter.bdf    == f->bdf;
+  bool listed = after == matches.after;
+
+  for (unsigned i = 0; i < matches.count && !listed; i++)
+    listed = matches.addr[i] == after;
+
+  if (same && listed) {
+    for (unsigned i = 0; i < matches.count; i++)
+      if (matches.addr[i] > after)
+        return matches.addr[i];
+    if (!matches.full)
+      return 0;
+  }
+
+  matches.valid  = true;
+  matches.filter = *f;
+  matches.after  = after;
+  matches.count  = 0;
+  matches.full   = false;
+  pci_walk_hw(collect_match, NULL);
+
+  return matches.count ? matches.addr[0] : 0;
+}
+
+bool
+pci_next(const struct pci_filter *f, struct pci_device *dev)
+{
+  uint32_t after = dev->cfg_address;
+  uint32_t next  = 0;
+
+  if (inventory) {
+    /* The inventory is sorted, so start on the bus we stopped at. */
+    for (unsigned i = inventory->bus_first[(after >> 16) & 0xFF];
+         i < inventory->count; i++) {
+      uint32_t addr = inventory->device[i].cfg_address;
+
+      if (addr > after && pci_filter_match(f, addr)) {
+        next = addr;
+        break;
+      }
+    }
+  } else
+    next = pci_next_hw(f, after);
+
+  if (next == 0)
+    return false;
+
+  populate_device_info(next, dev);
+  return true;
+}
+
+bool
+pci_find_device_by_class(uint8_t class, uint8_t subclass,
+			 struct pci_device *dev)
+{
+  struct pci_filter f;
+  struct filter_match m = { &f, 0, 0, 0 };
+
+  assert(dev != NULL, "Invalid dev pointer");
+  pci_filter_init(&f, class, subclass);
+
+  int phase = timeline_begin("pci scan");
+  pci_walk(match_filter, &m);
+  timeline_end(phase);
+
+  if (m.last != 0) {
+    populate_device_info(m.last, dev);
     return true;
   } else {
     return false;    
@@ -96,6 +605,15 @@ pci_find_device_by_class(uint8_t class, uint8_t subclass,
 unsigned char
 pci_find_cap(unsigned addr, unsigned char id)
 {
+  const struct pci_inventory_device *d = pci_inventory_lookup(addr);
+
+  if (d && d->ncaps <= PCI_INVENTORY_CAPS) {
+    for (unsigned i = 0; i < d->ncaps; i++)
+      if (d->cap_id[i] == id)
+        return d->cap_offset[i];
+    return 0;
+  }
+
   if (~pci_read_uint32(addr+PCI_CONF_HDR_CMD) & 0x100000)
     return 0;
   unsigned char cap_offset = pci_read_uint8(addr+PCI_CONF_HDR_CAP);
@@ -0,0 +1,122 @@
+/* -*- Mode: C -*- */
+/*
+ * Copies between any physical addresses.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <phys.h>
+#include <asm.h>
+#include <cpuid.h>
+#include <util.h>
+
+enum {
+  PTE_P        = 1 << 0,
+  PTE_RW       = 1 << 1,
+  PTE_PS       = 1 << 7,        /* 2MB page in a page directory */
+
+  CR0_PG       = 1U << 31,
+  CR4_PAE      = 1 << 5,
+
+  LARGE_PAGE   = 2 << 20,
+  WINDOW       = 512 << 20,     /* per direction */
+  WINDOW_BASE  = 0xC0000000U,
+  WINDOW_PAGES = WINDOW / LARGE_PAGE,
+};
+
+/* The lower 3GB are identity mapped. The page directory of the top
+   gigabyte holds the source window followed by the destination
+   window. */
+static uint64_t pdpt[4] __attribute__((aligned(32)));
+static uint64_t pd[4][512] __attribute__((aligned(4096)));
+
+extern char _image_end[];
+
+static bool
+has_pae(void)
+{
+  uint32_t r[4];
+
+  cpuid(1, 0, r);
+  return ((r[3] >> 6) & 1) != 0;
+}
+
+static void
+phys_setup(void)
+{
+  for (unsigned i = 0; i < 4; i++) {
+    pdpt[i] = (uintptr_t)pd[i] | PTE_P;
+    for (unsigned j = 0; j < 512; j++)
+      pd[i][j] = ((uint64_t)i << 30) | ((uint64_t)j << 21) | PTE_PS | PTE_RW | PTE_P;
+  }
+}
+
+/** Maps [addr, addr+len) into the window starting at directory entry
+    first and returns its virtual address. */
+static char *
+phys_window(unsigned first, uint64_t addr, size_t len)
+{
+  uint64_t page = addr & ~(uint64_t)(LARGE_PAGE - 1);
+
+  for (unsigned j = first; page < addr + len; j++, page += LARGE_PAGE)
+    pd[3][j] = page | PTE_PS | PTE_RW | PTE_P;
+
+  return (char *)(WINDOW_BASE + first * LARGE_PAGE) + (addr & (LARGE_PAGE - 1));
+}
+
+bool
+phys_copy(uint64_t dst, uint64_t src, uint64_t len)
+{
+  static bool setup;
+
+  if (dst + len <= 1ULL << 32 && src + len <= 1ULL << 32) {
+    memcpy((void *)(uintptr_t)dst, (const void *)(uintptr_t)src, len);
+    return true;
+  }
+
+  if (!has_pae())
+    return false;
+
+  assert((uintptr_t)_image_end <= WINDOW_BASE, "Image overlaps copy windows.");
+
+  if (!setup) {
+    phys_setup();
+    setup = true;
+  }
+
+  /* We only turn paging on with interrupts off and for one window
+     full at a time. Turning it off again flushes the TLB. */
+  while (len) {
+    size_t chunk = MIN(len, (uint64_t)(WINDOW - LARGE_PAGE));
+    char  *d     = phys_window(WINDOW_PAGES, dst, chunk);
+    char  *s     = phys_window(0, src, chunk);
+
+    memory_barrier();
+    set_cr4(get_cr4() | CR4_PAE);
+    set_cr3((uintptr_t)pdpt);
+    set_cr0(get_cr0() | CR0_PG);
+
+    memcpy(d, s, chunk);
+
+    memory_barrier();
+    set_cr0(get_cr0() & ~CR0_PG);
+    set_cr4(get_cr4() & ~CR4_PAE);
+
+    dst += chunk;
+    src += chunk;
+    len -= chunk;
+  }
+
+  return true;
+}
+
+/* EOF */
@@ -22,91 +22,227 @@
  */
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <util.h>
 
 static const char *hex = "0123456789abcdef";
 
+/* Output is collected here and goes to the console sinks once per
+   line, instead of once per character. */
+struct outbuf {
+  unsigned len;
+  char     buf[128];
+};
+
+static void
+flush(struct outbuf *o)
+{
+  out_write(o->buf, o->len);
+  o->len = 0;
+}
+
+static void
+put(struct outbuf *o, char c)
+{
+  o->buf[o->len++] = c;
+  if (c == '\n' || o->len == sizeof(o->buf))
+    flush(o);
+}
+
+static void
+put_repeat(struct outbuf *o, char c, int n)
+{
+  while (n-- > 0)
+    put(o, c);
+}
+
+/**
+ * Divides *n by d and returns the remainder. Both halves take one
+ * 32-bit divide each, no 64-bit division from qdivrem.c. The second
+ * one cannot overflow, because its upper half is below d.
+ */
+static uint32_t
+divmod32(unsigned long long *n, uint32_t d)
+{
+  uint32_t hi = *n >> 32;
+  uint32_t lo = *n;
+  uint32_t q_hi = hi / d;
+  uint32_t rem;
+
+  hi %= d;
+  asm ("divl %4" : "=a" (lo), "=d" (rem) : "a" (lo), "d" (hi), "rm" (d));
+
+  *n = (unsigned long long)q_hi << 32 | lo;
+  return rem;
+}
+
+/** Writes the digits of v backwards to s and returns their end. */
+static char *
+utoa10_rev(char *s, uint32_t v, unsigned min_digits)
+{
+  char *end = s + min_digits;
+
+  do {
+    /* v / 10 for all 32-bit v */
+    uint32_t q = ((uint64_t)v * 0xCCCCCCCDU) >> 35;
+
+    *s++ = '0' + (v - q * 10);
+    v = q;
+  } while (v || s < end);
+
+  return s;
+}
+
+/** Writes the decimal digits of n backwards to s and returns their end. */
+static char *
+ulltoa10_rev(char *s, unsigned long long n)
+{
+  /* Nine digits at a time fit into 32 bits. */
+  while (n >> 32)
+    s = utoa10_rev(s, divmod32(&n, 1000000000U), 9);
+
+  return utoa10_rev(s, n, 1);
+}
+
+/**
+ * Formats into a line buffer. Knows %c, %s, %d, %i, %u, %x and %p
+ * with the flags '-' and '0', width and precision (also as '*') and
+ * the l and ll length modifiers. %p prints like %x.
+ */
 void
 vprintf(const char *fmt, va_list ap)
 {
-  char buf[64];
-  char *s;
-  unsigned long long ull;
+  struct outbuf o;
+  char buf[24];                 /* 2^64 has 20 digits */
   int c;
-  enum { PLAIN, INFMT } state = PLAIN;
-  unsigned longness = 0;
-  unsigned fill = 0;
-  
+
+  o.len = 0;
+
   while ((c = *fmt++)) {
-    
-    switch (state) {
-    case PLAIN:
+    if (c != '%') {
+      put(&o, c);
+      continue;
+    }
 
-      longness = 0;
-      fill     = 0;
+    bool left = false;
+    bool zero = false;
+    int width = 0;
+    int precision = -1;
+    unsigned longness = 0;
 
-      switch (c) {
-      case '%':
-        state = INFMT;
-        longness = 0;
-        break;
-      default:
-        out_char(c);
+    for (;; fmt++)
+      if (*fmt == '-')
+        left = true;
+      else if (*fmt == '0')
+        zero = true;
+      else
         break;
+
+    if (*fmt == '*') {
+      width = va_arg(ap, int);
+      if (width < 0) {
+        left  = true;
+        width = -width;
       }
-      break;                    /* case PLAIN */
-    case INFMT:
-      switch (c) {
-      case '0' ... '9':
-        fill = c - '0';
-        break;
-      case 'l':
-        longness++;
-        break;
-      case 'c':
-	out_char(va_arg(ap, int));
-        state = PLAIN;
-        break;
-      case 's':
-        out_string(va_arg(ap, char *));
-        state = PLAIN;
-	break;
-      case 'd':       /* A lie, always prints unsigned */
-      case 'u':
-        if (longness < 2)
-          ull = va_arg(ap, unsigned);
-        else
-          ull = va_arg(ap, unsigned long long);
-	s = buf;
-	do
-	  *s++ = '0' + ull % 10U;
-	while (ull /= 10U);
-      dumpbuf:;
-        while ((s - buf) < fill--)
-          out_char('0');
-	while (--s >= buf) {
-          out_char(*s);
-        }
-        state = PLAIN;
-	break;
-      case 'p':
-      case 'x':
-        if (longness < 2)
-          ull = va_arg(ap, unsigned);
-        else
-          ull = va_arg(ap, unsigned long long);
-	s = buf;
-	do
-	  *s++ = hex[ull & 0xF];
-	while (ull >>= 4);
-	goto dumpbuf;
+      fmt++;
+    } else
+      for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+        width = width * 10 + *fmt - '0';
+
+    if (*fmt == '.') {
+      fmt++;
+      precision = 0;
+      if (*fmt == '*') {
+        precision = va_arg(ap, int);
+        fmt++;
+      } else
+        for (; *fmt >= '0' && *fmt <= '9'; fmt++)
+          precision = precision * 10 + *fmt - '0';
+    }
+
+    for (; *fmt == 'l'; fmt++)
+      longness++;
+
+    const char *str;
+    int len;
+    char sign = 0;
+    unsigned long long ull;
+
+    switch ((c = *fmt++)) {
+    case 0:
+      fmt--;
+      continue;
+    case 'c':
+      buf[0] = va_arg(ap, int);
+      str = buf;
+      len = 1;
+      goto field;
+    case 's':
+      str = va_arg(ap, const char *);
+      if (!str)
+        str = "(null)";
+      for (len = 0; str[len] && (precision < 0 || len < precision); len++)
+        ;
+    field:
+      if (!left)
+        put_repeat(&o, ' ', width - len);
+      for (int i = 0; i < len; i++)
+        put(&o, str[i]);
+      if (left)
+        put_repeat(&o, ' ', width - len);
+      continue;
+    case 'd':
+    case 'i':
+      {
+        long long ll = (longness < 2) ? va_arg(ap, int) : va_arg(ap, long long);
+
+        if (ll < 0) {
+          sign = '-';
+          ull  = -(unsigned long long)ll;
+        } else
+          ull = ll;
       }
+      goto decimal;
+    case 'u':
+      ull = (longness < 2) ? va_arg(ap, unsigned) : va_arg(ap, unsigned long long);
+    decimal:
+      len = (precision == 0 && ull == 0) ? 0 : ulltoa10_rev(buf, ull) - buf;
+      break;
+    case 'p':
+    case 'x':
+      ull = (longness < 2) ? va_arg(ap, unsigned) : va_arg(ap, unsigned long long);
+      len = 0;
+      if (precision != 0 || ull != 0)
+        do
+          buf[len++] = hex[ull & 0xF];
+        while (ull >>= 4);
+      break;
+    default:
+      put(&o, c);
+      continue;
+    }
+
+    /* A number, its len digits are backwards in buf. */
+    int digits = (precision > len) ? precision : len;
+    int pad    = width - digits - (sign != 0);
 
-      break;                    /* case INFMT */
+    if (zero && !left && precision < 0) {
+      digits += pad > 0 ? pad : 0;
+      pad = 0;
     }
+
+    if (!left)
+      put_repeat(&o, ' ', pad);
+    if (sign)
+      put(&o, sign);
+    put_repeat(&o, '0', digits - len);
+    while (len > 0)
+      put(&o, buf[--len]);
+    if (left)
+      put_repeat(&o, ' ', pad);
   }
-  
-  return;
+
+  flush(&o);
 }
 
 void
@@ -3,11 +3,13 @@
 #include <serial.h>
 #include <bda.h>
 #include <util.h>
+#include <mbi.h>
 
 enum Port  {
   THR         = 0,    // Transmit Holding Register    (write)
   IER         = 1,    // Interrupt Enable Register    (write)
   FCR         = 2,    // FIFO Control Register        (write)
+  IIR         = 2,    // Interrupt Identification     (read)
   LCR         = 3,    // Line Control Register        (write)
   MCR         = 4,    // Modem Control Register       (write)
   LSR         = 5,    // Line Status Register         (read)
@@ -19,6 +21,10 @@ enum {
   FCR_FIFO_ENABLE     = 1u << 0,  // FIFO Enable
   FCR_RECV_FIFO_RESET = 1u << 1,  // Receiver FIFO Reset
   FCR_TMIT_FIFO_RESET = 1u << 2,  // Transmit FIFO Reset
+  FCR_FIFO_64         = 1u << 5,  // 64 byte FIFO (16750, needs DLAB)
+
+  IIR_FIFO_ENABLED    = 3u << 6,  // 16550A and later
+  IIR_FIFO_64         = 1u << 5,
 
   LCR_DATA_BITS_8     = 3u << 0,
   LCR_STOP_BITS_1     = 0u << 2,
@@ -28,26 +34,57 @@ enum {
   MCR_RTS             = 1u << 1,  // Request To Send
 
   LSR_TMIT_HOLD_EMPTY = 1u << 5,
+  LSR_TMIT_EMPTY      = 1u << 6,  // FIFO and shift register empty
+
+  UART_CLOCK          = 1843200,  // standard crystal, 115200 baud max
 };
 
 static uint16_t serial_base;
 static bool     output_enabled = false;
 
+static unsigned baud       = 115200;
+static unsigned uart_clock = UART_CLOCK;
+
+static unsigned fifo_size  = 1;
+static unsigned tx_room;        // free FIFO slots we know of
+
 void
 serial_send (int c)
 {
   if (!output_enabled) return;
 
-  unsigned max_tries = 0x10000;
-  while (!(inb (serial_base + LSR) & LSR_TMIT_HOLD_EMPTY)) {
-    asm volatile ("pause");
-    if (max_tries-- == 0) {
-      output_enabled = false;
-      return;
+  /* Once the transmitter is empty, the whole FIFO is ours. */
+  if (tx_room == 0) {
+    unsigned max_tries = 0x10000;
+    while (!(inb (serial_base + LSR) & LSR_TMIT_HOLD_EMPTY)) {
+      cpu_pause();
+      if (max_tries-- == 0) {
+        output_enabled = false;
+        return;
+      }
     }
+    tx_room = fifo_size;
   }
 
   outb (serial_base + THR, c);
+  tx_room--;
+}
+
+/**
+ * Returns how many bytes we can write after THR empty. The 16550A
+ * and later report enabled FIFOs in IIR, 16750 and 16950-class parts
+ * also whether the 64 byte mode is on. The latter may have an even
+ * larger FIFO, 64 bytes are always safe.
+ */
+static unsigned
+serial_fifo_size(void)
+{
+  uint8_t iir = inb (serial_base + IIR);
+
+  if ((iir & IIR_FIFO_ENABLED) != IIR_FIFO_ENABLED)
+    return 1;
+
+  return (iir & IIR_FIFO_64) ? 64 : 16;
 }
 
 void
@@ -63,19 +100,78 @@ serial_init()
 
   /* Programming the first serial adapter (8N1) */
   outb (serial_base + LCR, LCR_DLAB);
-  
-  /* 115200 baud */
-  outb (serial_base + DLR_LOW,  1);
-  outb (serial_base + DLR_HIGH, 0);
-    
-  /* 9600 baud */
-  /*   outb (serial_base + DLR_LOW,  0x0C); */
-  /*   outb (serial_base + DLR_HIGH, 0); */
-  
+
+  /* Divisor for the configured baud rate, rounded to the nearest. */
+  unsigned divisor = (uart_clock + 8 * baud) / (16 * baud);
+  outb (serial_base + DLR_LOW,  divisor & 0xFF);
+  outb (serial_base + DLR_HIGH, divisor >> 8);
+
+  /* Older parts ignore FCR_FIFO_64. */
+  outb (serial_base + FCR, FCR_FIFO_ENABLE | FCR_RECV_FIFO_RESET |
+        FCR_TMIT_FIFO_RESET | FCR_FIFO_64);
+
   outb (serial_base + LCR, LCR_DATA_BITS_8 | LCR_STOP_BITS_1);
   outb (serial_base + IER, 0);
-  outb (serial_base + FCR, FCR_FIFO_ENABLE | FCR_RECV_FIFO_RESET | FCR_TMIT_FIFO_RESET);
   outb (serial_base + MCR, MCR_DTR | MCR_RTS);
+
+  fifo_size = serial_fifo_size();
+  tx_room   = 0;
+}
+
+/**
+ * Takes baud= and uartclk= from the multiboot command line. uartclk
+ * is the UART input clock in Hz or, with an x suffix, a multiple of
+ * the standard 1.8432 MHz, as many PCI cards have 8x or 16x crystals.
+ */
+void
+serial_configure(const struct mbi *mbi)
+{
+  unsigned new_baud  = baud;
+  unsigned new_clock = uart_clock;
+
+  if ((mbi->flags & MBI_FLAG_CMDLINE) == 0)
+    return;
+
+  char *last_ptr = NULL;
+  char cmdline_buf[256];
+  char *token;
+
+  strncpy(cmdline_buf, (const char *)mbi->cmdline, sizeof(cmdline_buf));
+  cmdline_buf[sizeof(cmdline_buf) - 1] = 0;
+
+  for (token = strtok_r(cmdline_buf, " ", &last_ptr);
+       token != NULL;
+       token = strtok_r(NULL, " ", &last_ptr)) {
+    char *end;
+
+    if (strncmp(token, "baud=", 5) == 0) {
+      new_baud = strtoull(token + 5, NULL, 0);
+    } else if (strncmp(token, "uartclk=", 8) == 0) {
+      new_clock = strtoull(token + 8, &end, 0);
+      if (*end == 'x')
+        new_clock *= UART_CLOCK;
+    }
+  }
+
+  if (new_baud == baud && new_clock == uart_clock)
+    return;
+
+  unsigned divisor = new_baud ? (new_clock + 8 * new_baud) / (16 * new_baud) : 0;
+  if (divisor == 0 || divisor > 0xFFFF) {
+    printf("Cannot do %u baud with a %u Hz UART clock.\n", new_baud, new_clock);
+    return;
+  }
+
+  baud       = new_baud;
+  uart_clock = new_clock;
+
+  /* Switch now, if we already talk. Let the FIFO drain first. */
+  if (output_enabled) {
+    unsigned max_tries = 0x100000;
+    while (!(inb (serial_base + LSR) & LSR_TMIT_EMPTY) && max_tries--)
+      cpu_pause();
+    serial_init();
+  }
 }
 
 /* EOF */
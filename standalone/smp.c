@@ -0,0 +1,253 @@
+/* -*- Mode: C -*- */
+/*
+ * Application processor bring-up and a small work queue.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <smp.h>
+#include <cpuid.h>
+#include <mbi-tools.h>
+#include <util.h>
+
+enum {
+  APIC_SVR         = 0x0F0,
+  APIC_ICR_LOW     = 0x300,
+  APIC_ICR_HIGH    = 0x310,
+
+  APIC_SVR_ENABLE  = 1 << 8,
+  APIC_SVR_VECTOR  = 0xFF,
+
+  ICR_INIT         = 5 << 8,
+  ICR_STARTUP      = 6 << 8,
+  ICR_PENDING      = 1 << 12,
+  ICR_ASSERT       = 1 << 14,
+  ICR_ALL_BUT_SELF = 3 << 18,
+
+  STARTUP_SAVE     = 64,        /* bytes saved below the startup code */
+  LOW_MEMORY       = 0x100000,
+};
+
+/* From smp_start.asm. The trampoline is copied to a page below 1MB
+   and switches to protected mode. Every AP then takes the next
+   number from smp_ap_next, picks its stack by it and calls
+   smp_ap_main(). */
+extern const char smp_trampoline[], smp_trampoline_end[];
+extern volatile unsigned smp_ap_next;
+
+/* Stack of CPU n ends at smp_stacks[n]. The BSP keeps its own. */
+uint8_t smp_stacks[SMP_MAX_CPUS - 1][SMP_STACK] __attribute__((aligned(16)));
+
+void smp_ap_main(unsigned cpu) __attribute__((noreturn));
+
+/* Jobs form a ring indexed by ever increasing counters. Only the BSP
+   adds jobs, every CPU takes them by advancing job_next. */
+static struct {
+  smp_job_fn fn;
+  void      *arg;
+} jobs[SMP_MAX_JOBS];
+
+static volatile unsigned job_count;
+static volatile unsigned job_next;
+static volatile unsigned job_done;
+
+static volatile unsigned cpus_online = 1;
+
+static uint8_t *startup_page;
+static uint8_t  startup_saved[STARTUP_SAVE];
+
+static inline volatile uint32_t *
+apic_reg(unsigned reg)
+{
+  return (volatile uint32_t *)(APIC_DEFAULT_PHYS_BASE + reg);
+}
+
+/** Sends an IPI to all other CPUs and waits until it is delivered. */
+static void
+apic_ipi_others(uint32_t icr)
+{
+  *apic_reg(APIC_ICR_HIGH) = 0;
+  *apic_reg(APIC_ICR_LOW)  = icr | ICR_ASSERT | ICR_ALL_BUT_SELF;
+
+  while (*apic_reg(APIC_ICR_LOW) & ICR_PENDING)
+    cpu_pause();
+}
+
+static bool
+touches(uintptr_t page, uintptr_t start, size_t len)
+{
+  return start < page + STARTUP_SAVE && page < start + len;
+}
+
+/** Checks whether the multiboot information refers to the start of
+    page, which we are about to overwrite. */
+static bool
+mbi_uses(const struct mbi *mbi, uintptr_t page)
+{
+  if (touches(page, (uintptr_t)mbi, sizeof(*mbi)))
+    return true;
+  if ((mbi->flags & MBI_FLAG_CMDLINE) &&
+      touches(page, mbi->cmdline, strlen((const char *)mbi->cmdline) + 1))
+    return true;
+  if ((mbi->flags & MBI_FLAG_MMAP) &&
+      touches(page, mbi->mmap_addr, mbi->mmap_length))
+    return true;
+
+  if ((mbi->flags & MBI_FLAG_MODS) == 0)
+    return false;
+
+  const struct module *mods = (const struct module *)mbi->mods_addr;
+
+  if (touches(page, mbi->mods_addr, mbi->mods_count * sizeof(*mods)))
+    return true;
+  for (unsigned i = 0; i < mbi->mods_count; i++)
+    if (touches(page, mods[i].mod_start, mods[i].mod_end - mods[i].mod_start) ||
+        touches(page, mods[i].string, strlen((const char *)mods[i].string) + 1))
+      return true;
+
+  return false;
+}
+
+/** Takes the next job and runs it. Returns false, if there was none. */
+static bool
+smp_run_one(void)
+{
+  unsigned n = job_next;
+
+  if (n == job_count)
+    return false;
+
+  /* Read the job before we take it. Once job_next has moved past n,
+     the BSP may reuse the slot, but then the CAS fails and we drop
+     what we read. */
+  memory_barrier();
+  smp_job_fn fn  = jobs[n % SMP_MAX_JOBS].fn;
+  void      *arg = jobs[n % SMP_MAX_JOBS].arg;
+
+  /* Someone else may have taken it. Try again later. */
+  if (__sync_bool_compare_and_swap(&job_next, n, n + 1)) {
+    fn(arg);
+    __sync_fetch_and_add(&job_done, 1);
+  }
+
+  return true;
+}
+
+void
+smp_ap_main(unsigned cpu)
+{
+  __sync_fetch_and_add(&cpus_online, 1);
+
+  for (;;)
+    if (!smp_run_one())
+      cpu_pause();
+}
+
+unsigned
+smp_init(struct mbi *mbi, struct mbi_range target,
+         const struct mbi_range *busy, unsigned nbusy)
+{
+  size_t len = smp_trampoline_end - smp_trampoline;
+  void  *page;
+  size_t page_len;
+
+  if (startup_page)
+    return cpus_online;
+
+  if (!has_apic() ||
+      !mbi_find_memory(mbi, 0x1000, &page, &page_len, false, LOW_MEMORY) ||
+      mbi_uses(mbi, (uintptr_t)page)) {
+    printf("SMP: no APIC or no memory for the startup code.\n");
+    return 1;
+  }
+
+  /* smp_park() puts the saved bytes back. Anything written there in
+     between, be it a relocated module or a loaded segment, would be
+     lost. */
+  bool clash = touches((uintptr_t)page, target.start, target.len);
+  for (unsigned i = 0; i < nbusy; i++)
+    clash |= touches((uintptr_t)page, busy[i].start, busy[i].len);
+  if (clash) {
+    printf("SMP: startup page %p is about to be overwritten.\n", page);
+    return 1;
+  }
+
+  assert(len <= STARTUP_SAVE, "SMP startup code too large.");
+
+  startup_page = page;
+  memcpy(startup_saved, startup_page, STARTUP_SAVE);
+  memcpy(startup_page, smp_trampoline, len);
+
+  *apic_reg(APIC_SVR) |= APIC_SVR_ENABLE | APIC_SVR_VECTOR;
+
+  /* The usual INIT-SIPI-SIPI sequence. Every AP that wakes up checks
+     in by incrementing cpus_online. */
+  apic_ipi_others(ICR_INIT);
+  wait(10);
+  for (unsigned i = 0; i < 2; i++) {
+    apic_ipi_others(ICR_STARTUP | ((uintptr_t)startup_page >> 12));
+    wait(1);
+  }
+
+  /* There is no way to know how many APs there are without parsing
+     ACPI tables. They are usually all there after a millisecond,
+     give the slow ones some more time. */
+  wait(10);
+
+  printf("SMP: %u CPUs online%s.\n", cpus_online,
+         smp_ap_next > SMP_MAX_CPUS ? " (more are not used)" : "");
+  return cpus_online;
+}
+
+void
+smp_submit(smp_job_fn fn, void *arg)
+{
+  /* Help out until there is a free slot. */
+  while (job_count - job_done >= SMP_MAX_JOBS)
+    if (!smp_run_one())
+      cpu_pause();
+
+  jobs[job_count % SMP_MAX_JOBS].fn  = fn;
+  jobs[job_count % SMP_MAX_JOBS].arg = arg;
+
+  /* Publish the job only after it is written. */
+  __sync_fetch_and_add(&job_count, 1);
+}
+
+void
+smp_wait(void)
+{
+  while (job_done != job_count)
+    if (!smp_run_one())
+      cpu_pause();
+}
+
+void
+smp_park(void)
+{
+  if (!startup_page)
+    return;
+
+  smp_wait();
+
+  /* The APs spin in smp_ap_main and hold no locks, so they can be
+     stopped at any time. INIT leaves them waiting for a SIPI. */
+  apic_ipi_others(ICR_INIT);
+  wait(10);
+
+  memcpy(startup_page, startup_saved, STARTUP_SAVE);
+  startup_page = NULL;
+  cpus_online  = 1;
+  smp_ap_next  = 1;
+}
+
+/* EOF */
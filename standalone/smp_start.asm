@@ -0,0 +1,68 @@
+        ;; Application processor startup code
+
+        CPU 686
+
+        EXTERN smp_ap_main, smp_stacks, cpu_enable_simd
+        GLOBAL smp_trampoline, smp_trampoline_end, smp_ap_next
+
+SMP_MAX_CPUS    equ 16          ; as in smp.h
+SMP_STACK_SHIFT equ 12          ; log2 of SMP_STACK
+
+        SECTION .text.smp EXEC NOWRITE ALIGN=16
+
+        ;; smp_init copies this to the start of a page below 1MB, whose
+        ;; number is the SIPI vector. APs start here in real mode with
+        ;; CS pointing to the page, so only offsets into it work.
+        BITS 16
+smp_trampoline:
+        cli
+        mov     ax, cs
+        mov     ds, ax
+        o32 lgdt [smp_gdtr - smp_trampoline]
+        mov     eax, cr0
+        or      al, 1
+        mov     cr0, eax
+        jmp     dword 08h:smp_ap_start
+
+        align 4
+smp_gdtr:
+        dw      smp_gdt_end - smp_gdt - 1
+        dd      smp_gdt
+smp_trampoline_end:
+
+        BITS 32
+smp_ap_start:
+        mov     eax, 10h
+        mov     ds, eax
+        mov     es, eax
+        mov     fs, eax
+        mov     gs, eax
+        mov     ss, eax
+
+        ;; Take a CPU number. The ones we have no stack for stay here.
+        mov     eax, 1
+        lock xadd [smp_ap_next], eax
+        cmp     eax, SMP_MAX_CPUS
+        jae     .park
+
+        mov     ebx, eax        ; survives the call, eax does not
+        shl     eax, SMP_STACK_SHIFT
+        lea     esp, [smp_stacks + eax]
+        call    cpu_enable_simd
+        mov     eax, ebx
+        call    smp_ap_main
+.park:
+        cli
+        hlt
+        jmp     .park
+
+        SECTION .data
+        align 8
+smp_gdt:
+        dq      0
+        dq      00CF9B000000FFFFh       ; flat code
+        dq      00CF93000000FFFFh       ; flat data
+smp_gdt_end:
+
+smp_ap_next:
+        dd      1                       ; 0 is the BSP
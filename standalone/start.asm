@@ -2,7 +2,7 @@
 
         CPU 686
         
-        EXTERN main, __exit
+        EXTERN main, __exit, cpu_enable_simd
         GLOBAL _mbheader, _start, jmp_multiboot
         
         SECTION .text._start EXEC NOWRITE ALIGN=4
@@ -14,6 +14,9 @@ _mbheader:
 
 _start:
         mov     esp, _stack
+        mov     esi, eax        ; survives the call, eax does not
+        call    cpu_enable_simd
+        mov     eax, esi
         mov     edx, ebx
         push    __exit
         jmp      main
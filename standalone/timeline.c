@@ -0,0 +1,123 @@
+/* -*- Mode: C -*- */
+/*
+ * Recording the boot timeline.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <timeline-tools.h>
+#include <mbi-tools.h>
+#include <util.h>
+
+static struct timeline *timeline;
+static unsigned depth;          /* phases running in this stage */
+
+void
+timeline_init(struct mbi *mbi, const char *stage)
+{
+  if ((mbi->flags & MBI_FLAG_MMAP) == 0)
+    return;
+
+  timeline = mbi_find_published(mbi, MMAP_TIMELINE);
+  if (timeline && timeline->magic == TIMELINE_MAGIC)
+    tsc_khz_set(timeline->tsc_khz);
+  else {
+    timeline = mbi_publish_memory(mbi, sizeof(*timeline), MMAP_TIMELINE);
+    memset(timeline, 0, sizeof(*timeline));
+    timeline->magic   = TIMELINE_MAGIC;
+    timeline->tsc_khz = tsc_khz();
+  }
+
+  depth = 0;
+  timeline_begin(stage);
+}
+
+int
+timeline_begin(const char *name)
+{
+  if (!timeline || timeline->count >= TIMELINE_PHASES)
+    return -1;
+
+  struct timeline_phase *p = &timeline->phase[timeline->count];
+
+  memset(p, 0, sizeof(*p));
+  strncpy(p->name, name, sizeof(p->name));
+  p->depth = depth++;
+  p->begin = rdtsc();
+
+  return timeline->count++;
+}
+
+void
+timeline_end(int phase)
+{
+  if (phase < 0 || timeline->phase[phase].end != 0)
+    return;
+
+  uint64_t now = rdtsc();
+
+  /* Phases nested in this one end with it. */
+  for (unsigned i = phase; i < timeline->count; i++)
+    if (timeline->phase[i].end == 0)
+      timeline->phase[i].end = now;
+  depth = timeline->phase[phase].depth;
+}
+
+void
+timeline_finish(void)
+{
+  if (!timeline)
+    return;
+
+  uint64_t now = rdtsc();
+
+  /* Earlier stages finished theirs. */
+  for (unsigned i = 0; i < timeline->count; i++)
+    if (timeline->phase[i].end == 0)
+      timeline->phase[i].end = now;
+  depth = 0;
+}
+
+void
+timeline_print(void)
+{
+  if (!timeline || timeline->count == 0)
+    return;
+
+  uint32_t khz = timeline->tsc_khz;
+  uint64_t t0  = timeline->phase[0].begin;
+
+  /* Without a TSC frequency the times are in cycles. */
+  printf("Boot timeline (%s):\n", khz ? "us" : "TSC cycles");
+  for (unsigned i = 0; i < timeline->count; i++) {
+    const struct timeline_phase *p = &timeline->phase[i];
+    uint64_t end = p->end ? p->end : rdtsc();
+    uint64_t at  = p->begin - t0;
+    uint64_t len = end - p->begin;
+    char name[TIMELINE_NAME + 1];
+
+    if (khz) {
+      at  = at  * 1000 / khz;
+      len = len * 1000 / khz;
+    }
+
+    memcpy(name, p->name, TIMELINE_NAME);
+    name[TIMELINE_NAME] = 0;
+
+    printf("  %10llu %10llu%s ", at, len, p->end ? " " : "+");
+    for (unsigned d = 0; d < p->depth; d++)
+      printf("  ");
+    printf("%s\n", name);
+  }
+}
+
+/* EOF */
@@ -45,17 +45,19 @@
 #define FNAME    8
 #define FCOMMENT 16
 
-/* If dest is NULL, return uncompressed length in *destLen. */
-int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
-                         const void *source, unsigned int sourceLen)
+/* find the deflate data behind the gzip header at source and store
+   its offset in *headerLen */
+int tinf_gzip_header(const void *source, unsigned int sourceLen,
+                     unsigned int *headerLen)
 {
     unsigned char *src = (unsigned char *)source;
-    unsigned char *dst = (unsigned char *)dest;
+    unsigned char *end = src + sourceLen;
     unsigned char *start;
-    unsigned int dlen, crc32;
-    int res;
     unsigned char flg;
 
+    /* base header and trailer */
+    if (sourceLen < 18) return TINF_DATA_ERROR;
+
     /* -- check format -- */
 
     /* check id bytes */
@@ -80,19 +82,32 @@ int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
     {
        unsigned int xlen = start[1];
        xlen = 256*xlen + start[0];
+       if (xlen + 2 > (unsigned int)(end - start)) return TINF_DATA_ERROR;
        start += xlen + 2;
     }
 
     /* skip file name if present */
-    if (flg & FNAME) { while (*start) ++start; ++start; }
+    if (flg & FNAME)
+    {
+       while (start < end && *start) ++start;
+       if (start++ == end) return TINF_DATA_ERROR;
+    }
 
     /* skip file comment if present */
-    if (flg & FCOMMENT) { while (*start) ++start; ++start; }
+    if (flg & FCOMMENT)
+    {
+       while (start < end && *start) ++start;
+       if (start++ == end) return TINF_DATA_ERROR;
+    }
 
     /* check header crc if present */
     if (flg & FHCRC)
     {
-       unsigned int hcrc = start[1];
+       unsigned int hcrc;
+
+       if (end - start < 2) return TINF_DATA_ERROR;
+
+       hcrc = start[1];
        hcrc = 256*hcrc + start[0];
 
        if (hcrc != (tinf_crc32(src, start - src) & 0x0000ffff))
@@ -101,6 +116,36 @@ int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
        start += 2;
     }
 
+    /* leave room for the trailer */
+    if (end - start < 8) return TINF_DATA_ERROR;
+
+    *headerLen = start - src;
+
+    return TINF_OK;
+}
+
+/* If dest is NULL, return uncompressed length in *destLen. */
+int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
+                         const void *source, unsigned int sourceLen)
+{
+    return tinf_gzip_uncompress_data(0, dest, destLen, source, sourceLen);
+}
+
+/* Like tinf_gzip_uncompress, with the decoder state in d (see
+   tinf_uncompress_data). */
+int tinf_gzip_uncompress_data(TINF_DATA *d, void *dest, unsigned int *destLen,
+                              const void *source, unsigned int sourceLen)
+{
+    unsigned char *src = (unsigned char *)source;
+    unsigned char *dst = (unsigned char *)dest;
+    unsigned int hlen, dlen, crc32, sum = 0;
+    int res;
+
+    /* -- check format and find start of compressed data -- */
+
+    if (tinf_gzip_header(src, sourceLen, &hlen) != TINF_OK)
+       return TINF_DATA_ERROR;
+
     /* -- get decompressed length -- */
 
     dlen =            src[sourceLen - 1];
@@ -120,9 +165,10 @@ int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
     crc32 = 256*crc32 + src[sourceLen - 7];
     crc32 = 256*crc32 + src[sourceLen - 8];
 
-    /* -- decompress data -- */
+    /* -- decompress data and compute its CRC32 on the way -- */
 
-    res = tinf_uncompress(dst, destLen, start, src + sourceLen - start - 8);
+    res = tinf_uncompress_data(d, dst, destLen, src + hlen, sourceLen - hlen - 8,
+                               tinf_crc32_update, &sum);
 
     if (res != TINF_OK) return TINF_DATA_ERROR;
 
@@ -130,7 +176,7 @@ int tinf_gzip_uncompress(void *dest, unsigned int *destLen,
 
     /* -- check CRC32 checksum -- */
 
-    if (crc32 != tinf_crc32(dst, dlen)) return TINF_DATA_ERROR;
+    if (crc32 != sum) return TINF_DATA_ERROR;
 
     return TINF_OK;
 }
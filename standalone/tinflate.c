@@ -31,28 +31,53 @@
  *    any source distribution.
  */
 
+/*
+ * Modified to decode Huffman symbols with lookup tables instead of
+ * walking the code one bit at a time, and to copy matches and stored
+ * blocks in words. Define TINF_BITSERIAL to get the original
+ * bit-serial decoder as a reference implementation.
+ *
+ * The block decoder is resumable: near the end of the input or the
+ * output every symbol is undone if it does not fit, which the stream
+ * functions at the end build on.
+ */
+
 #include "tinf.h"
 
 /* ------------------------------ *
  * -- internal data structures -- *
  * ------------------------------ */
 
-typedef struct {
-   unsigned short table[16];  /* table of code length counts */
-   unsigned short trans[288]; /* code -> symbol translation table */
-} TINF_TREE;
+/* bits resolved by the primary lookup tables */
+#define TINF_LROOT 9   /* literal/length tree */
+#define TINF_DROOT 6   /* distance tree */
+#define TINF_CROOT 7   /* code length tree */
+
+/* marks table entries for bit patterns that are not a valid code */
+#define TINF_BAD_SYMBOL 0xffff
+
+#define TINF_BITBUF_BITS (8 * sizeof(TINF_BITBUF))
+
+/* input bytes that always hold a whole symbol with its extra bits */
+#define TINF_MARGIN 8
+
+/* states of the block decoder */
+#define TINF_HEADER 0  /* at a block header */
+#define TINF_STORED 1  /* inside a stored block */
+#define TINF_CODES  2  /* inside a Huffman coded block */
+#define TINF_DONE   3  /* behind the final block */
+
+/* internal result, the output buffer is full */
+#define TINF_NEED_OUTPUT 3
 
+/* bit stream position to go back to when a symbol or block header
+   runs past the end of the input or output */
 typedef struct {
    const unsigned char *source;
-   unsigned int tag;
+   unsigned int overrun;
+   TINF_BITBUF tag;
    unsigned int bitcount;
-
-   unsigned char *dest;
-   unsigned int *destLen;
-
-   TINF_TREE ltree; /* dynamic length/symbol tree */
-   TINF_TREE dtree; /* dynamic distance tree */
-} TINF_DATA;
+} TINF_MARK;
 
 /* --------------------------------------------------- *
  * -- uninitialized global data (static structures) -- *
@@ -122,8 +147,96 @@ static void tinf_build_fixed_trees(TINF_TREE *lt, TINF_TREE *dt)
    for (i = 0; i < 32; ++i) dt->trans[i] = i;
 }
 
+#ifndef TINF_BITSERIAL
+
+/* reverse the lowest len bits of code */
+static unsigned int tinf_reverse(unsigned int code, unsigned int len)
+{
+   unsigned int rev = 0;
+
+   for (; len; --len, code >>= 1) rev = (rev << 1) | (code & 1);
+
+   return rev;
+}
+
+/* build lookup tables with root index bits from the code length
+   counts and the sorted symbols of a tree */
+static int tinf_build_fast(TINF_TREE *t, unsigned int root)
+{
+   const TINF_ENTRY bad = { TINF_BAD_SYMBOL, 0, 0 };
+   unsigned short left[16];
+   unsigned int len, i, n, code, prefix, used;
+   unsigned int sub_base = 0, sub_bits = 0;
+
+   t->root = root;
+   used = 1 << root;
+   prefix = used;
+
+   for (i = 0; i < used; ++i) t->fast[i] = bad;
+   for (i = 0; i < 16; ++i) left[i] = t->table[i];
+
+   /* walk the canonical codes in increasing order, the symbols in
+      trans are sorted accordingly */
+   for (code = 0, i = 0, len = 1; len < 16; ++len, code <<= 1)
+   {
+      for (; left[len]; --left[len], ++code, ++i)
+      {
+         TINF_ENTRY e;
+         unsigned int rev = tinf_reverse(code, len);
+
+         e.sym = t->trans[i];
+         e.sub = 0;
+
+         if (len <= root)
+         {
+            /* replicate into all slots sharing the low len bits */
+            e.bits = len;
+            for (n = rev; n < (1u << root); n += 1 << len) t->fast[n] = e;
+            continue;
+         }
+
+         if ((rev & ((1 << root) - 1)) != prefix)
+         {
+            /* start a sub-table large enough for the remaining codes
+               that share this root prefix */
+            int space;
+
+            prefix = rev & ((1 << root) - 1);
+            sub_bits = len - root;
+            space = 1 << sub_bits;
+            while (sub_bits + root < 15)
+            {
+               space -= left[sub_bits + root];
+               if (space <= 0) break;
+               ++sub_bits;
+               space <<= 1;
+            }
+
+            if (used + (1 << sub_bits) > TINF_FAST_SIZE) return TINF_DATA_ERROR;
+
+            sub_base = used;
+            used += 1 << sub_bits;
+            for (n = sub_base; n < used; ++n) t->fast[n] = bad;
+
+            t->fast[prefix].sym = sub_base;
+            t->fast[prefix].bits = root;
+            t->fast[prefix].sub = sub_bits;
+         }
+
+         e.bits = len - root;
+         for (n = rev >> root; n < (1u << sub_bits); n += 1 << (len - root))
+            t->fast[sub_base + n] = e;
+      }
+   }
+
+   return TINF_OK;
+}
+
+#endif
+
 /* given an array of code lengths, build a tree */
-static void tinf_build_tree(TINF_TREE *t, const unsigned char *lengths, unsigned int num)
+static int tinf_build_tree(TINF_TREE *t, const unsigned char *lengths, unsigned int num,
+                           unsigned int root)
 {
    unsigned short offs[16];
    unsigned int i, sum;
@@ -148,12 +261,115 @@ static void tinf_build_tree(TINF_TREE *t, const unsigned char *lengths, unsigned
    {
       if (lengths[i]) t->trans[offs[lengths[i]]++] = i;
    }
+
+#ifndef TINF_BITSERIAL
+   return tinf_build_fast(t, root);
+#else
+   (void)root;
+   return TINF_OK;
+#endif
 }
 
 /* ---------------------- *
  * -- decode functions -- *
  * ---------------------- */
 
+#ifndef TINF_BITSERIAL
+
+/* load a little-endian machine word from an unaligned address */
+static TINF_BITBUF tinf_load_word(const unsigned char *p)
+{
+   TINF_BITBUF w;
+
+   __builtin_memcpy(&w, p, sizeof(w));
+
+   return w;
+}
+
+/* fill tag to at least TINF_BITBUF_BITS - 8 bits */
+static void tinf_refill(TINF_DATA *d)
+{
+   if (d->source_end - d->source >= (long)sizeof(TINF_BITBUF))
+   {
+      /* load a whole word and keep the complete bytes that fit. Bits
+         above bitcount are either zero or the very bytes the next
+         refill ORs in again. */
+      d->tag |= tinf_load_word(d->source) << d->bitcount;
+      d->source += (TINF_BITBUF_BITS - 1 - d->bitcount) >> 3;
+      d->bitcount |= TINF_BITBUF_BITS - 8;
+   } else {
+      /* near the end of the input, feed bytes one at a time and
+         zeros once it is exhausted */
+      while (d->bitcount <= TINF_BITBUF_BITS - 9)
+      {
+         if (d->source < d->source_end)
+         {
+            d->tag |= (TINF_BITBUF)*d->source++ << d->bitcount;
+         } else {
+            d->overrun++;
+         }
+         d->bitcount += 8;
+      }
+   }
+}
+
+/* drop the bits up to the next byte boundary and give the remaining
+   whole bytes in tag back to the source stream */
+static void tinf_align_source(TINF_DATA *d)
+{
+   unsigned int bytes = d->bitcount >> 3;
+
+   d->source -= bytes - (d->overrun < bytes ? d->overrun : bytes);
+   d->overrun -= d->overrun < bytes ? d->overrun : bytes;
+   d->tag = 0;
+   d->bitcount = 0;
+}
+
+/* read a num bit value from a stream and add base */
+static unsigned int tinf_read_bits(TINF_DATA *d, int num, int base)
+{
+   unsigned int val;
+
+   if (d->bitcount < (unsigned int)num) tinf_refill(d);
+
+   val = d->tag & ((1UL << num) - 1);
+   d->tag >>= num;
+   d->bitcount -= num;
+
+   return val + base;
+}
+
+/* get one bit from source stream */
+static int tinf_getbit(TINF_DATA *d)
+{
+   return tinf_read_bits(d, 1, 0);
+}
+
+/* given a data stream and a tree, decode a symbol */
+static int tinf_decode_symbol(TINF_DATA *d, TINF_TREE *t)
+{
+   TINF_ENTRY e;
+
+   /* no code is longer than 15 bits */
+   if (d->bitcount < 15) tinf_refill(d);
+
+   e = t->fast[d->tag & ((1 << t->root) - 1)];
+
+   if (e.sub)
+   {
+      d->tag >>= e.bits;
+      d->bitcount -= e.bits;
+      e = t->fast[e.sym + (d->tag & ((1 << e.sub) - 1))];
+   }
+
+   d->tag >>= e.bits;
+   d->bitcount -= e.bits;
+
+   return e.sym;
+}
+
+#else
+
 /* get one bit from source stream */
 static int tinf_getbit(TINF_DATA *d)
 {
@@ -162,8 +378,14 @@ static int tinf_getbit(TINF_DATA *d)
    /* check if tag is empty */
    if (!d->bitcount--)
    {
-      /* load next tag */
-      d->tag = *d->source++;
+      /* load next tag, zeros once the input is exhausted */
+      if (d->source < d->source_end)
+      {
+         d->tag = *d->source++;
+      } else {
+         d->tag = 0;
+         d->overrun++;
+      }
       d->bitcount = 7;
    }
 
@@ -207,15 +429,70 @@ static int tinf_decode_symbol(TINF_DATA *d, TINF_TREE *t)
       sum += t->table[len];
       cur -= t->table[len];
 
-   } while (cur >= 0);
+   } while (cur >= 0 && len < 15);
+
+   /* no code is longer than 15 bits */
+   if (cur >= 0) return TINF_BAD_SYMBOL;
 
    return t->trans[sum + cur];
 }
 
+/* drop the rest of the current byte */
+static void tinf_align_source(TINF_DATA *d)
+{
+   d->bitcount = 0;
+}
+
+#endif
+
+/* true if anything decoded since the last mark used the zeros fed
+   beyond the input */
+static int tinf_overran(const TINF_DATA *d)
+{
+#ifndef TINF_BITSERIAL
+   return d->overrun * 8 > d->bitcount;
+#else
+   return d->overrun != 0;
+#endif
+}
+
+static void tinf_mark(const TINF_DATA *d, TINF_MARK *m)
+{
+   m->source = d->source;
+   m->overrun = d->overrun;
+   m->tag = d->tag;
+   m->bitcount = d->bitcount;
+}
+
+/* go back to a mark and drop the zeros fed beyond the input, so
+   decoding can resume there once more input arrives */
+static void tinf_rewind(TINF_DATA *d, const TINF_MARK *m)
+{
+   d->source = m->source;
+   d->tag = m->tag;
+   d->bitcount = m->bitcount - 8 * m->overrun;
+   d->overrun = 0;
+}
+
+/* once the decoder is past the input left over in the hold buffer,
+   go on in the chunk the hold buffer was topped up from; only called
+   between symbols, when no zeros fed to tag are used */
+static void tinf_leave_hold(TINF_DATA *d)
+{
+   if (d->hold_next && d->source >= d->hold_next)
+   {
+      d->bitcount -= 8 * d->overrun;
+      d->overrun = 0;
+      d->source = d->next + (d->source - d->hold_next);
+      d->source_end = d->next_end;
+      d->hold_next = 0;
+   }
+}
+
 /* given a data stream, decode dynamic trees from it */
-static void tinf_decode_trees(TINF_DATA *d, TINF_TREE *lt, TINF_TREE *dt)
+static int tinf_decode_trees(TINF_DATA *d, TINF_TREE *lt, TINF_TREE *dt)
 {
-   TINF_TREE code_tree;
+   TINF_TREE *code_tree = &d->ctree;
    unsigned char lengths[288+32];
    unsigned int hlit, hdist, hclen;
    unsigned int i, num, length;
@@ -241,20 +518,25 @@ static void tinf_decode_trees(TINF_DATA *d, TINF_TREE *lt, TINF_TREE *dt)
    }
 
    /* build code length tree */
-   tinf_build_tree(&code_tree, lengths, 19);
+   if (tinf_build_tree(code_tree, lengths, 19, TINF_CROOT) != TINF_OK)
+      return TINF_DATA_ERROR;
 
    /* decode code lengths for the dynamic trees */
    for (num = 0; num < hlit + hdist; )
    {
-      int sym = tinf_decode_symbol(d, &code_tree);
+      int sym = tinf_decode_symbol(d, code_tree);
 
       switch (sym)
       {
       case 16:
          /* copy previous code length 3-6 times (read 2 bits) */
          {
-            unsigned char prev = lengths[num - 1];
-            for (length = tinf_read_bits(d, 2, 3); length; --length)
+            unsigned char prev;
+            if (num == 0) return TINF_DATA_ERROR;
+            prev = lengths[num - 1];
+            length = tinf_read_bits(d, 2, 3);
+            if (num + length > hlit + hdist) return TINF_DATA_ERROR;
+            for (; length; --length)
             {
                lengths[num++] = prev;
             }
@@ -262,126 +544,427 @@ static void tinf_decode_trees(TINF_DATA *d, TINF_TREE *lt, TINF_TREE *dt)
          break;
       case 17:
          /* repeat code length 0 for 3-10 times (read 3 bits) */
-         for (length = tinf_read_bits(d, 3, 3); length; --length)
+         length = tinf_read_bits(d, 3, 3);
+         if (num + length > hlit + hdist) return TINF_DATA_ERROR;
+         for (; length; --length)
          {
             lengths[num++] = 0;
          }
          break;
       case 18:
          /* repeat code length 0 for 11-138 times (read 7 bits) */
-         for (length = tinf_read_bits(d, 7, 11); length; --length)
+         length = tinf_read_bits(d, 7, 11);
+         if (num + length > hlit + hdist) return TINF_DATA_ERROR;
+         for (; length; --length)
          {
             lengths[num++] = 0;
          }
          break;
       default:
          /* values 0-15 represent the actual code lengths */
+         if (sym > 15) return TINF_DATA_ERROR;
          lengths[num++] = sym;
          break;
       }
    }
 
    /* build dynamic trees */
-   tinf_build_tree(lt, lengths, hlit);
-   tinf_build_tree(dt, lengths + hlit, hdist);
+   if (tinf_build_tree(lt, lengths, hlit, TINF_LROOT) != TINF_OK)
+      return TINF_DATA_ERROR;
+
+   return tinf_build_tree(dt, lengths + hlit, hdist, TINF_DROOT);
+}
+
+/* -------------------- *
+ * -- copy functions -- *
+ * -------------------- */
+
+/* smallest multiple of a short match distance that is at least 8 */
+static const unsigned char tinf_period[8] = { 0, 8, 8, 9, 8, 10, 12, 14 };
+
+/* copy len bytes in 8-byte words, src must be at least 8 bytes
+   behind dst */
+static void tinf_copy_words(unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+   for (; len >= 8; len -= 8, dst += 8, src += 8)
+   {
+      unsigned long long w;
+
+      __builtin_memcpy(&w, src, 8);
+      __builtin_memcpy(dst, &w, 8);
+   }
+
+   while (len--) *dst++ = *src++;
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+
+typedef char TINF_V16 __attribute__((vector_size(16)));
+
+/* copy len bytes in 16-byte SSE2 moves, src must be at least 16
+   bytes behind dst */
+__attribute__((target("sse2")))
+static void tinf_copy_sse2(unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+   for (; len >= 16; len -= 16, dst += 16, src += 16)
+   {
+      TINF_V16 v;
+
+      __builtin_memcpy(&v, src, 16);
+      __builtin_memcpy(dst, &v, 16);
+   }
+
+   tinf_copy_words(dst, src, len);
+}
+
+/* check CPUID for SSE2 support */
+static int tinf_has_sse2(void)
+{
+   unsigned int r[4];
+
+   tinf_cpuid(1, r);
+
+   return (r[3] >> 26) & 1;
+}
+
+#endif
+
+static void tinf_copy_first(unsigned char *dst, const unsigned char *src, unsigned int len);
+
+/* 16-byte copy, SSE2 if the CPU has it */
+static void (*tinf_copy_wide)(unsigned char *, const unsigned char *, unsigned int) = tinf_copy_first;
+
+/* pick a kernel on the first call */
+static void tinf_copy_first(unsigned char *dst, const unsigned char *src, unsigned int len)
+{
+   tinf_copy_select(TINF_COPY_AUTO);
+
+   tinf_copy_wide(dst, src, len);
+}
+
+/* use the given kernel, or the fastest one for TINF_COPY_AUTO, and
+   return the kernel in use; without SSE2 it falls back to words */
+int tinf_copy_select(int kernel)
+{
+   if (kernel == TINF_COPY_AUTO) kernel = TINF_COPY_SSE2;
+
+#if defined(__i386__) || defined(__x86_64__)
+   if (kernel == TINF_COPY_SSE2 && tinf_has_sse2())
+   {
+      tinf_copy_wide = tinf_copy_sse2;
+      return kernel;
+   }
+#endif
+
+   tinf_copy_wide = tinf_copy_words;
+
+   return TINF_COPY_WORDS;
+}
+
+/* copy a match of length bytes from offs bytes back, the source may
+   overlap the destination, in which case the last offs bytes repeat;
+   also used by the LZ4 and zstd decoders */
+void TINFCC tinf_copy_match(unsigned char *dst, unsigned int offs, unsigned int length)
+{
+   unsigned int i;
+
+   if (offs >= 16)
+   {
+      tinf_copy_wide(dst, dst - offs, length);
+      return;
+   }
+
+   if (offs == 1)
+   {
+      /* run of a single byte */
+      __builtin_memset(dst, dst[-1], length);
+      return;
+   }
+
+   if (offs < 8)
+   {
+      /* the output is periodic in offs, so once the first period - offs
+         bytes are in place, the rest can be copied from period bytes
+         back without overlapping a word */
+      unsigned int period = tinf_period[offs];
+      unsigned int head = period - offs < length ? period - offs : length;
+
+      for (i = 0; i < head; ++i) dst[i] = (dst - offs)[i];
+
+      dst += head;
+      length -= head;
+      offs = period;
+   }
+
+   tinf_copy_words(dst, dst - offs, length);
+}
+
+/* ------------------------ *
+ * -- checksum functions -- *
+ * ------------------------ */
+
+/* output to produce before the checksum catches up within a block */
+#define TINF_CHECK_WINDOW 32768
+
+/* run the checksum over the output produced since the last call,
+   while it is still in the cache */
+static void tinf_check_output(TINF_DATA *d)
+{
+   if (d->check)
+   {
+      *d->sum = d->check(*d->sum, d->check_pos, d->dest - d->check_pos);
+      d->check_pos = d->dest;
+   }
 }
 
 /* ----------------------------- *
  * -- block inflate functions -- *
  * ----------------------------- */
 
-/* given a stream and two trees, inflate a block of data */
-static int tinf_inflate_block_data(TINF_DATA *d, TINF_TREE *lt, TINF_TREE *dt)
+/* move on to the next block, or stop behind the final one */
+static int tinf_end_block(TINF_DATA *d)
 {
-   /* remember current output position */
-   unsigned char *start = d->dest;
+   d->state = d->bfinal ? TINF_DONE : TINF_HEADER;
+
+   tinf_check_output(d);
+
+   return TINF_OK;
+}
+
+/* read a block header, and the trees of a dynamic block */
+static int tinf_inflate_block_header(TINF_DATA *d)
+{
+   TINF_MARK mark;
+   unsigned int length, invlength;
+   int res = TINF_OK;
+
+   tinf_leave_hold(d);
+   tinf_mark(d, &mark);
+
+   /* read final block flag */
+   d->bfinal = tinf_getbit(d);
+
+   /* read block type (2 bits) */
+   switch (tinf_read_bits(d, 2, 0))
+   {
+   case 0:
+      /* uncompressed block, the lengths start at the next byte */
+      if (tinf_overran(d)) goto need_input;
+
+      tinf_align_source(d);
+
+      if (d->source_end - d->source < 4) goto need_input;
+
+      /* get length */
+      length = d->source[1];
+      length = 256*length + d->source[0];
+
+      /* get one's complement of length */
+      invlength = d->source[3];
+      invlength = 256*invlength + d->source[2];
+
+      /* check length */
+      if (length != (~invlength & 0x0000ffff)) return TINF_DATA_ERROR;
+
+      d->source += 4;
+      d->left = length;
+      d->state = TINF_STORED;
+      return TINF_OK;
+   case 1:
+      /* block with fixed huffman trees */
+      d->lt = &sltree;
+      d->dt = &sdtree;
+      d->state = TINF_CODES;
+      break;
+   case 2:
+      /* block with dynamic huffman trees, decode them from stream */
+      res = tinf_decode_trees(d, &d->ltree, &d->dtree);
+      d->lt = &d->ltree;
+      d->dt = &d->dtree;
+      d->state = TINF_CODES;
+      break;
+   default:
+      res = TINF_DATA_ERROR;
+      break;
+   }
+
+   if (!tinf_overran(d)) return res;
+
+need_input:
+   tinf_rewind(d, &mark);
+   d->state = TINF_HEADER;
+
+   return TINF_NEED_INPUT;
+}
+
+/* copy a stored block as far as input and output allow */
+static int tinf_inflate_uncompressed_block(TINF_DATA *d)
+{
+   while (d->left)
+   {
+      unsigned int length = d->left;
+
+      tinf_leave_hold(d);
+
+      if ((unsigned long)(d->source_end - d->source) < length)
+         length = d->source_end - d->source;
+
+      if ((unsigned long)(d->dest_end - d->dest) < length)
+         length = d->dest_end - d->dest;
+
+      if (!length)
+         return d->source == d->source_end ? TINF_NEED_INPUT : TINF_NEED_OUTPUT;
+
+      __builtin_memcpy(d->dest, d->source, length);
+      d->dest += length;
+      d->source += length;
+      d->left -= length;
+   }
+
+   return tinf_end_block(d);
+}
+
+/* inflate Huffman coded data until the end of the block, or until the
+   input or the output runs short */
+static int tinf_inflate_block_data(TINF_DATA *d)
+{
+   TINF_TREE *lt = d->lt, *dt = d->dt;
+   TINF_MARK mark;
+   int edge;
+
+   /* only used when edge is set, which takes a fresh mark */
+   tinf_mark(d, &mark);
 
    while (1)
    {
-      int sym = tinf_decode_symbol(d, lt);
+      unsigned int length, dist, offs;
+      int sym;
 
-      /* check for end of block */
-      if (sym == 256)
+      /* close to the end of the input or output, a symbol may not fit
+         and must be undone */
+      edge = d->source_end - d->source < TINF_MARGIN ||
+             d->dest_end - d->dest < 258;
+
+      if (edge)
       {
-         *d->destLen += d->dest - start;
-         return TINF_OK;
+         tinf_leave_hold(d);
+         tinf_mark(d, &mark);
       }
 
+      sym = tinf_decode_symbol(d, lt);
+
       if (sym < 256)
       {
-         *d->dest++ = sym;
+         if (edge)
+         {
+            if (tinf_overran(d)) goto need_input;
+            if (d->dest == d->dest_end) goto need_output;
+         }
 
-      } else {
+         *d->dest++ = sym;
+         continue;
+      }
 
-         int length, dist, offs;
-         int i;
+      /* check for end of block */
+      if (sym == 256)
+      {
+         if (edge && tinf_overran(d)) goto need_input;
 
-         sym -= 257;
+         return tinf_end_block(d);
+      }
 
-         /* possibly get more bits from length code */
-         length = tinf_read_bits(d, length_bits[sym], length_base[sym]);
+      if (sym > 285) break;
 
-         dist = tinf_decode_symbol(d, dt);
+      sym -= 257;
 
-         /* possibly get more bits from distance code */
-         offs = tinf_read_bits(d, dist_bits[dist], dist_base[dist]);
+      /* possibly get more bits from length code */
+      length = tinf_read_bits(d, length_bits[sym], length_base[sym]);
 
-         /* copy match */
-         for (i = 0; i < length; ++i)
-         {
-            d->dest[i] = d->dest[i - offs];
-         }
+      dist = tinf_decode_symbol(d, dt);
 
-         d->dest += length;
-      }
-   }
-}
+      if (dist > 29) break;
 
-/* inflate an uncompressed block of data */
-static int tinf_inflate_uncompressed_block(TINF_DATA *d)
-{
-   unsigned int length, invlength;
-   unsigned int i;
+      /* possibly get more bits from distance code */
+      offs = tinf_read_bits(d, dist_bits[dist], dist_base[dist]);
 
-   /* get length */
-   length = d->source[1];
-   length = 256*length + d->source[0];
+      if (edge)
+      {
+         if (tinf_overran(d)) goto need_input;
+         if ((unsigned long)(d->dest_end - d->dest) < length) goto need_output;
+      }
 
-   /* get one's complement of length */
-   invlength = d->source[3];
-   invlength = 256*invlength + d->source[2];
+      if (offs > (unsigned long)(d->dest - d->dest_start)) return TINF_DATA_ERROR;
 
-   /* check length */
-   if (length != (~invlength & 0x0000ffff)) return TINF_DATA_ERROR;
+      /* copy match */
+      tinf_copy_match(d->dest, offs, length);
 
-   d->source += 4;
+      d->dest += length;
 
-   /* copy block */
-   for (i = length; i; --i) *d->dest++ = *d->source++;
+      /* long runs of matches may fill a lot of output */
+      if (d->dest - d->check_pos >= TINF_CHECK_WINDOW) tinf_check_output(d);
+   }
 
-   /* make sure we start next block on a byte boundary */
-   d->bitcount = 0;
+   /* an invalid symbol, unless it was made up of the zeros behind
+      the input */
+   if (!edge || !tinf_overran(d)) return TINF_DATA_ERROR;
 
-   *d->destLen += length;
+need_input:
+   tinf_rewind(d, &mark);
+   return TINF_NEED_INPUT;
 
-   return TINF_OK;
+need_output:
+   tinf_rewind(d, &mark);
+   return TINF_NEED_OUTPUT;
 }
 
-/* inflate a block of data compressed with fixed huffman trees */
-static int tinf_inflate_fixed_block(TINF_DATA *d)
+/* decode blocks until the stream ends, or until the input or the
+   output runs short */
+static int tinf_inflate(TINF_DATA *d)
 {
-   /* decode block using fixed trees */
-   return tinf_inflate_block_data(d, &sltree, &sdtree);
+   int res = TINF_OK;
+
+   while (res == TINF_OK)
+   {
+      switch (d->state)
+      {
+      case TINF_HEADER:
+         res = tinf_inflate_block_header(d);
+         break;
+      case TINF_STORED:
+         res = tinf_inflate_uncompressed_block(d);
+         break;
+      case TINF_CODES:
+         res = tinf_inflate_block_data(d);
+         break;
+      default:
+         return TINF_OK;
+      }
+   }
+
+   return res;
 }
 
-/* inflate a block of data compressed with dynamic huffman trees */
-static int tinf_inflate_dynamic_block(TINF_DATA *d)
+/* set up d to inflate the stream at source into dest */
+static void tinf_start(TINF_DATA *d, const unsigned char *source, unsigned int sourceLen,
+                       unsigned char *dest, unsigned int destLen,
+                       TINF_CHECK check, unsigned int *sum)
 {
-   /* decode trees from stream */
-   tinf_decode_trees(d, &d->ltree, &d->dtree);
+   d->source = source;
+   d->source_end = source + sourceLen;
+   d->overrun = 0;
+   d->tag = 0;
+   d->bitcount = 0;
+   d->hold_next = 0;
+
+   d->dest = dest;
+   d->dest_start = dest;
+   d->dest_end = dest + destLen;
+
+   d->state = TINF_HEADER;
 
-   /* decode block using decoded trees */
-   return tinf_inflate_block_data(d, &d->ltree, &d->dtree);
+   d->check = check;
+   d->sum = sum;
+   d->check_pos = dest;
 }
 
 /* ---------------------- *
@@ -401,57 +984,204 @@ void tinf_init()
    /* fix a special case */
    length_bits[28] = 0;
    length_base[28] = 258;
+
+#ifndef TINF_BITSERIAL
+   /* build lookup tables for the fixed trees */
+   tinf_build_fast(&sltree, TINF_LROOT);
+   tinf_build_fast(&sdtree, TINF_DROOT);
+#endif
 }
 
 /* inflate stream from source to dest */
 int tinf_uncompress(void *dest, unsigned int *destLen,
                     const void *source, unsigned int sourceLen)
 {
-   TINF_DATA d;
-   int bfinal;
+   return tinf_uncompress_check(dest, destLen, source, sourceLen, 0, 0);
+}
+
+/* inflate stream from source to dest and continue the checksum in
+   *sum over the output, block by block */
+int tinf_uncompress_check(void *dest, unsigned int *destLen,
+                          const void *source, unsigned int sourceLen,
+                          TINF_CHECK check, unsigned int *sum)
+{
+   return tinf_uncompress_data(0, dest, destLen, source, sourceLen, check, sum);
+}
+
+/* like tinf_uncompress_check, but keep the decoder state in d, so
+   several streams can be inflated at the same time; if d is 0, a
+   static one is used */
+int tinf_uncompress_data(TINF_DATA *d, void *dest, unsigned int *destLen,
+                         const void *source, unsigned int sourceLen,
+                         TINF_CHECK check, unsigned int *sum)
+{
+   /* the lookup tables are too large for the loader stack */
+   static TINF_DATA sd;
+   int res;
+
+   if (!d) d = &sd;
+
+   tinf_start(d, (const unsigned char *)source, sourceLen,
+              (unsigned char *)dest, *destLen, check, sum);
+
+   res = tinf_inflate(d);
+
+   *destLen = d->dest - (unsigned char *)dest;
+
+   /* the whole stream has to fit into source and dest */
+   if (res != TINF_OK || d->state != TINF_DONE) return TINF_DATA_ERROR;
+
+   return TINF_OK;
+}
+
+/* -------------------------- *
+ * -- streaming functions -- *
+ * -------------------------- */
+
+/* set up s for a new stream; the checksum in *sum is continued over
+   the output as it is drained */
+void tinf_stream_init(TINF_STREAM *s, TINF_CHECK check, unsigned int *sum)
+{
+   tinf_start(&s->d, s->hold, 0, s->window, sizeof(s->window), 0, 0);
+
+   s->pending = s->window;
+   s->check = check;
+   s->sum = sum;
+}
+
+/* hand the next chunk of input to s, once drain asked for it; input
+   left over from the last chunk has been kept in the hold buffer, so
+   the caller may reuse the memory of its chunks */
+int tinf_stream_feed(TINF_STREAM *s, const void *source, unsigned int sourceLen)
+{
+   TINF_DATA *d = &s->d;
+   const unsigned char *src = (const unsigned char *)source;
+   unsigned int held = d->source_end - d->source;
+   unsigned int i, length;
+
+   /* the last chunk is still in use */
+   if (d->hold_next || (held && d->source != s->hold)) return TINF_DATA_ERROR;
 
-   /* initialise data */
-   d.source = (const unsigned char *)source;
-   d.bitcount = 0;
+   if (!held)
+   {
+      d->source = src;
+      d->source_end = src + sourceLen;
+      return TINF_OK;
+   }
 
-   d.dest = (unsigned char *)dest;
-   d.destLen = destLen;
+   /* top up the hold buffer, enough to finish what is held there */
+   length = sourceLen < TINF_HOLD - held ? sourceLen : TINF_HOLD - held;
+
+   for (i = 0; i < length; ++i) s->hold[held + i] = src[i];
+
+   d->source_end = s->hold + held + length;
+   d->hold_next = s->hold + held;
+   d->next = src;
+   d->next_end = src + sourceLen;
+
+   return TINF_OK;
+}
+
+/* keep the input the decoder still needs in the hold buffer */
+static int tinf_stream_keep(TINF_STREAM *s)
+{
+   TINF_DATA *d = &s->d;
+   unsigned int i, length = d->source_end - d->source;
+
+   /* a block header never spans more than a topped up hold buffer */
+   if (d->hold_next && d->next + (d->source_end - d->hold_next) != d->next_end)
+      return TINF_DATA_ERROR;
+
+   /* moving down, so copying forwards is safe */
+   for (i = 0; i < length; ++i) s->hold[i] = d->source[i];
+
+   d->source = s->hold;
+   d->source_end = s->hold + length;
+   d->hold_next = 0;
+
+   return TINF_NEED_INPUT;
+}
+
+/* inflate up to *destLen bytes into dest and set *destLen to the
+   number written; returns TINF_OK when dest is full, TINF_NEED_INPUT
+   when the input fed so far is used up, and TINF_STREAM_END when the
+   stream ended and all of its output was drained */
+int tinf_stream_drain(TINF_STREAM *s, void *dest, unsigned int *destLen)
+{
+   TINF_DATA *d = &s->d;
+   unsigned char *out = (unsigned char *)dest;
+   unsigned int room = *destLen;
+   int res = TINF_OK;
 
    *destLen = 0;
 
-   do {
+   while (1)
+   {
+      unsigned int length = d->dest - s->pending;
+
+      /* hand out what is in the window */
+      if (length > room) length = room;
+
+      __builtin_memcpy(out, s->pending, length);
+      if (s->check) *s->sum = s->check(*s->sum, out, length);
+
+      s->pending += length;
+      out += length;
+      room -= length;
+      *destLen += length;
 
-      unsigned int btype;
-      int res;
+      if (s->pending == d->dest && d->state == TINF_DONE) return TINF_STREAM_END;
 
-      /* read final block flag */
-      bfinal = tinf_getbit(&d);
+      if (!room) return TINF_OK;
 
-      /* read block type (2 bits) */
-      btype = tinf_read_bits(&d, 2, 0);
+      if (res == TINF_NEED_INPUT) return tinf_stream_keep(s);
 
-      /* decompress block */
-      switch (btype)
+      /* keep TINF_WINDOW bytes of history and make room behind them;
+         moving down, so copying forwards is safe */
+      if (d->dest_end - d->dest < 258)
       {
-      case 0:
-         /* decompress uncompressed block */
-         res = tinf_inflate_uncompressed_block(&d);
-         break;
-      case 1:
-         /* decompress block with fixed huffman trees */
-         res = tinf_inflate_fixed_block(&d);
-         break;
-      case 2:
-         /* decompress block with dynamic huffman trees */
-         res = tinf_inflate_dynamic_block(&d);
-         break;
-      default:
-         return TINF_DATA_ERROR;
+         unsigned int shift = d->dest - s->window - TINF_WINDOW;
+
+         tinf_copy_wide(s->window, s->window + shift, TINF_WINDOW);
+         d->dest -= shift;
+         s->pending -= shift;
       }
 
-      if (res != TINF_OK) return TINF_DATA_ERROR;
+      res = tinf_inflate(d);
+
+      if (res == TINF_DATA_ERROR) return res;
+   }
+}
+
+/* check that the stream ended and all of its output was drained, and
+   copy up to *restLen bytes of the input behind it, like a gzip or
+   zlib trailer, to rest; call it before reusing the last chunk */
+int tinf_stream_finish(TINF_STREAM *s, void *rest, unsigned int *restLen)
+{
+   TINF_DATA *d = &s->d;
+   unsigned char *out = (unsigned char *)rest;
+   unsigned int n = 0;
+
+   if (d->state != TINF_DONE || s->pending != d->dest)
+   {
+      *restLen = 0;
+      return TINF_DATA_ERROR;
+   }
+
+   /* give the whole bytes in tag back to the input */
+   tinf_align_source(d);
+   tinf_leave_hold(d);
+
+   for (; n < *restLen && d->source < d->source_end; ++n) *out++ = *d->source++;
+
+   if (d->hold_next)
+   {
+      const unsigned char *p = d->next + (d->source_end - d->hold_next);
+
+      for (; n < *restLen && p < d->next_end; ++n) *out++ = *p++;
+   }
 
-   } while (!bfinal);
+   *restLen = n;
 
    return TINF_OK;
 }
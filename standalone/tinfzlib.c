@@ -38,7 +38,7 @@ int tinf_zlib_uncompress(void *dest, unsigned int *destLen,
 {
    unsigned char *src = (unsigned char *)source;
    unsigned char *dst = (unsigned char *)dest;
-   unsigned int a32;
+   unsigned int a32, sum = 1;
    int res;
    unsigned char cmf, flg;
 
@@ -68,15 +68,16 @@ int tinf_zlib_uncompress(void *dest, unsigned int *destLen,
    a32 = 256*a32 + src[sourceLen - 2];
    a32 = 256*a32 + src[sourceLen - 1];
 
-   /* -- inflate -- */
+   /* -- inflate and compute adler32 on the way -- */
 
-   res = tinf_uncompress(dst, destLen, src + 2, sourceLen - 6);
+   res = tinf_uncompress_check(dst, destLen, src + 2, sourceLen - 6,
+                               tinf_adler32_update, &sum);
 
    if (res != TINF_OK) return TINF_DATA_ERROR;
 
    /* -- check adler32 checksum -- */
 
-   if (a32 != tinf_adler32(dst, *destLen)) return TINF_DATA_ERROR;
+   if (a32 != sum) return TINF_DATA_ERROR;
 
    return TINF_OK;
 }
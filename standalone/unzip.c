@@ -6,6 +6,9 @@
 #include <elf.h>
 #include <version.h>
 #include <serial.h>
+#include <dispatch.h>
+#include <timeline-tools.h>
+#include <bootlog-tools.h>
 
 int
 main(uint32_t magic, struct mbi *mbi)
@@ -16,9 +19,15 @@ main(uint32_t magic, struct mbi *mbi)
     return 1;
   }
 
+  console_configure(mbi);
+  timeline_init(mbi, "unzip");
+  bootlog_init(mbi);
+
   printf("\nUnzip %s\n", version_str);
   printf("Blame Julian Stecklina <jsteckli@os.inf.tu-dresden.de> for bugs.\n\n");
 
+  cpu_dispatch(mbi);
+
   printf("Trying to relocate and uncompress all modules.\n"
          "This should be the first boot chainloader, otherwise our simplistic memory\n"
          "management will probably fail.\n");
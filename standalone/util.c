@@ -16,14 +16,28 @@
 #include <stdarg.h>
 #include <serial.h>
 #include <util.h>
+#include <vga.h>
+#include <bootlog-tools.h>
+#include <mbi.h>
+#include <acpi.h>
+#include <cpuid.h>
+
+enum {
+  CALIBRATE_MS = 10,
+  PIT_HZ       = 1193182,
+  TSC_KHZ_MAX  = 10000000,      /* assumed, if calibration failed */
+  STALL_READS  = 64,            /* timer reads that must see it move */
+};
+
+static bool calibrated;
+static uint32_t calibrated_khz;
 
 /**
- * Wait roughly a given number of milliseconds.
- *
- * We use the PIT for this.
+ * Wait roughly a given number of milliseconds with the PIT, if we do
+ * not know the TSC frequency.
  */
-void
-wait(int ms)
+static void
+pit_wait(int ms)
 {
   /* the PIT counts with 1.193 Mhz */
   ms*=1193;
@@ -43,6 +57,198 @@ wait(int ms)
     }
 }
 
+/** Latches and reads the count of PIT channel 2. */
+static uint16_t
+pit_channel2_count(void)
+{
+  outb(0x43, 0x80);
+  uint8_t lo = inb(0x42);
+  return lo | inb(0x42) << 8;
+}
+
+/**
+ * Counts TSC ticks while PIT channel 2 counts down CALIBRATE_MS.
+ * Returns 0, if the channel does not count.
+ */
+static uint64_t
+tsc_ticks_pit(void)
+{
+  unsigned count = PIT_HZ * CALIBRATE_MS / 1000;
+
+  /* Gate channel 2 on and the speaker off. In mode 0 the output goes
+     high, when the count reaches zero. */
+  outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+  outb(0x43, 0xB0);
+  outb(0x42, count & 0xFF);
+  outb(0x42, count >> 8);
+
+  uint64_t start = rdtsc();
+
+  /* Some chipsets do not gate channel 2 anymore. Each read takes
+     several port accesses of about a microsecond, so a channel that
+     counts has moved long before we give up. */
+  uint16_t first = pit_channel2_count();
+  unsigned reads;
+
+  for (reads = 0; reads < STALL_READS; reads++)
+    if (pit_channel2_count() != first)
+      break;
+  if (reads == STALL_READS)
+    return 0;
+
+  uint64_t now;
+
+  do {
+    now = rdtsc();
+    if (now - start > (1ULL << 32))
+      return 0;
+  } while ((inb(0x61) & 0x20) == 0);
+
+  return now - start;
+}
+
+/**
+ * Counts TSC ticks while the 24-bit ACPI PM timer advances by
+ * CALIBRATE_MS. Returns 0, if there is no PM timer or it does not
+ * count.
+ */
+static uint64_t
+tsc_ticks_pm_timer(uint16_t port)
+{
+  uint32_t ticks = (uint64_t)PM_TIMER_HZ * CALIBRATE_MS / 1000;
+  uint32_t first = inl(port);
+  uint64_t start = rdtsc();
+  uint64_t now;
+  unsigned reads = 0;
+
+  do {
+    now = rdtsc();
+    if (now - start > (1ULL << 32))
+      return 0;
+    if (++reads == STALL_READS && ((inl(port) - first) & 0xFFFFFF) == 0)
+      return 0;
+  } while (((inl(port) - first) & 0xFFFFFF) < ticks);
+
+  return now - start;
+}
+
+/**
+ * Returns the TSC frequency in kHz or 0, if it cannot be measured.
+ *
+ * It is measured once against the ACPI PM timer or, if the FADT has
+ * none, against PIT channel 2.
+ */
+uint32_t
+tsc_khz(void)
+{
+  if (calibrated)
+    return calibrated_khz;
+  calibrated = true;
+
+  uint16_t port  = acpi_pm_timer_port();
+  uint64_t ticks = port ? tsc_ticks_pm_timer(port) : 0;
+
+  if (ticks == 0)
+    ticks = tsc_ticks_pit();
+
+  calibrated_khz = (uint32_t)(ticks / CALIBRATE_MS);
+  return calibrated_khz;
+}
+
+/**
+ * Takes the TSC frequency an earlier stage measured, so we do not
+ * have to calibrate again.
+ */
+void
+tsc_khz_set(uint32_t khz)
+{
+  calibrated     = true;
+  calibrated_khz = khz;
+}
+
+/**
+ * Returns the TSC value ms milliseconds from now. Without a
+ * calibrated TSC, we assume a fast one, so timeouts rather take
+ * longer than expire early.
+ */
+deadline_t
+deadline_in(unsigned ms)
+{
+  uint32_t khz = tsc_khz();
+
+  return rdtsc() + (uint64_t)ms * (khz ? khz : TSC_KHZ_MAX);
+}
+
+bool
+deadline_passed(deadline_t deadline)
+{
+  return (int64_t)(rdtsc() - deadline) >= 0;
+}
+
+static bool
+has_waitpkg(void)
+{
+  uint32_t r[4];
+
+  cpuid(0, 0, r);
+  if (r[0] < 7)
+    return false;
+
+  cpuid(7, 0, r);
+  return ((r[2] >> 5) & 1) != 0;
+}
+
+/**
+ * Without WAITPKG we spin on the word, which at least stays in our
+ * cache. Plain MWAIT has no timeout and we run without interrupts,
+ * so nothing would wake us, if the write never comes.
+ */
+void
+wait_change(volatile uint32_t *word, uint32_t value, deadline_t deadline)
+{
+  static int waitpkg = -1;
+
+  if (waitpkg < 0)
+    waitpkg = has_waitpkg();
+
+  if (!waitpkg) {
+    while (*word == value && !deadline_passed(deadline))
+      cpu_pause();
+    return;
+  }
+
+  /* umonitor %eax */
+  asm volatile (".byte 0xf3, 0x0f, 0xae, 0xf0" :: "a" (word) : "memory");
+  if (*word != value)
+    return;
+
+  /* umwait %ecx until the TSC reaches edx:eax. ecx = 0 asks for the
+     deeper C0.2 state. */
+  asm volatile (".byte 0xf2, 0x0f, 0xae, 0xf1"
+                :: "c" (0), "a" ((uint32_t)deadline), "d" ((uint32_t)(deadline >> 32))
+                : "memory", "cc");
+}
+
+/**
+ * Wait roughly a given number of milliseconds.
+ *
+ * We spin on the TSC for this, or use the PIT, if we could not
+ * calibrate it.
+ */
+void
+wait(int ms)
+{
+  if (tsc_khz() == 0) {
+    pit_wait(ms);
+    return;
+  }
+
+  deadline_t deadline = deadline_in(ms);
+
+  while (!deadline_passed(deadline))
+    cpu_pause();
+}
+
 /**
  * Print the exit status and reboot the machine.
  */
@@ -64,36 +270,84 @@ __exit(unsigned status)
   /* NOT REACHED */
 }
 
+unsigned console_sinks = CONSOLE_VGA | CONSOLE_SERIAL;
+
+/**
+ * Output len chars to the enabled console sinks, one sink after the
+ * other.
+ */
+void
+out_write(const char *s, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    bootlog_putc(s[i]);
+
+  if (console_sinks & CONSOLE_VGA)
+    for (size_t i = 0; i < len; i++)
+      vga_putc(s[i]);
+
+  if (console_sinks & CONSOLE_SERIAL)
+    for (size_t i = 0; i < len; i++) {
+      serial_send(s[i]);
+
+      if (s[i] == '\n')
+        serial_send('\r');
+    }
+}
+
 /**
  * Output a single char.
- * Note: We allow only to put a char on the last line.
  */
 int
 out_char(unsigned value)
 {
-#define BASE(ROW) ((unsigned short *) (0xb8000+ROW*160))
-  static unsigned int col;
-  if (value!='\n')
-    {
-      unsigned short *p = BASE(24)+col;
-      *p = 0x0f00 | value;
-      col++;
-    }
-  if (col>=80 || value == '\n')
-    {
-      col=0;
-      unsigned short *p=BASE(0);
-      memcpy(p, p+80, 24*160);
-      memset(BASE(24), 0, 160);
-    }
+  char c = value;
 
+  out_write(&c, 1);
+  return value;
+}
 
-  serial_send(value);
+/**
+ * Takes console= from the multiboot command line, a comma-separated
+ * list of vga and serial, or none. quiet is short for console=none,
+ * the boot log still gets everything. Serial settings are up to
+ * serial_configure().
+ */
+void
+console_configure(const struct mbi *mbi)
+{
+  if ((mbi->flags & MBI_FLAG_CMDLINE) != 0) {
+    char *last_ptr = NULL;
+    char cmdline_buf[256];
+    char *token;
 
-  if (value == '\n')
-    serial_send('\r');
+    strncpy(cmdline_buf, (const char *)mbi->cmdline, sizeof(cmdline_buf));
+    cmdline_buf[sizeof(cmdline_buf) - 1] = 0;
 
-  return value;
+    for (token = strtok_r(cmdline_buf, " ", &last_ptr);
+         token != NULL;
+         token = strtok_r(NULL, " ", &last_ptr)) {
+      char *sink_ptr = NULL;
+      char *sink;
+
+      if (strcmp(token, "quiet") == 0)
+        console_sinks = 0;
+      if (strncmp(token, "console=", 8) != 0)
+        continue;
+
+      console_sinks = 0;
+      for (sink = strtok_r(token + 8, ",", &sink_ptr);
+           sink != NULL;
+           sink = strtok_r(NULL, ",", &sink_ptr)) {
+        if (strcmp(sink, "vga") == 0)
+          console_sinks |= CONSOLE_VGA;
+        else if (strcmp(sink, "serial") == 0)
+          console_sinks |= CONSOLE_SERIAL;
+      }
+    }
+  }
+
+  serial_configure(mbi);
 }
 
 
@@ -103,8 +357,7 @@ out_char(unsigned value)
 void
 out_string(const char *value)
 {
-  for(; *value; value++)
-    out_char(*value);
+  out_write(value, strlen(value));
 }
 
 /* EOF */
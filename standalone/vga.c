@@ -0,0 +1,121 @@
+/* -*- Mode: C -*- */
+/*
+ * VGA text console.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <vga.h>
+#include <asm.h>
+#include <util.h>
+
+enum {
+  VGA_MEM       = 0xB8000,
+  VGA_COLS      = 80,
+  VGA_ROWS      = 25,
+  VGA_LINE      = VGA_COLS * 2,
+  VGA_BUF_ROWS  = 0x8000 / VGA_LINE, /* rows in the 32K text window */
+
+  CRTC_INDEX    = 0x3D4,
+  CRTC_DATA     = 0x3D5,
+  CRTC_START_HI = 0x0C,
+  CRTC_START_LO = 0x0D,
+};
+
+/* The screen shows rows top to top + VGA_ROWS - 1 of video memory. We
+   scroll by moving the CRTC start address down and only copy the
+   screen back to the start when we run out of memory below it. */
+static bool     ready;
+static unsigned top;
+static unsigned col;
+
+static unsigned short *
+vga_row(unsigned row)
+{
+  return (unsigned short *)(VGA_MEM + row * VGA_LINE);
+}
+
+static unsigned
+crtc_start(void)
+{
+  outb(CRTC_INDEX, CRTC_START_HI);
+  unsigned start = inb(CRTC_DATA) << 8;
+  outb(CRTC_INDEX, CRTC_START_LO);
+  return start | inb(CRTC_DATA);
+}
+
+static void
+crtc_set_start(unsigned start)
+{
+  outb(CRTC_INDEX, CRTC_START_HI);
+  outb(CRTC_DATA, start >> 8);
+  outb(CRTC_INDEX, CRTC_START_LO);
+  outb(CRTC_DATA, start & 0xFF);
+}
+
+/** Continues where an earlier stage left the screen. */
+static void
+vga_init(void)
+{
+  unsigned start = crtc_start();
+
+  if (start % VGA_COLS == 0 && start / VGA_COLS + VGA_ROWS <= VGA_BUF_ROWS)
+    top = start / VGA_COLS;
+  else {
+    top = 0;
+    crtc_set_start(0);
+  }
+  ready = true;
+}
+
+static void
+vga_scroll(void)
+{
+  if (top + VGA_ROWS == VGA_BUF_ROWS) {
+    memcpy(vga_row(0), vga_row(top + 1), (VGA_ROWS - 1) * VGA_LINE);
+    top = 0;
+  } else
+    top++;
+
+  memset(vga_row(top + VGA_ROWS - 1), 0, VGA_LINE);
+  crtc_set_start(top * VGA_COLS);
+}
+
+void
+vga_putc(unsigned c)
+{
+  if (!ready)
+    vga_init();
+
+  if (c != '\n')
+    vga_row(top + VGA_ROWS - 1)[col++] = 0x0f00 | c;
+
+  if (col >= VGA_COLS || c == '\n') {
+    col = 0;
+    vga_scroll();
+  }
+}
+
+void
+vga_handoff(void)
+{
+  if (!ready || top == 0)
+    return;
+
+  /* Row by row, so no single copy overlaps. */
+  for (unsigned row = 0; row < VGA_ROWS; row++)
+    memcpy(vga_row(row), vga_row(top + row), VGA_LINE);
+  top = 0;
+  crtc_set_start(0);
+}
+
+/* EOF */
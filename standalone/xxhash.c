@@ -0,0 +1,161 @@
+/* -*- Mode: C -*- */
+/*
+ * xxHash checksums as used by the LZ4 and zstd frame formats.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <xxhash.h>
+
+static const uint32_t P32_1 = 2654435761U;
+static const uint32_t P32_2 = 2246822519U;
+static const uint32_t P32_3 = 3266489917U;
+static const uint32_t P32_4 = 668265263U;
+static const uint32_t P32_5 = 374761393U;
+
+static const uint64_t P64_1 = 11400714785074694791ULL;
+static const uint64_t P64_2 = 14029467366897019727ULL;
+static const uint64_t P64_3 = 1609587929392839161ULL;
+static const uint64_t P64_4 = 9650029242287828579ULL;
+static const uint64_t P64_5 = 2870177450012600261ULL;
+
+static inline uint32_t
+rotl32(uint32_t x, unsigned r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t
+rotl64(uint64_t x, unsigned r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+  uint32_t v;
+  __builtin_memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+  uint64_t v;
+  __builtin_memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t
+round32(uint32_t acc, uint32_t input)
+{
+  return rotl32(acc + input * P32_2, 13) * P32_1;
+}
+
+static inline uint64_t
+round64(uint64_t acc, uint64_t input)
+{
+  return rotl64(acc + input * P64_2, 31) * P64_1;
+}
+
+static inline uint64_t
+merge64(uint64_t acc, uint64_t v)
+{
+  return (acc ^ round64(0, v)) * P64_1 + P64_4;
+}
+
+uint32_t
+xxh32(const void *data, size_t len, uint32_t seed)
+{
+  const uint8_t *p = data;
+  const uint8_t *end = p + len;
+  uint32_t h;
+
+  if (len >= 16) {
+    uint32_t v1 = seed + P32_1 + P32_2;
+    uint32_t v2 = seed + P32_2;
+    uint32_t v3 = seed;
+    uint32_t v4 = seed - P32_1;
+
+    for (; end - p >= 16; p += 16) {
+      v1 = round32(v1, read32(p));
+      v2 = round32(v2, read32(p + 4));
+      v3 = round32(v3, read32(p + 8));
+      v4 = round32(v4, read32(p + 12));
+    }
+    h = rotl32(v1, 1) + rotl32(v2, 7) + rotl32(v3, 12) + rotl32(v4, 18);
+  } else
+    h = seed + P32_5;
+
+  h += len;
+
+  for (; end - p >= 4; p += 4)
+    h = rotl32(h + read32(p) * P32_3, 17) * P32_4;
+  for (; p < end; p++)
+    h = rotl32(h + *p * P32_5, 11) * P32_1;
+
+  h ^= h >> 15;
+  h *= P32_2;
+  h ^= h >> 13;
+  h *= P32_3;
+  h ^= h >> 16;
+  return h;
+}
+
+uint64_t
+xxh64(const void *data, size_t len, uint64_t seed)
+{
+  const uint8_t *p = data;
+  const uint8_t *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + P64_1 + P64_2;
+    uint64_t v2 = seed + P64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - P64_1;
+
+    for (; end - p >= 32; p += 32) {
+      v1 = round64(v1, read64(p));
+      v2 = round64(v2, read64(p + 8));
+      v3 = round64(v3, read64(p + 16));
+      v4 = round64(v4, read64(p + 24));
+    }
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = merge64(h, v1);
+    h = merge64(h, v2);
+    h = merge64(h, v3);
+    h = merge64(h, v4);
+  } else
+    h = seed + P64_5;
+
+  h += len;
+
+  for (; end - p >= 8; p += 8)
+    h = rotl64(h ^ round64(0, read64(p)), 27) * P64_1 + P64_4;
+  if (end - p >= 4) {
+    h = rotl64(h ^ (read32(p) * P64_1), 23) * P64_2 + P64_3;
+    p += 4;
+  }
+  for (; p < end; p++)
+    h = rotl64(h ^ (*p * P64_5), 11) * P64_1;
+
+  h ^= h >> 33;
+  h *= P64_2;
+  h ^= h >> 29;
+  h *= P64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+/* EOF */
@@ -9,6 +9,9 @@
 #include <util.h>
 #include <serial.h>
 #include <version.h>
+#include <dispatch.h>
+#include <timeline-tools.h>
+#include <bootlog-tools.h>
 
 #define MAX_FIXUPS 32
 
@@ -111,11 +114,17 @@ main(uint32_t magic, struct mbi *mbi)
   if (magic == MBI_MAGIC) {
     if ((mbi->flags & MBI_FLAG_CMDLINE) != 0)
       parse_cmdline((const char *)mbi->cmdline);
+    console_configure(mbi);
+    timeline_init(mbi, "zapp");
+    bootlog_init(mbi);
+    pci_inventory_init(mbi);
   } else {
     printf("Not loaded by Multiboot-compliant loader. Bye.\n");
     return 1;
   }
 
+  cpu_dispatch(mbi);
+
   struct rsdp *rsdp = acpi_get_rsdp();
   struct acpi_table *rsdt = (struct acpi_table *)(rsdp->rsdt);
   printf("RSDT at %p.\n", rsdt);
@@ -192,30 +201,29 @@ main(uint32_t magic, struct mbi *mbi)
       uint16_t bdf =  dev.cfg_address >> 8;
       if (!pci_find_cap(dev.cfg_address, PCI_CAP_ID_EXP)) {
         /* we are not PCIe device, thus we probably sit behind a bridge - scan the root bus*/
-        for (unsigned device=0; device < 32; device++) {
-          uint8_t maxfunc = 0;
-          for (unsigned func = 0; func <= maxfunc; func++) {
-            uint32_t addr = 0x80000000 | device<<11 | func<<8;
-	      
-            if (!maxfunc && pci_read_uint8(addr+14) & 0x80)
-              maxfunc=7;
-
-            /* Is this a bridge and is our bus encoded from it? */
-            if ((((PCI_CLASS_BRIDGE_DEV << 8) | PCI_SUBCLASS_PCI_BRIDGE) == (pci_read_uint32(addr+0x8) >> 16))
-                && (pci_read_uint8(addr + 25) <= (bdf >> 8) && pci_read_uint8(addr + 26) >= (bdf >> 8))) {
-	      /* Check wether we have a PCIe->PCI-X bridge and need to
-		 add an additional RMRR for claimed transactions. */
-	      uint8_t capofs = pci_find_cap(addr, PCI_CAP_ID_EXP);
-	      if (capofs && ((pci_read_uint8(addr + capofs + 2) >> 4) == PCI_EXP_TYPE_PCI_BRIDGE)) {
-		printf("Add additional RMRR for secondary bus of PCIe->PCIX/PCI bridge.\n");
-		add_rmrr_entry(newdmar, additions[i].base, additions[i].size, pci_read_uint8(addr + 25) << 8);
-	      } else {
-		printf("Add RMRR for legacy PCI bridge instead.\n");
-		bdf = (device << 3) | func;
-	      }
-	    }
+        bool root_bridge(uint32_t addr, void *arg) {
+          (void)arg;
+          if ((addr >> 16) & 0xFF)
+            return false;
+
+          /* Is this a bridge and is our bus encoded from it? */
+          if ((((PCI_CLASS_BRIDGE_DEV << 8) | PCI_SUBCLASS_PCI_BRIDGE) == (pci_read_uint32(addr+0x8) >> 16))
+              && (pci_read_uint8(addr + 25) <= (bdf >> 8) && pci_read_uint8(addr + 26) >= (bdf >> 8))) {
+            /* Check wether we have a PCIe->PCI-X bridge and need to
+               add an additional RMRR for claimed transactions. */
+            uint8_t capofs = pci_find_cap(addr, PCI_CAP_ID_EXP);
+            if (capofs && ((pci_read_uint8(addr + capofs + 2) >> 4) == PCI_EXP_TYPE_PCI_BRIDGE)) {
+              printf("Add additional RMRR for secondary bus of PCIe->PCIX/PCI bridge.\n");
+              add_rmrr_entry(newdmar, additions[i].base, additions[i].size, pci_read_uint8(addr + 25) << 8);
+            } else {
+              printf("Add RMRR for legacy PCI bridge instead.\n");
+              bdf = (addr >> 8) & 0xFF;
+            }
           }
+          return false;
         }
+
+        pci_walk(root_bridge, NULL);
       }
       add_rmrr_entry(newdmar, additions[i].base, additions[i].size, bdf);
     }
@@ -0,0 +1,1045 @@
+/* -*- Mode: C -*- */
+/*
+ * Zstandard decoder.
+ *
+ * Decodes zstd frames (RFC 8878) into a buffer that holds the
+ * complete output, which then doubles as the window. All tables live
+ * in a caller provided struct zstd, so several modules can be decoded
+ * at the same time. Dictionaries are not supported.
+ *
+ * This file is part of Morbo.
+ *
+ * Morbo is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * Morbo is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ */
+
+#include <codec.h>
+#include <tinf.h>
+#include <xxhash.h>
+#include <util.h>
+
+enum {
+  ZSTD_MAGIC           = 0xFD2FB528,
+  ZSTD_SKIP_MAGIC      = 0x184D2A50, /* low nibble is user defined */
+
+  ZSTD_BLOCK_RAW       = 0,
+  ZSTD_BLOCK_RLE       = 1,
+  ZSTD_BLOCK_COMPRESSED = 2,
+  ZSTD_BLOCK_MAX       = 128 << 10,
+
+  /* Literals_Block_Type */
+  ZSTD_LIT_RAW         = 0,
+  ZSTD_LIT_RLE         = 1,
+  ZSTD_LIT_COMPRESSED  = 2,
+  ZSTD_LIT_TREELESS    = 3,
+
+  /* Symbol compression modes */
+  ZSTD_MODE_PREDEFINED = 0,
+  ZSTD_MODE_RLE        = 1,
+  ZSTD_MODE_FSE        = 2,
+  ZSTD_MODE_REPEAT     = 3,
+
+  ZSTD_MAX_LL          = 35,
+  ZSTD_MAX_ML          = 52,
+  ZSTD_MAX_OF          = 31,
+  ZSTD_LL_LOG          = 9,
+  ZSTD_ML_LOG          = 9,
+  ZSTD_OF_LOG          = 8,
+
+  FSE_MIN_LOG          = 5,
+  FSE_MAX_LOG          = 9,
+  FSE_MAX_SYMBOLS      = ZSTD_MAX_ML + 1,
+
+  HUF_MAX_BITS         = 11,
+  HUF_WEIGHT_LOG       = 6,
+  HUF_MAX_WEIGHT_SYMBOL = 15,
+};
+
+struct fse_entry {
+  uint16_t base;                /* next state before adding bits */
+  uint8_t  symbol;
+  uint8_t  bits;
+};
+
+struct fse_table {
+  unsigned log;
+  struct fse_entry e[1 << FSE_MAX_LOG];
+};
+
+/** Decoding table entry for sequence codes with the baseline and
+    number of extra bits of the code already looked up. */
+struct seq_entry {
+  uint32_t value;
+  uint16_t base;
+  uint8_t  extra;
+  uint8_t  bits;
+};
+
+struct seq_table {
+  unsigned log;
+  struct seq_entry e[1 << FSE_MAX_LOG];
+};
+
+struct huf_entry {
+  uint8_t symbol;
+  uint8_t bits;
+};
+
+struct huf_table {
+  unsigned bits;
+  struct huf_entry e[1 << HUF_MAX_BITS];
+};
+
+/**
+ * Reader for the backward bit streams that carry Huffman and FSE
+ * coded data. The stream is consumed from its last byte towards its
+ * first; consumed counts the bits taken from the top of container.
+ * Reading past the start pushes consumed beyond 64, which callers
+ * check to detect overflow.
+ */
+struct bits {
+  const uint8_t *start;
+  const uint8_t *ptr;
+  uint64_t       container;
+  unsigned       consumed;
+};
+
+/** Decoder state that is kept across the blocks of a frame. */
+struct zstd {
+  struct seq_table ll, of, ml;
+  struct fse_table fse;
+  struct huf_table huf;
+  bool             ll_valid, of_valid, ml_valid, huf_valid;
+  uint32_t         rep[3];
+  uint8_t          lit[ZSTD_BLOCK_MAX];
+};
+
+_Static_assert(sizeof(struct zstd) <= ZSTD_SCRATCH, "ZSTD_SCRATCH too small");
+
+static const int16_t ll_default[ZSTD_MAX_LL + 1] = {
+  4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+  -1, -1, -1, -1,
+};
+
+static const int16_t ml_default[ZSTD_MAX_ML + 1] = {
+  1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+  -1, -1, -1, -1, -1,
+};
+
+static const int16_t of_default[29] = {
+  1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1,
+};
+
+static const uint32_t ll_base[ZSTD_MAX_LL + 1] = {
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+  16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+  8192, 16384, 32768, 65536,
+};
+
+static const uint8_t ll_bits[ZSTD_MAX_LL + 1] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+  13, 14, 15, 16,
+};
+
+static const uint32_t ml_base[ZSTD_MAX_ML + 1] = {
+  3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+  19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+  35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+  4099, 8195, 16387, 32771, 65539,
+};
+
+static const uint8_t ml_bits[ZSTD_MAX_ML + 1] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+  12, 13, 14, 15, 16,
+};
+
+static inline unsigned
+highbit(uint32_t x)
+{
+  return 31 - __builtin_clz(x);
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+  uint32_t v;
+  __builtin_memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t
+read_le(const uint8_t *p, size_t n)
+{
+  uint64_t v = 0;
+
+  while (n--)
+    v = (v << 8) | p[n];
+  return v;
+}
+
+/** Reads n <= 25 bits at bit offset pos of a forward (LSB first) bit
+    stream. Bits beyond len read as zero. */
+static uint32_t
+fwd_bits(const uint8_t *src, size_t len, size_t pos, unsigned n)
+{
+  size_t byte = pos / 8;
+  uint32_t v = 0;
+
+  for (unsigned i = 0; i < 4 && byte + i < len; i++)
+    v |= (uint32_t)src[byte + i] << (8 * i);
+
+  return (v >> (pos % 8)) & ((1U << n) - 1);
+}
+
+static bool
+bits_init(struct bits *b, const uint8_t *src, size_t len)
+{
+  /* The last byte holds a 1 bit to mark where the stream begins. */
+  if (len == 0 || src[len - 1] == 0)
+    return false;
+
+  b->start = src;
+  if (len >= 8) {
+    b->ptr = src + len - 8;
+    __builtin_memcpy(&b->container, b->ptr, 8);
+    b->consumed = 0;
+  } else {
+    b->ptr = src;
+    b->container = read_le(src, len);
+    b->consumed = (8 - len) * 8;
+  }
+
+  b->consumed += 8 - highbit(src[len - 1]);
+  return true;
+}
+
+/** Refills the container, so that at least 57 bits can be read
+    unless the stream is about to end. */
+static inline __attribute__((always_inline)) void
+bits_reload(struct bits *b)
+{
+  size_t bytes = b->consumed / 8;
+
+  if (b->consumed > 64)
+    return;
+  if (bytes > (size_t)(b->ptr - b->start))
+    bytes = b->ptr - b->start;
+  if (bytes == 0)
+    return;
+
+  b->ptr      -= bytes;
+  b->consumed -= bytes * 8;
+  __builtin_memcpy(&b->container, b->ptr, 8);
+}
+
+/** Returns the next n (0 to 32) bits without consuming them. Once
+    the stream is overrun, the result is garbage. */
+static inline __attribute__((always_inline)) uint32_t
+bits_peek(const struct bits *b, unsigned n)
+{
+  return ((b->container << (b->consumed & 63)) >> 1) >> (63 - n);
+}
+
+static inline __attribute__((always_inline)) uint32_t
+bits_read(struct bits *b, unsigned n)
+{
+  uint32_t v = bits_peek(b, n);
+
+  b->consumed += n;
+  return v;
+}
+
+/** Checks whether a stream was consumed exactly. */
+static inline bool
+bits_done(const struct bits *b)
+{
+  return b->ptr == b->start && b->consumed == 64;
+}
+
+/**
+ * Builds an FSE decoding table from normalized probabilities, where
+ * -1 stands for "less than 1" (RFC 8878, 4.1.1).
+ */
+static bool
+fse_build(struct fse_table *t, const int16_t *norm, unsigned nsym,
+          unsigned log)
+{
+  unsigned size = 1U << log;
+  unsigned high = size - 1;
+  unsigned step = (size >> 1) + (size >> 3) + 3;
+  unsigned pos  = 0;
+  uint16_t next[FSE_MAX_SYMBOLS];
+
+  for (unsigned s = 0; s < nsym; s++)
+    if (norm[s] == -1) {
+      t->e[high--].symbol = s;
+      next[s] = 1;
+    } else
+      next[s] = norm[s];
+
+  for (unsigned s = 0; s < nsym; s++)
+    for (int i = 0; i < norm[s]; i++) {
+      t->e[pos].symbol = s;
+      do
+        pos = (pos + step) & (size - 1);
+      while (pos > high);
+    }
+  if (pos != 0)
+    return false;
+
+  for (unsigned u = 0; u < size; u++) {
+    unsigned state = next[t->e[u].symbol]++;
+    unsigned bits  = log - highbit(state);
+
+    t->e[u].bits = bits;
+    t->e[u].base = (state << bits) - size;
+  }
+
+  t->log = log;
+  return true;
+}
+
+/** Builds a table that always yields symbol without reading bits. */
+static void
+fse_build_rle(struct fse_table *t, uint8_t symbol)
+{
+  t->log = 0;
+  t->e[0].symbol = symbol;
+  t->e[0].bits   = 0;
+  t->e[0].base   = 0;
+}
+
+/**
+ * Reads an FSE table description and builds the table. Returns the
+ * number of bytes consumed or 0 on error.
+ */
+static size_t
+fse_read(struct fse_table *t, const uint8_t *src, size_t len,
+         unsigned max_log, unsigned max_symbol)
+{
+  int16_t  norm[FSE_MAX_SYMBOLS];
+  unsigned log = fwd_bits(src, len, 0, 4) + FSE_MIN_LOG;
+  int      remaining = (1 << log) + 1;
+  int      threshold = 1 << log;
+  unsigned nbits = log + 1;
+  unsigned sym = 0;
+  size_t   pos = 4;
+  bool     prev0 = false;
+
+  if (log > max_log)
+    return 0;
+
+  while (remaining > 1 && sym <= max_symbol) {
+    if (prev0) {
+      /* Runs of zero probabilities are coded in 2-bit repeat
+         counts, where 3 means that another count follows. */
+      unsigned repeat;
+      do {
+        repeat = fwd_bits(src, len, pos, 2);
+        pos += 2;
+        for (unsigned i = 0; i < repeat; i++) {
+          if (sym > max_symbol)
+            return 0;
+          norm[sym++] = 0;
+        }
+      } while (repeat == 3);
+      if (sym > max_symbol)
+        return 0;
+    }
+
+    int max = 2 * threshold - 1 - remaining;
+    int count = fwd_bits(src, len, pos, nbits);
+
+    if ((count & (threshold - 1)) < max) {
+      count &= threshold - 1;
+      pos += nbits - 1;
+    } else {
+      if (count >= threshold)
+        count -= max;
+      pos += nbits;
+    }
+
+    count--;
+    remaining -= count < 0 ? -count : count;
+    norm[sym++] = count;
+    prev0 = count == 0;
+
+    if (remaining < 1)
+      return 0;
+    while (remaining < threshold) {
+      nbits--;
+      threshold >>= 1;
+    }
+  }
+
+  if (remaining != 1 || pos > len * 8 || !fse_build(t, norm, sym, log))
+    return 0;
+
+  return (pos + 7) / 8;
+}
+
+/**
+ * Reads the Huffman tree description of a compressed literals
+ * section and builds the decoding table in z->huf (RFC 8878, 4.2.1).
+ * Returns the number of bytes consumed or 0 on error.
+ */
+static size_t
+huf_read(struct zstd *z, const uint8_t *src, size_t len)
+{
+  struct huf_table *h = &z->huf;
+  uint8_t  w[256];
+  unsigned n = 0;
+  size_t   used;
+
+  if (len < 1)
+    return 0;
+
+  if (src[0] >= 128) {
+    /* Weights stored directly as 4-bit values. */
+    n = src[0] - 127;
+    used = 1 + (n + 1) / 2;
+    if (used > len)
+      return 0;
+    for (unsigned i = 0; i < n; i++)
+      w[i] = (src[1 + i / 2] >> (i & 1 ? 0 : 4)) & 0xF;
+  } else {
+    /* FSE compressed weights, decoded with two interleaved states. */
+    struct fse_table *t = &z->fse;
+    struct bits b;
+    size_t hlen;
+
+    used = 1 + src[0];
+    if (used > len)
+      return 0;
+    hlen = fse_read(t, src + 1, src[0], HUF_WEIGHT_LOG, HUF_MAX_WEIGHT_SYMBOL);
+    if (hlen == 0 || !bits_init(&b, src + 1 + hlen, src[0] - hlen))
+      return 0;
+
+    unsigned state[2];
+    state[0] = bits_read(&b, t->log);
+    state[1] = bits_read(&b, t->log);
+
+    for (unsigned i = 0;; i ^= 1) {
+      const struct fse_entry *e = &t->e[state[i]];
+
+      /* At most 255 weights, the last one after the overflow. */
+      if (n >= 254)
+        return 0;
+      w[n++] = e->symbol;
+      state[i] = e->base + bits_read(&b, e->bits);
+      bits_reload(&b);
+
+      if (b.consumed > 64) {
+        w[n++] = t->e[state[i ^ 1]].symbol;
+        break;
+      }
+    }
+  }
+
+  /* The weight of the last symbol is implied: it completes the sum
+     of all weights to a power of two. */
+  unsigned count[HUF_MAX_BITS + 2] = { 0 };
+  uint32_t total = 0;
+
+  for (unsigned i = 0; i < n; i++) {
+    if (w[i] > HUF_MAX_BITS)
+      return 0;
+    count[w[i]]++;
+    if (w[i])
+      total += 1U << (w[i] - 1);
+  }
+  if (total == 0)
+    return 0;
+
+  unsigned maxbits = highbit(total) + 1;
+  uint32_t rest = (1U << maxbits) - total;
+
+  if (maxbits > HUF_MAX_BITS || (rest & (rest - 1)))
+    return 0;
+  w[n] = highbit(rest) + 1;
+  count[w[n]]++;
+  n++;
+
+  /* Codes are canonical: longer codes (smaller weights) come first,
+     ties are broken by symbol value. */
+  uint32_t start[HUF_MAX_BITS + 2];
+  uint32_t pos = 0;
+
+  for (unsigned i = 1; i <= maxbits; i++) {
+    start[i] = pos;
+    pos += count[i] << (i - 1);
+  }
+
+  for (unsigned s = 0; s < n; s++) {
+    if (w[s] == 0)
+      continue;
+
+    struct huf_entry e = { .symbol = s, .bits = maxbits + 1 - w[s] };
+    uint32_t fill = 1U << (w[s] - 1);
+
+    for (uint32_t u = 0; u < fill; u++)
+      h->e[start[w[s]] + u] = e;
+    start[w[s]] += fill;
+  }
+
+  h->bits = maxbits;
+  return used;
+}
+
+static inline __attribute__((always_inline)) uint8_t
+huf_symbol(const struct huf_table *h, struct bits *b)
+{
+  const struct huf_entry *e = &h->e[bits_peek(b, h->bits)];
+
+  b->consumed += e->bits;
+  return e->symbol;
+}
+
+/** Decodes n literals from one Huffman coded stream. */
+static bool
+huf_decode(const struct huf_table *h, uint8_t *dst, size_t n,
+           const uint8_t *src, size_t len)
+{
+  struct bits b;
+
+  if (!bits_init(&b, src, len))
+    return false;
+
+  /* Four symbols of at most 11 bits fit into one refill. */
+  for (size_t i = 0; i < n; i++) {
+    if ((i & 3) == 0)
+      bits_reload(&b);
+    dst[i] = huf_symbol(h, &b);
+  }
+
+  bits_reload(&b);
+  return bits_done(&b);
+}
+
+/**
+ * Decodes the four streams of a literals section, each of which
+ * holds a quarter of them. The streams are decoded in lockstep, so
+ * their table lookups can overlap.
+ */
+static bool
+huf_decode4(const struct huf_table *h, uint8_t *dst, size_t n,
+            const uint8_t *src, const size_t *len)
+{
+  size_t   seg = (n + 3) / 4;
+  struct   bits b[4];
+  uint8_t *op[4];
+  uint8_t *oend[4];
+
+  for (unsigned i = 0; i < 4; i++) {
+    if (!bits_init(&b[i], src, len[i]))
+      return false;
+    src    += len[i];
+    op[i]   = dst + i * seg;
+    oend[i] = i < 3 ? op[i] + seg : dst + n;
+  }
+
+  /* The last stream is the shortest. */
+  while (oend[3] - op[3] >= 4) {
+    for (unsigned i = 0; i < 4; i++)
+      bits_reload(&b[i]);
+    for (unsigned k = 0; k < 4; k++)
+      for (unsigned i = 0; i < 4; i++)
+        *op[i]++ = huf_symbol(h, &b[i]);
+  }
+
+  for (unsigned i = 0; i < 4; i++) {
+    for (size_t k = 0; op[i] < oend[i]; k++) {
+      if ((k & 3) == 0)
+        bits_reload(&b[i]);
+      *op[i]++ = huf_symbol(h, &b[i]);
+    }
+
+    bits_reload(&b[i]);
+    if (!bits_done(&b[i]))
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Decodes the literals section of a compressed block. Raw literals
+ * are used in place, everything else ends up in z->lit. Returns
+ * the number of bytes consumed or 0 on error.
+ */
+static size_t
+zstd_literals(struct zstd *z, const uint8_t *src, size_t len,
+              const uint8_t **lit, size_t *nlit)
+{
+  unsigned type, format;
+  size_t hlen, regen;
+
+  if (len < 1)
+    return 0;
+
+  type   = src[0] & 3;
+  format = (src[0] >> 2) & 3;
+
+  if (type == ZSTD_LIT_RAW || type == ZSTD_LIT_RLE) {
+    /* Size_Format 0 and 2 use a 5 bit size, 1 and 3 one of 12 and
+       20 bits. */
+    hlen = (format & 1) ? 2 + (format >> 1) : 1;
+    if (len < hlen)
+      return 0;
+    regen = read_le(src, hlen) >> ((format & 1) ? 4 : 3);
+    if (regen > ZSTD_BLOCK_MAX)
+      return 0;
+
+    if (type == ZSTD_LIT_RAW) {
+      if (regen > len - hlen)
+        return 0;
+      *lit  = src + hlen;
+      *nlit = regen;
+      return hlen + regen;
+    }
+
+    if (len < hlen + 1)
+      return 0;
+    memset(z->lit, src[hlen], regen);
+    *lit  = z->lit;
+    *nlit = regen;
+    return hlen + 1;
+  }
+
+  /* Huffman coded, with one stream for format 0 and four otherwise. */
+  unsigned sbits = format < 2 ? 10 : 6 + format * 4;
+  size_t   csize;
+
+  hlen = format < 2 ? 3 : format + 2;
+  if (len < hlen)
+    return 0;
+
+  uint64_t h = read_le(src, hlen) >> 4;
+  regen = h & ((1U << sbits) - 1);
+  csize = (h >> sbits) & ((1U << sbits) - 1);
+  if (regen > ZSTD_BLOCK_MAX || csize > len - hlen)
+    return 0;
+
+  const uint8_t *p = src + hlen;
+  size_t plen = csize;
+
+  if (type == ZSTD_LIT_COMPRESSED) {
+    size_t tlen = huf_read(z, p, plen);
+    if (tlen == 0)
+      return 0;
+    p += tlen;
+    plen -= tlen;
+    z->huf_valid = true;
+  } else if (!z->huf_valid)
+    return 0;
+
+  if (format == 0) {
+    if (!huf_decode(&z->huf, z->lit, regen, p, plen))
+      return 0;
+  } else {
+    size_t seg = (regen + 3) / 4;
+    size_t slen[4];
+
+    if (plen < 6 || seg * 3 > regen)
+      return 0;
+    slen[0] = p[0] | (p[1] << 8);
+    slen[1] = p[2] | (p[3] << 8);
+    slen[2] = p[4] | (p[5] << 8);
+    if (slen[0] + slen[1] + slen[2] > plen - 6)
+      return 0;
+    slen[3] = plen - 6 - slen[0] - slen[1] - slen[2];
+
+    if (!huf_decode4(&z->huf, z->lit, regen, p + 6, slen))
+      return 0;
+  }
+
+  *lit  = z->lit;
+  *nlit = regen;
+  return hlen + csize;
+}
+
+/**
+ * Sets up the decoding table for one of the sequence codes according
+ * to its compression mode. Codes translate into value[code] plus as
+ * many extra bits as given in extra[code], or 1 << code plus code
+ * extra bits if value is NULL (for offsets). Returns the number of
+ * bytes consumed in *used.
+ */
+static bool
+zstd_table(struct zstd *z, struct seq_table *t, bool *valid, unsigned mode,
+           const uint8_t *src, size_t len, size_t *used,
+           const int16_t *predef, unsigned predef_len, unsigned predef_log,
+           unsigned max_log, unsigned max_symbol,
+           const uint32_t *value, const uint8_t *extra)
+{
+  struct fse_table *f = &z->fse;
+
+  *used = 0;
+
+  switch (mode) {
+  case ZSTD_MODE_PREDEFINED:
+    fse_build(f, predef, predef_len, predef_log);
+    break;
+  case ZSTD_MODE_RLE:
+    if (len < 1 || src[0] > max_symbol)
+      return false;
+    fse_build_rle(f, src[0]);
+    *used = 1;
+    break;
+  case ZSTD_MODE_FSE:
+    *used = fse_read(f, src, len, max_log, max_symbol);
+    if (*used == 0)
+      return false;
+    break;
+  case ZSTD_MODE_REPEAT:
+    return *valid;
+  }
+
+  for (unsigned u = 0; u < (1U << f->log); u++) {
+    unsigned code = f->e[u].symbol;
+
+    t->e[u].value = value ? value[code] : 1U << code;
+    t->e[u].extra = value ? extra[code] : code;
+    t->e[u].base  = f->e[u].base;
+    t->e[u].bits  = f->e[u].bits;
+  }
+
+  t->log = f->log;
+  *valid = true;
+  return true;
+}
+
+/**
+ * Decodes the sequences section and executes the sequences, which
+ * interleave the literals with matches. Output goes to out + *pos
+ * and may not grow beyond olen. Matches may reach back to fstart.
+ */
+static bool
+zstd_sequences(struct zstd *z, const uint8_t *src, size_t len,
+               const uint8_t *lit, size_t nlit, uint8_t *out, size_t fstart,
+               size_t *pos, size_t olen)
+{
+  const uint8_t *lend = lit + nlit;
+  uint8_t *op    = out + *pos;
+  uint8_t *oend  = out + olen;
+  uint8_t *start = out + fstart;
+  size_t nseq, p = 1;
+
+  if (len < 1)
+    return false;
+
+  nseq = src[0];
+  if (nseq == 255) {
+    if (len < 3)
+      return false;
+    nseq = 0x7F00 + src[1] + (src[2] << 8);
+    p = 3;
+  } else if (nseq >= 128) {
+    if (len < 2)
+      return false;
+    nseq = ((nseq - 128) << 8) + src[1];
+    p = 2;
+  }
+
+  if (nseq > 0) {
+    struct bits b;
+    size_t used;
+
+    if (p >= len || (src[p] & 3))
+      return false;
+    unsigned modes = src[p++];
+
+    if (!zstd_table(z, &z->ll, &z->ll_valid, modes >> 6, src + p, len - p,
+                    &used, ll_default, ZSTD_MAX_LL + 1, 6,
+                    ZSTD_LL_LOG, ZSTD_MAX_LL, ll_base, ll_bits))
+      return false;
+    p += used;
+    if (!zstd_table(z, &z->of, &z->of_valid, (modes >> 4) & 3, src + p,
+                    len - p, &used, of_default,
+                    sizeof(of_default) / sizeof(of_default[0]), 5,
+                    ZSTD_OF_LOG, ZSTD_MAX_OF, NULL, NULL))
+      return false;
+    p += used;
+    if (!zstd_table(z, &z->ml, &z->ml_valid, (modes >> 2) & 3, src + p,
+                    len - p, &used, ml_default, ZSTD_MAX_ML + 1, 6,
+                    ZSTD_ML_LOG, ZSTD_MAX_ML, ml_base, ml_bits))
+      return false;
+    p += used;
+
+    if (!bits_init(&b, src + p, len - p))
+      return false;
+
+    unsigned ll_state = bits_read(&b, z->ll.log);
+    unsigned of_state = bits_read(&b, z->of.log);
+    unsigned ml_state = bits_read(&b, z->ml.log);
+
+    while (nseq--) {
+      const struct seq_entry *lle = &z->ll.e[ll_state];
+      const struct seq_entry *ofe = &z->of.e[of_state];
+      const struct seq_entry *mle = &z->ml.e[ml_state];
+      uint32_t offset, ofv;
+      size_t   ll, ml;
+
+      /* A sequence takes up to 63 extra bits and 26 bits of state
+         updates, more than one refill provides. Refill again only
+         when the bits left might not suffice. */
+      bits_reload(&b);
+      ofv = ofe->value + bits_read(&b, ofe->extra);
+      if (b.consumed > 64 - 32)
+        bits_reload(&b);
+      ml = mle->value + bits_read(&b, mle->extra);
+      ll = lle->value + bits_read(&b, lle->extra);
+
+      if (ofv > 3) {
+        offset = ofv - 3;
+        z->rep[2] = z->rep[1];
+        z->rep[1] = z->rep[0];
+        z->rep[0] = offset;
+      } else {
+        /* Repeat offsets shift by one, if there are no literals. */
+        unsigned idx = ofv - 1 + (ll == 0);
+
+        if (idx == 0)
+          offset = z->rep[0];
+        else {
+          offset = idx == 3 ? z->rep[0] - 1 : z->rep[idx];
+          if (idx != 1)
+            z->rep[2] = z->rep[1];
+          z->rep[1] = z->rep[0];
+          z->rep[0] = offset;
+        }
+      }
+
+      if (nseq) {
+        if (b.consumed > 64 - 26)
+          bits_reload(&b);
+        ll_state = lle->base + bits_read(&b, lle->bits);
+        ml_state = mle->base + bits_read(&b, mle->bits);
+        of_state = ofe->base + bits_read(&b, ofe->bits);
+      }
+
+      if (ll > (size_t)(lend - lit) || ll + ml > (size_t)(oend - op) ||
+          offset == 0 || offset > (size_t)(op + ll - start))
+        return false;
+
+      /* Away from the ends of the buffers, copy in whole words past
+         the end of literals and match. */
+      if ((size_t)(lend - lit) >= ll + 8 &&
+          (size_t)(oend - op) >= ll + ml + 8) {
+        codec_copy_wild(op, lit, ll);
+        op  += ll;
+        lit += ll;
+        if (offset >= 8)
+          codec_copy_wild(op, op - offset, ml);
+        else
+          tinf_copy_match(op, offset, ml);
+      } else {
+        codec_copy(op, lit, ll);
+        op  += ll;
+        lit += ll;
+        tinf_copy_match(op, offset, ml);
+      }
+      op += ml;
+    }
+
+    bits_reload(&b);
+    if (!bits_done(&b))
+      return false;
+  }
+
+  /* Literals after the last sequence. */
+  if ((size_t)(lend - lit) > (size_t)(oend - op))
+    return false;
+  memcpy(op, lit, lend - lit);
+  op += lend - lit;
+
+  *pos = op - out;
+  return true;
+}
+
+static bool
+zstd_block(struct zstd *z, const uint8_t *src, size_t len, uint8_t *out,
+           size_t fstart, size_t *pos, size_t olen)
+{
+  const uint8_t *lit;
+  size_t nlit;
+  size_t used = zstd_literals(z, src, len, &lit, &nlit);
+
+  return used != 0 &&
+    zstd_sequences(z, src + used, len - used, lit, nlit, out, fstart, pos,
+                   olen);
+}
+
+struct zstd_frame {
+  size_t   header_len;
+  uint64_t content_size;
+  bool     has_size;
+  bool     checksum;
+};
+
+static bool
+zstd_header(const uint8_t *src, size_t len, struct zstd_frame *f)
+{
+  static const uint8_t did_len[4] = { 0, 1, 2, 4 };
+  static const uint8_t fcs_len[4] = { 0, 2, 4, 8 };
+
+  if (len < 5 || read32(src) != ZSTD_MAGIC)
+    return false;
+
+  uint8_t fhd    = src[4];
+  bool    single = fhd & 0x20;
+  size_t  pos    = single ? 5 : 6; /* skip Window_Descriptor */
+  size_t  dlen   = did_len[fhd & 3];
+  size_t  slen   = (fhd >> 6) ? fcs_len[fhd >> 6] : single;
+
+  if ((fhd & 0x08) || len < pos + dlen + slen)
+    return false;
+
+  /* Frames that need a dictionary cannot be decoded. */
+  if (read_le(src + pos, dlen) != 0)
+    return false;
+  pos += dlen;
+
+  f->content_size = read_le(src + pos, slen) + (slen == 2 ? 256 : 0);
+  f->has_size     = slen != 0;
+  f->checksum     = fhd & 0x04;
+  f->header_len   = pos + slen;
+  return true;
+}
+
+/**
+ * Walks the frames in src and decodes them to out, which holds olen
+ * bytes, using the tables in z. If out is NULL, only the content sizes from the frame
+ * headers are summed up. The decoded length is returned in *out_len.
+ * Returns false on malformed input.
+ */
+static bool
+zstd_frames(struct zstd *z, const uint8_t *src, size_t len, uint8_t *out,
+            size_t olen, size_t *out_len)
+{
+  size_t pos = 0;
+  size_t op  = 0;
+
+  while (pos < len) {
+    const uint8_t *frame = src + pos;
+    size_t left = len - pos;
+    struct zstd_frame f;
+
+    if (left < 8)
+      return false;
+
+    if ((read32(frame) & ~0xFU) == ZSTD_SKIP_MAGIC) {
+      size_t skip = read32(frame + 4);
+      if (skip > left - 8)
+        return false;
+      pos += 8 + skip;
+      continue;
+    }
+
+    if (!zstd_header(frame, left, &f))
+      return false;
+    pos += f.header_len;
+
+    size_t fstart = op;
+    bool last;
+
+    if (out) {
+      z->rep[0] = 1;
+      z->rep[1] = 4;
+      z->rep[2] = 8;
+      z->ll_valid = z->of_valid = z->ml_valid = z->huf_valid = false;
+    }
+
+    do {
+      if (len - pos < 3)
+        return false;
+
+      uint32_t bh   = read_le(src + pos, 3);
+      unsigned type = (bh >> 1) & 3;
+      size_t   n    = bh >> 3;
+      size_t   in   = type == ZSTD_BLOCK_RLE ? 1 : n;
+
+      last = bh & 1;
+      pos += 3;
+      if (n > ZSTD_BLOCK_MAX || in > len - pos)
+        return false;
+
+      if (out)
+        switch (type) {
+        case ZSTD_BLOCK_RAW:
+          if (n > olen - op)
+            return false;
+          memcpy(out + op, src + pos, n);
+          op += n;
+          break;
+        case ZSTD_BLOCK_RLE:
+          if (n > olen - op)
+            return false;
+          memset(out + op, src[pos], n);
+          op += n;
+          break;
+        case ZSTD_BLOCK_COMPRESSED:
+          if (!zstd_block(z, src + pos, n, out, fstart, &op, olen))
+            return false;
+          break;
+        default:
+          return false;
+        }
+
+      pos += in;
+    } while (!last);
+
+    if (out) {
+      if (f.has_size && op - fstart != f.content_size)
+        return false;
+    } else {
+      /* Without a content size, we would have to decode the frame to
+         know its size. zstd writes it unless compressing a pipe. */
+      if (!f.has_size || f.content_size > olen - op)
+        return false;
+      op += f.content_size;
+    }
+
+    if (f.checksum) {
+      if (len - pos < 4 ||
+          (out && (uint32_t)xxh64(out + fstart, op - fstart, 0) !=
+           read32(src + pos)))
+        return false;
+      pos += 4;
+    }
+  }
+
+  *out_len = op;
+  return pos == len;
+}
+
+bool
+zstd_size(const void *src, size_t len, size_t *out_len)
+{
+  return zstd_frames(NULL, src, len, NULL, ~(size_t)0, out_len);
+}
+
+bool
+zstd_decode(void *dst, size_t dst_len, const void *src, size_t len,
+            void *scratch)
+{
+  size_t out_len;
+
+  return zstd_frames(scratch, src, len, dst, dst_len, &out_len) &&
+    out_len == dst_len;
+}
+
+/* EOF */
@@ -5,7 +5,10 @@
 #include <cinttypes>
 #include <cstdint>
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
 
+#include <endian.h>
 #include <getopt.h>
 #include <unistd.h>
 
@@ -15,12 +18,15 @@
 #include <libraw1394/csr.h>
 
 #include <ohci-constants.h>
+#include <morbo.h>
+#include <bootlog.h>
 
 #ifndef NO_FW_SCREEN
 # include <SDL/SDL.h>
 #endif	// NO_FW_SCREEN
 
-static char usage_peek[] = "Usage: %s [-p port] [-b blocksize] guid/nodeno address length\n";
+static char usage_peek[] = "Usage: %s [-p port] [-b blocksize] guid/nodeno address length\n"
+                           "       %s -t [-p port] [-b blocksize] guid/nodeno [address]\n";
 static char usage_poke[] = "Usage: %s [-p port] [-b blocksize] guid/nodeno address\n";
 static char usage_screen[] = "Usage: %s [-p port] [-b blocksize] guid/nodeno address width height depth\n";
 
@@ -34,6 +40,116 @@ const char *strippath(char *name)
     return s+1;
 }
 
+/* Returns the boot log address from Morbo's info leaf in the
+   ConfigROM or 0. */
+static uint64_t
+find_bootlog(raw1394handle_t fw_handle, nodeid_t target)
+{
+  quadlet_t crom[32];
+
+  for (unsigned i = 0; i < 32; i++) {
+    int res = raw1394_read(fw_handle, target, CSR_REGISTER_BASE + CSR_CONFIG_ROM + 4*i,
+			   4, &crom[i]);
+    if (res != 0) { perror("read config rom"); return 0; }
+    crom[i] = ntohl(crom[i]);
+  }
+
+  unsigned root = (crom[0] >> 24) + 1;
+  if (root >= 32)
+    return 0;
+
+  for (unsigned i = root + 1; i <= root + (crom[root] >> 16) && i < 32; i++) {
+    if ((crom[i] >> 24) != MORBO_INFO_DIR)
+      continue;
+
+    /* Older Morbos have only the MBI pointer in the leaf. */
+    unsigned leaf = i + (crom[i] & 0xFFFFFF);
+    if (leaf + 2 >= 32 || (crom[leaf] >> 16) < 2)
+      return 0;
+    return crom[leaf + 2];
+  }
+
+  return 0;
+}
+
+static int
+read_retry(raw1394handle_t fw_handle, nodeid_t target, uint64_t address,
+	   size_t size, void *buf)
+{
+  int tries = 5;
+  int res;
+
+  while ((res = raw1394_read(fw_handle, target, address, size,
+			     reinterpret_cast<quadlet_t *>(buf))) != 0 && tries-- > 0)
+    ;
+  return res;
+}
+
+/* Follows the boot log ring at address like tail -f. Reads only the
+   header while nothing happens. */
+static int
+tail_bootlog(raw1394handle_t fw_handle, nodeid_t target, uint64_t address,
+	     unsigned step)
+{
+  struct bootlog log;
+  char buf[step];
+
+  if (read_retry(fw_handle, target, address, sizeof(log), &log) != 0) {
+    perror("read boot log"); return EXIT_FAILURE;
+  }
+
+  uint32_t size = le32toh(log.size);
+  uint32_t head = le32toh(log.head);
+
+  if (le32toh(log.magic) != BOOTLOG_MAGIC || size == 0 || (size & (size - 1)) != 0) {
+    fprintf(stderr, "No boot log at %#" PRIx64 ".\n", address);
+    return EXIT_FAILURE;
+  }
+
+  /* Start with what is still in the ring. */
+  uint32_t pos = (head > size) ? head - size : 0;
+
+  while (true) {
+    if (read_retry(fw_handle, target, address + offsetof(struct bootlog, head),
+		   sizeof(head), &head) != 0) {
+      perror("read head"); return EXIT_FAILURE;
+    }
+    head = le32toh(head);
+
+    if (head - pos > size) {
+      fprintf(stderr, "\n[%u bytes lost]\n", head - pos - size);
+      pos = head - size;
+    }
+
+    while (pos != head) {
+      uint32_t off = pos & (size - 1);
+      size_t   len = std::min<size_t>(std::min(head - pos, size - off), step);
+
+      if (read_retry(fw_handle, target, address + offsetof(struct bootlog, data) + off,
+		     len, buf) != 0) {
+	perror("read data"); return EXIT_FAILURE;
+      }
+
+      /* Only keep what was not overwritten while we read it. */
+      uint32_t now;
+      if (read_retry(fw_handle, target, address + offsetof(struct bootlog, head),
+		     sizeof(now), &now) != 0) {
+	perror("read head"); return EXIT_FAILURE;
+      }
+      if (le32toh(now) - pos > size)
+	break;
+
+      if (write(STDOUT_FILENO, buf, len) < 0) {
+	perror("write");
+	return EXIT_FAILURE;
+      }
+      pos += len;
+    }
+
+    usleep(100000);
+  }
+}
+
 int
 main(int argc, char **argv)
 {
@@ -41,6 +157,7 @@ main(int argc, char **argv)
   int opt;
   unsigned port = 0;
   unsigned step = 128;
+  bool tail = false;
 
   enum { INVALID, PEEK, POKE, SCREEN } mode = INVALID;
 
@@ -60,7 +177,7 @@ main(int argc, char **argv)
     return EXIT_FAILURE;
   }
 
-  while ((opt = getopt(argc, argv, "p:b:")) != -1) {
+  while ((opt = getopt(argc, argv, "p:b:t")) != -1) {
     switch (opt) {
     case 'p':
       port = strtoul(optarg, 0, 0);
@@ -68,25 +185,30 @@ main(int argc, char **argv)
     case 'b':
       step = strtoul(optarg, 0, 0);
       break;
+    case 't':
+      if (mode != PEEK) goto print_usage;
+      tail = true;
+      break;
     default:
       goto print_usage;
     }
   }
 
-  if (((mode == PEEK) && (argc - optind) != 3) ||
+  if (((mode == PEEK) && !tail && (argc - optind) != 3) ||
+      ((mode == PEEK) && tail && (argc - optind) != 1 && (argc - optind) != 2) ||
       ((mode == POKE) && (argc - optind) != 2) ||
       ((mode == SCREEN) && (argc - optind) != 5)) {
   print_usage:
     fprintf(stderr, (mode == PEEK) ? usage_peek : 
-                    (mode == POKE) ? usage_poke : usage_screen, name);
+                    (mode == POKE) ? usage_poke : usage_screen, name, name);
     return EXIT_FAILURE;
   }
 
   uint64_t guid    = strtoull(argv[optind],     NULL, 0);
-  uint64_t address = strtoull(argv[optind + 1], NULL, 0);
+  uint64_t address = (optind + 1 < argc) ? strtoull(argv[optind + 1], NULL, 0) : 0;
   uint64_t length;
   uint32_t width, height, depth;
-  if (mode == PEEK) length = strtoull(argv[optind + 2], NULL, 0);
+  if (mode == PEEK && !tail) length = strtoull(argv[optind + 2], NULL, 0);
   if (mode == SCREEN) {
     width  = strtoul(argv[optind + 2], NULL, 0);
     height = strtoul(argv[optind + 3], NULL, 0);
@@ -131,6 +253,16 @@ main(int argc, char **argv)
     ;
   }
 
+  if (tail) {
+    if (address == 0)
+      address = find_bootlog(fw_handle, target);
+    if (address == 0) {
+      fprintf(stderr, "Target publishes no boot log.\n");
+      return EXIT_FAILURE;
+    }
+    return tail_bootlog(fw_handle, target, address, step);
+  }
+
   quadlet_t buf[step/sizeof(quadlet_t)];
 
   switch (mode) {